@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+#include "hal.h"
+#include "hal_sim.h"
+#include "host_test.h"
+#include "crash_log.h"
+#include "log_ring.h"
+#include "syslog.h"
+#include "timer_wheel.h"
+
+/* The cost of one ESP_LOGI through syslog, per call:
+ *
+ *   console only     esp_log_write() with no syslog hook, the floor
+ *   before           the hook as it was before messages were formatted
+ *                    in place: task name copied, the format copied to
+ *                    strip colour codes, the header by snprintf()
+ *   after            syslog_vprintf() as it is: per-tag filter, prefix
+ *                    parsing, cached header, in place formatting, and
+ *                    the crash log copy
+ *   after, filtered  a message below its tag's level
+ *   crash log copy   crash_log_add() alone, the share of "after" that
+ *                    "before" had no counterpart for
+ *
+ * The network stays down, so both queue into a full ring that drops its
+ * oldest message for each new one.  The console itself is a no-op. */
+
+#define BENCH_CALLS 1000000
+#define RING_SIZE 8192			/* as syslog.c */
+#define MAX_DATAGRAM 1024
+
+static int console(const char *fmt, va_list args) {
+  return 0;
+}
+
+/****************************************************************************
+ * Before
+ */
+
+static uint64_t old_ring_buf[RING_SIZE / sizeof(uint64_t)];
+static log_ring_t old_ring;
+static uint32_t old_msgid = 1;
+static const char *old_hostname = "ESP32";
+
+static void old_compose(uint8_t facility, uint8_t severity, const char *tag,
+			const char *fmt, va_list argptr) {
+  char fmt_tmp[256];
+  log_ring_slot_t slot;
+  char *p, *end;
+  uint32_t msgid;
+
+  if (!log_ring_reserve(&old_ring, MAX_DATAGRAM, &slot)) return;
+  msgid = __atomic_fetch_add(&old_msgid, 1, __ATOMIC_RELAXED);
+  p = (char *)slot.data;
+  end = p + MAX_DATAGRAM;
+  {
+    int i, j;
+    bool in_escape_code = false;
+    for (i = 0, j = 0; fmt[i] != 0; i++) {
+      if (in_escape_code) {
+	if (fmt[i] == 'm') in_escape_code = false;
+      }else{
+	if (fmt[i] == 0x1B) {
+	  in_escape_code = true;
+	  continue;
+	}
+	fmt_tmp[j] = fmt[i];
+	j++;
+      }
+    }
+    fmt_tmp[j] = 0;
+  }
+  p += snprintf(p, end - p, "<%d>1 ", facility * 8 + severity);
+  p += snprintf(p, end - p, "- ");
+  p += snprintf(p, end - p, "%s %s - %u ", old_hostname, tag, msgid);
+  p += vsnprintf(p, end - p, fmt_tmp, argptr);
+  if (p > end - 1) p = end - 1;
+  log_ring_commit(&old_ring, &slot, p - (char *)slot.data);
+}
+
+static int old_vprintf(const char *msg, va_list arglist) {
+  va_list syslog_args;
+  char task_name[16];
+
+  strncpy(task_name, hal_task_name(), 16);
+  task_name[15] = 0;
+  if (strncmp(task_name, "tiT", 16) != 0) {
+    va_copy(syslog_args, arglist);
+    old_compose(1, 6, "TAG", msg, syslog_args);
+    va_end(syslog_args);
+  }
+  return console(msg, arglist);
+}
+
+/****************************************************************************/
+
+static void bench(const char *name, const char *tag) {
+  int64_t start = test_now_ns(), ns;
+
+  for (int i = 0; i < BENCH_CALLS; i++)
+    ESP_LOGI(tag, "door %s, %d ms after the edge", "OPEN", i);
+  ns = test_now_ns() - start;
+  printf("syslog %-26s %6.1f ns per log call\n", name, (double)ns / BENCH_CALLS);
+}
+
+static void bench_crash_log(void) {
+  static const char text[] = "I (1234) bench: door OPEN, 1234 ms after the edge";
+  int64_t start = test_now_ns(), ns;
+
+  for (int i = 0; i < BENCH_CALLS; i++)
+    crash_log_add(CRASH_LOG_TEXT, 6, "bench", i, text, sizeof(text) - 1);
+  ns = test_now_ns() - start;
+  printf("syslog %-26s %6.1f ns per log call\n", "crash log copy", (double)ns / BENCH_CALLS);
+}
+
+int main(void) {
+  hal_sim_init();
+  timer_wheel_init(0);
+  esp_log_set_vprintf(console);
+  bench("console only", "bench");
+
+  log_ring_init(&old_ring, old_ring_buf, sizeof(old_ring_buf), LOG_RING_DROP_OLDEST);
+  esp_log_set_vprintf(old_vprintf);
+  bench("before", "bench");
+
+  esp_log_set_vprintf(console);
+  syslog_init();
+  syslog_set_overflow_policy(LOG_RING_DROP_OLDEST);
+  syslog_set_level("quiet", SYSLOG_PRIO_WARNING);
+  bench("after", "bench");
+  bench("after, filtered", "quiet");
+  bench_crash_log();
+  return 0;
+}
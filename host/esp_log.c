@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include "esp_log.h"
+#include "hal.h"
+
+/* Host implementation of the esp_log.h subset the modules use.  Unlike
+ * ESP-IDF there is a single level for all tags. */
+
+static vprintf_like_t log_vprintf = vprintf;
+static esp_log_level_t log_level = ESP_LOG_INFO;
+
+vprintf_like_t esp_log_set_vprintf(vprintf_like_t func) {
+  vprintf_like_t old = log_vprintf;
+  log_vprintf = func;
+  return old;
+}
+
+void esp_log_level_set(const char *tag, esp_log_level_t level) {
+  log_level = level;
+}
+
+uint32_t esp_log_timestamp(void) {
+  return hal_time_us() / 1000;
+}
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...) {
+  va_list args;
+  if (level > log_level) return;
+  va_start(args, format);
+  log_vprintf(format, args);
+  va_end(args);
+}
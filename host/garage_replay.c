@@ -0,0 +1,467 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <esp_log.h>
+#include "hal.h"
+#include "hal_sim.h"
+#include "garage_config.h"
+#include "garage_control.h"
+#include "heartbeat.h"
+#include "timer_wheel.h"
+
+/* Replay sensor traces through garage_control on the virtual clock.
+ *
+ * A trace is a text file, one event per line, times in milliseconds:
+ *
+ *   # comment
+ *   0      1 0       pin levels: open sensor, closed sensor (0 = magnet)
+ *   1000   open      HomeKit open command
+ *   60000  close     HomeKit close command
+ *   3600000 end      keep running until here
+ *
+ * For each trace the state sequence is printed with the detection
+ * latency of every sensor driven transition, measured from the last
+ * pin edge before it, followed by the HAL callback counts and the CPU
+ * time the control code used per simulated hour, and for doors that
+ * jammed, how long after setting off they were reported stuck.  A
+ * trace fails, and the exit status with it, if a door does not end in
+ * the state its final pin levels show.  The timers and pins
+ * a light sleeping chip would wake for follow, per simulated hour, with
+ * the share of wakeups each had to itself and the modelled time asleep,
+ * then the wheel timers behind the timer_wheel wakeups; -a sets the
+ * timer alignment grid to compare.  -d replays the trace
+ * on that many doors at once, each a few ms behind the last, to show
+ * the cost per door as doors are added.  Runs are deterministic apart
+ * from the CPU figures.
+ *
+ *   garage_replay [-q] [-v] [-a align_ms] [-d doors] trace...
+ *   garage_replay -S [-c cycles] [-p period_s] [-t travel_s] [-b bounce_ms]
+ *		   [-g glitches] [-j jam_every] [-s seed] > trace
+ */
+
+typedef enum { EV_PINS, EV_OPEN, EV_CLOSE, EV_END } replay_kind_t;
+
+typedef struct {
+  int64_t time_us;
+  replay_kind_t kind;
+  int open_level, closed_level;
+  int door;
+  size_t seq;			/* keeps equal times in trace order */
+} replay_event_t;
+
+static const char *state_str[] = { "OPEN", "CLOSED", "OPENING", "CLOSING", "STOPPED" };
+
+static bool quiet;
+static int align_ms = GARAGE_LOW_POWER ? GARAGE_TIMER_ALIGN_MILLISECONDS : 0;
+static int door_count = 1;
+
+/* door 0 is wired as configured, the others on spare simulated pins */
+#define REPLAY_DOOR_STAGGER_US 7000
+static garage_door_config_t door_config[GARAGE_MAX_DOORS];
+static char door_names[GARAGE_MAX_DOORS][8];
+
+/* written by the state callback, which runs on the garage event task
+ * while the replay thread waits */
+static struct {
+  garage_state_t state;
+  int64_t last_edge_us;
+  bool edge_since_change;
+  int64_t depart_us;		/* the edge it set off on */
+} doors[GARAGE_MAX_DOORS];
+
+static struct {
+  uint32_t transitions;
+  uint32_t measured;
+  int64_t latency_min, latency_max, latency_sum;
+  uint32_t stuck;
+  int64_t stuck_min, stuck_max, stuck_sum;
+} replay;
+
+static void doors_configure(void) {
+  static const garage_door_config_t configured[] = GARAGE_DOORS;
+
+  door_config[0] = configured[0];
+  for (int d = 1; d < door_count; d++) {
+    int base = 16 + 4 * (d - 1);
+    snprintf(door_names[d], sizeof(door_names[d]), "door%d", d);
+    door_config[d].name = door_names[d];
+    door_config[d].open_sensor_pin = base;
+    door_config[d].closed_sensor_pin = base + 1;
+    door_config[d].open_control_pin = base + 2;
+    door_config[d].close_control_pin = base + 3;
+  }
+}
+
+static void state_callback(garage_door_t *door, garage_state_t current, garage_state_t target) {
+  int d = garage_door_index(door);
+  int64_t now = hal_time_us();
+  int64_t latency = -1, stuck;
+  garage_travel_t travel;
+
+  if (current != doors[d].state) {
+    if (doors[d].state != (garage_state_t)-1) replay.transitions++;
+    if (doors[d].edge_since_change) {
+      latency = now - doors[d].last_edge_us;
+      if (!replay.measured || latency < replay.latency_min) replay.latency_min = latency;
+      if (!replay.measured || latency > replay.latency_max) replay.latency_max = latency;
+      replay.latency_sum += latency;
+      replay.measured++;
+    }
+    if (current == GARAGE_OPENING || current == GARAGE_CLOSING)
+      doors[d].depart_us = doors[d].edge_since_change ? doors[d].last_edge_us : now;
+    /* how long a jammed door went unreported */
+    if (current == GARAGE_STOPPED && doors[d].depart_us >= 0) {
+      stuck = now - doors[d].depart_us;
+      if (!replay.stuck || stuck < replay.stuck_min) replay.stuck_min = stuck;
+      if (!replay.stuck || stuck > replay.stuck_max) replay.stuck_max = stuck;
+      replay.stuck_sum += stuck;
+      replay.stuck++;
+    }
+    if (current != GARAGE_OPENING && current != GARAGE_CLOSING) doors[d].depart_us = -1;
+    doors[d].edge_since_change = false;
+    doors[d].state = current;
+  }
+  if (quiet) return;
+  if (door_count > 1) printf("  %d", d);
+  printf("  %10.3f  %-8s %-8s ", now / 1e6, state_str[current], state_str[target]);
+  if (latency >= 0) printf("%8.1f", latency / 1e3);
+  else printf("%8s", "-");
+  if (garage_get_travel(door, &travel)) printf("  due in %.1f s", travel.eta_ms / 1e3);
+  printf("\n");
+}
+
+static int event_cmp(const void *a, const void *b) {
+  const replay_event_t *x = a, *y = b;
+  if (x->time_us != y->time_us) return x->time_us < y->time_us ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static replay_event_t *trace_load(const char *path, size_t *count) {
+  FILE *f = fopen(path, "r");
+  replay_event_t *events = NULL;
+  size_t n = 0, size = 0;
+  char line[128];
+  int lineno = 0;
+
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    replay_event_t ev = { 0 };
+    char word[16];
+    double ms;
+
+    lineno++;
+    if (line[strspn(line, " \t\r\n")] == '#' || line[strspn(line, " \t\r\n")] == 0) continue;
+    if (sscanf(line, "%lf %d %d", &ms, &ev.open_level, &ev.closed_level) == 3) {
+      ev.kind = EV_PINS;
+    } else if (sscanf(line, "%lf %15s", &ms, word) == 2 &&
+	       (!strcmp(word, "open") || !strcmp(word, "close") || !strcmp(word, "end"))) {
+      ev.kind = word[0] == 'o' ? EV_OPEN : word[0] == 'c' ? EV_CLOSE : EV_END;
+    } else {
+      fprintf(stderr, "%s:%d: bad trace line\n", path, lineno);
+      free(events);
+      fclose(f);
+      return NULL;
+    }
+    ev.time_us = (int64_t)(ms * 1000);
+    ev.seq = n;
+    if (n == size) {
+      size = size ? size * 2 : 256;
+      events = realloc(events, size * sizeof(*events));
+    }
+    events[n++] = ev;
+  }
+  fclose(f);
+  /* every door gets its own copy, staggered, all in time order */
+  events = realloc(events, n * door_count * sizeof(*events));
+  for (int d = 0; d < door_count; d++) {
+    for (size_t i = 0; i < n; i++) {
+      replay_event_t *ev = &events[d * n + i];
+      *ev = events[i];
+      ev->door = d;
+      ev->seq = d * n + i;
+      if (ev->time_us > 0 || ev->kind != EV_PINS) ev->time_us += d * REPLAY_DOOR_STAGGER_US;
+    }
+  }
+  n *= door_count;
+  qsort(events, n, sizeof(*events), event_cmp);
+  *count = n;
+  return events;
+}
+
+static void set_pins(const replay_event_t *ev) {
+  const garage_door_config_t *config = &door_config[ev->door];
+
+  if (hal_gpio_get_level(config->open_sensor_pin) != ev->open_level ||
+      hal_gpio_get_level(config->closed_sensor_pin) != ev->closed_level) {
+    doors[ev->door].last_edge_us = hal_time_us();
+    doors[ev->door].edge_since_change = true;
+  }
+  hal_sim_gpio_input(config->open_sensor_pin, ev->open_level);
+  hal_sim_gpio_input(config->closed_sensor_pin, ev->closed_level);
+}
+
+/* garage_control has no teardown, so each trace is replayed in its own
+ * process */
+static void report_wakeups(double hours) {
+  hal_sim_wake_source_t sources[2 * GARAGE_MAX_DOORS + 8];
+  size_t n = hal_sim_wake_sources(sources, sizeof(sources) / sizeof(sources[0]));
+
+  printf("  wakeups per hour (own/shared):");
+  for (size_t i = 0; i < n; i++)
+    printf(" %s %.0f/%.0f", sources[i].name, sources[i].wakeups / hours,
+	   sources[i].shared / hours);
+  printf("; asleep %u%%\n", (unsigned)hal_power_sleep_pct());
+}
+
+/* The timers behind the timer_wheel wakeups above */
+static void report_timers(double hours) {
+  timer_wheel_timer_stat_t timers[16];
+  size_t n = timer_wheel_timer_stats(timers, 16);
+  timer_wheel_stats_t stats;
+
+  timer_wheel_stats(&stats);
+  printf("  timer_wheel: %.1f timers a wakeup; per hour (fired/shared):",
+	 stats.expiries ? (double)stats.fired / stats.expiries : 0.0);
+  for (size_t i = 0; i < n; i++)
+    printf(" %s %.0f/%.0f", timers[i].name, timers[i].fired / hours, timers[i].shared / hours);
+  printf("\n");
+}
+
+/* Once the last event has played out every door shows what its pins
+ * say: open, closed, or stopped between the two */
+static int check_settled(const char *path) {
+  int bad = 0;
+
+  for (int d = 0; d < door_count; d++) {
+    garage_state_t want = GARAGE_STOPPED;
+    if (hal_gpio_get_level(door_config[d].open_sensor_pin) == 0) want = GARAGE_OPEN;
+    else if (hal_gpio_get_level(door_config[d].closed_sensor_pin) == 0) want = GARAGE_CLOSED;
+    if (doors[d].state != want) {
+      printf("%s: door %d ended %s, its pins say %s\n", path, d,
+	     doors[d].state == (garage_state_t)-1 ? "unreported" : state_str[doors[d].state],
+	     state_str[want]);
+      bad = 1;
+    }
+  }
+  return bad;
+}
+
+static int replay_trace(const char *path) {
+  replay_event_t *events;
+  size_t n, i = 0;
+  hal_sim_stats_t stats;
+  double hours;
+  int bad;
+
+  events = trace_load(path, &n);
+  if (!events) return 1;
+
+  hal_sim_init();
+  hal_power_init(GARAGE_LOW_POWER);
+  timer_wheel_init(align_ms * 1000);
+  if (!quiet) printf("%s\n  %10s  %-8s %-8s %8s\n", path, "time_s", "state", "target", "latency_ms");
+
+  /* levels at time zero are the state the controller boots into */
+  for (; i < n && events[i].time_us == 0 && events[i].kind == EV_PINS; i++)
+    set_pins(&events[i]);
+  for (int d = 0; d < door_count; d++) {
+    doors[d].edge_since_change = false;
+    doors[d].state = -1;
+    doors[d].depart_us = -1;
+  }
+  heartbeat_init(30);
+  garage_init(door_config, door_count);
+  garage_set_state_callback(state_callback);
+  hal_heap_seal(GARAGE_STATIC_ONLY);
+
+  for (; i < n; i++) {
+    hal_sim_advance_to(events[i].time_us);
+    switch (events[i].kind) {
+    case EV_PINS: set_pins(&events[i]); break;
+    case EV_OPEN: garage_action_open(garage_door(events[i].door)); break;
+    case EV_CLOSE: garage_action_close(garage_door(events[i].door)); break;
+    case EV_END: break;
+    }
+  }
+  /* let debounce and the stuck timer finish with the last event */
+  hal_sim_advance((GARAGE_MAX_TRANSIT_SECONDS + 1) * 1000000LL);
+  bad = check_settled(path);
+
+  hal_sim_get_stats(&stats);
+  hours = hal_time_us() / 3600e6;
+  printf("%s: %.3f h simulated", path, hours);
+  if (door_count > 1) printf(" on %d doors", door_count);
+  printf(", %u transitions", replay.transitions);
+  if (replay.measured)
+    printf(", latency min/avg/max %.1f/%.1f/%.1f ms",
+	   replay.latency_min / 1e3, replay.latency_sum / 1e3 / replay.measured,
+	   replay.latency_max / 1e3);
+  if (replay.stuck)
+    printf("\n  %u stuck, reported after min/avg/max %.1f/%.1f/%.1f s (fixed timeout %d s)",
+	   replay.stuck, replay.stuck_min / 1e6, replay.stuck_sum / 1e6 / replay.stuck,
+	   replay.stuck_max / 1e6, GARAGE_MAX_TRANSIT_SECONDS);
+  printf("\n  callbacks: %u timer, %u isr, %u task wakeups; cpu %.3f ms per simulated hour\n",
+	 stats.timer_callbacks, stats.isr_calls, stats.task_wakeups,
+	 stats.cpu_ns / 1e6 / hours);
+  if (door_count > 1)
+    printf("  cpu %.3f ms per door-hour\n", stats.cpu_ns / 1e6 / hours / door_count);
+  report_wakeups(hours);
+  report_timers(hours);
+  free(events);
+  return bad;
+}
+
+/****************************************************************************
+ * Synthetic traces
+ *
+ * Each cycle opens the door and closes it again half a period later.
+ * Contacts chatter for up to bounce_ms whenever they change, stationary
+ * contacts see short glitches, and every jam_every'th movement stalls
+ * between the sensors for longer than GARAGE_MAX_TRANSIT_SECONDS before
+ * it completes.
+ */
+typedef struct {
+  int cycles, period_s, travel_s, bounce_ms, glitches, jam_every;
+  uint32_t seed;
+} synth_config_t;
+
+/* a fixed generator, so a seed gives the same trace everywhere */
+static uint32_t synth_rand(uint32_t *state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static void synth_pins(double ms, int open, int closed) {
+  printf("%.1f %d %d\n", ms, open, closed);
+}
+
+/* a contact changing to level at ms, chattering first */
+static void synth_edge(const synth_config_t *c, uint32_t *rng, double ms,
+		       int pin_open, int level, int other) {
+  int chatter = c->bounce_ms ? synth_rand(rng) % 6 : 0;
+  double t = ms;
+
+  for (int i = 0; i < chatter; i++) {
+    double step = c->bounce_ms / (2.0 * chatter) * (1 + synth_rand(rng) % 100 / 100.0);
+    if (pin_open) synth_pins(t, level, other); else synth_pins(t, other, level);
+    t += step / 2;
+    if (pin_open) synth_pins(t, !level, other); else synth_pins(t, other, !level);
+    t += step / 2;
+  }
+  if (pin_open) synth_pins(t, level, other); else synth_pins(t, other, level);
+}
+
+/* the asserted contact drops out briefly */
+static void synth_glitches(const synth_config_t *c, uint32_t *rng, double from, double to,
+			   int open, int closed) {
+  for (int i = 0; i < c->glitches; i++) {
+    double t = from + (to - from) * (synth_rand(rng) % 1000) / 1000.0;
+    double width = 1 + synth_rand(rng) % GARAGE_SENSOR_GLITCH_MILLISECONDS;
+    synth_pins(t, 1, 1);
+    synth_pins(t + width, open, closed);
+  }
+}
+
+static void synth_move(const synth_config_t *c, uint32_t *rng, double ms, bool opening,
+		       bool jam) {
+  double travel = c->travel_s * 1000.0 * (0.9 + synth_rand(rng) % 200 / 1000.0);
+
+  if (jam) travel += (GARAGE_MAX_TRANSIT_SECONDS + 10) * 1000.0;
+  printf("%.1f %s\n", ms, opening ? "open" : "close");
+  /* relay pulse, then the door starts to move */
+  ms += 1500;
+  if (opening) {
+    synth_edge(c, rng, ms, 0, 1, 1);
+    synth_edge(c, rng, ms + travel, 1, 0, 1);
+  } else {
+    synth_edge(c, rng, ms, 1, 1, 1);
+    synth_edge(c, rng, ms + travel, 0, 0, 1);
+  }
+}
+
+static void synth(const synth_config_t *c) {
+  uint32_t rng = c->seed;
+  int moves = 0;
+
+  printf("# synthetic: -c %d -p %d -t %d -b %d -g %d -j %d -s %u\n",
+	 c->cycles, c->period_s, c->travel_s, c->bounce_ms, c->glitches, c->jam_every, c->seed);
+  synth_pins(0, 1, 0);
+  for (int i = 0; i < c->cycles; i++) {
+    double start = (double)i * c->period_s * 1000 + 1000;
+    double half = c->period_s * 500.0;
+
+    synth_glitches(c, &rng, start - 1000 + 100, start - 100, 1, 0);
+    moves++;
+    synth_move(c, &rng, start, true, c->jam_every && moves % c->jam_every == 0);
+    synth_glitches(c, &rng, start + half - 30000, start + half - 1000, 0, 1);
+    moves++;
+    synth_move(c, &rng, start + half, false, c->jam_every && moves % c->jam_every == 0);
+  }
+  printf("%.1f end\n", (double)c->cycles * c->period_s * 1000);
+}
+
+int main(int argc, char **argv) {
+  synth_config_t synth_config = {
+    .cycles = 6, .period_s = 600, .travel_s = 12, .bounce_ms = 20,
+    .glitches = 0, .jam_every = 0, .seed = 1,
+  };
+  bool synthesize = false;
+  int opt;
+
+  esp_log_level_set("*", ESP_LOG_ERROR);
+  while ((opt = getopt(argc, argv, "qva:d:Sc:p:t:b:g:j:s:")) != -1) {
+    switch (opt) {
+    case 'q': quiet = true; break;
+    case 'v': esp_log_level_set("*", ESP_LOG_DEBUG); break;
+    case 'a': align_ms = atoi(optarg); break;
+    case 'd':
+      door_count = atoi(optarg);
+      if (door_count < 1 || door_count > GARAGE_MAX_DOORS) {
+	fprintf(stderr, "%s: 1 to %d doors\n", argv[0], GARAGE_MAX_DOORS);
+	return 2;
+      }
+      break;
+    case 'S': synthesize = true; break;
+    case 'c': synth_config.cycles = atoi(optarg); break;
+    case 'p': synth_config.period_s = atoi(optarg); break;
+    case 't': synth_config.travel_s = atoi(optarg); break;
+    case 'b': synth_config.bounce_ms = atoi(optarg); break;
+    case 'g': synth_config.glitches = atoi(optarg); break;
+    case 'j': synth_config.jam_every = atoi(optarg); break;
+    case 's': synth_config.seed = strtoul(optarg, NULL, 0); break;
+    default:
+      fprintf(stderr, "usage: %s [-q] [-v] [-a align_ms] [-d doors] trace...\n"
+	      "       %s -S [-c cycles] [-p period_s] [-t travel_s] [-b bounce_ms]"
+	      " [-g glitches] [-j jam_every] [-s seed]\n", argv[0], argv[0]);
+      return 2;
+    }
+  }
+
+  doors_configure();
+  if (synthesize) {
+    synth(&synth_config);
+    return 0;
+  }
+  if (optind == argc) {
+    fprintf(stderr, "%s: no trace given\n", argv[0]);
+    return 2;
+  }
+  /* one process per trace, see replay_trace() */
+  for (int i = optind; i < argc; i++) {
+    int status;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0) exit(replay_trace(argv[i]));
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	WEXITSTATUS(status) != 0)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,407 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <esp_log.h>
+#include "hal.h"
+#include "hal_sim.h"
+#include "hal_socket.h"
+#include "garage_config.h"
+#include "garage_control.h"
+#include "syslog.h"
+#include "syslog_spool.h"
+#include "heartbeat.h"
+#include "span_trace.h"
+#include "notify_coalesce.h"
+#include "crash_log.h"
+#include "timer_wheel.h"
+#include "wall_clock.h"
+
+/* Linux simulator: runs garage_control, syslog and heartbeat on the
+ * POSIX HAL through a scripted open/close cycle and a stuck door, and
+ * prints state callbacks, relay pulses and the syslog traffic it gets
+ * on 127.0.0.1:RECEIVER_PORT_NUM, then fakes a watchdog reset to show
+ * the crash log being sent.  Last a Wi-Fi outage fills the syslog
+ * spool, on a temporary file standing in for the flash partition, and
+ * a reset part way through its replay has to carry on from flash.
+ * The simulator answers SNTP as the network first comes up, so the
+ * messages queued since boot go out back-dated.  Exits non-zero if the
+ * HomeKit notifications were not the expected ones, a relay pulse had
+ * the wrong width, the relays overlapped, an outage line never
+ * arrived or not with the time it was logged at, or a heartbeat came
+ * in cut short. */
+
+static int syslog_sock = -1;
+
+#define OUTAGE_LINES 400
+#define SPOOL_BYTES (64 * 1024)
+static uint8_t outage_seen[OUTAGE_LINES];
+static int outage_mistimed;
+static int64_t outage_start_us;
+static int heartbeat_lines, heartbeat_cut, heartbeat_tasks;
+
+#define SNTP_UTC_US 1792314000000000LL	/* 2026-10-18T09:00:00Z */
+static int64_t sntp_at_us;
+
+static const char *state_str[] = { "OPEN", "CLOSED", "OPENING", "CLOSING", "STOPPED" };
+
+static void print_time(void) {
+  int64_t now = hal_time_us();
+  printf("[%4lld.%03lld] ", (long long)(now / 1000000), (long long)(now / 1000 % 1000));
+}
+
+static const garage_door_config_t door_config[] = GARAGE_DOORS;
+
+/* What a HomeKit controller should see of the script below */
+static const char *expected_notify[] = {
+  "current OPENING target OPEN", "current OPEN",
+  "current CLOSING target CLOSED", "current CLOSED",
+  "current OPENING target OPEN", "current OPEN",
+  "current CLOSING target CLOSED", "current CLOSED",
+  "current OPENING target OPEN", "current STOPPED",
+};
+#define NOTIFY_MAX 32
+static char notified[NOTIFY_MAX][48];
+static int notify_count;
+
+/* stand in for garage.c's HomeKit glue */
+static void notify(garage_door_t *door, bool current_changed, garage_state_t current,
+		   bool target_changed, garage_state_t target) {
+  char text[48];
+
+  snprintf(text, sizeof(text), "%s%s%s%s", current_changed ? "current " : "",
+	   current_changed ? state_str[current] : "",
+	   target_changed ? (current_changed ? " target " : "target ") : "",
+	   target_changed ? state_str[target] : "");
+  print_time();
+  printf("notify %s\n", text);
+  if (notify_count < NOTIFY_MAX) strcpy(notified[notify_count], text);
+  notify_count++;
+  if (current == target) garage_span_mark(door, SPAN_NOTIFY, hal_time_us());
+}
+
+static void state_callback(garage_door_t *door, garage_state_t current, garage_state_t target) {
+  print_time();
+  printf("state %s target %s\n", state_str[current], state_str[target]);
+  notify_coalesce_update(door, current, target);
+}
+
+static void homekit_set(garage_state_t target) {
+  garage_span_begin(garage_door(0), hal_time_us());
+  notify_coalesce_request(garage_door(0), target);
+  if (target == GARAGE_OPEN) garage_action_open(garage_door(0));
+  else garage_action_close(garage_door(0));
+}
+
+static void syslog_listen(void) {
+  struct sockaddr_in addr;
+
+  syslog_sock = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(RECEIVER_PORT_NUM);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (syslog_sock < 0 || bind(syslog_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("syslog receiver");
+    syslog_sock = -1;
+  }
+}
+
+/* UTC microseconds of an RFC 5424 TIMESTAMP as wall_clock.c writes
+ * them, -1 if msg has none */
+static int64_t message_utc(const char *msg) {
+  struct tm tm = { 0 };
+  int us;
+
+  msg = strstr(msg, ">1 ");
+  if (!msg || sscanf(msg + 3, "%d-%d-%dT%d:%d:%d.%dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+		     &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &us) != 7)
+    return -1;
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  return (int64_t)timegm(&tm) * 1000000 + us;
+}
+
+/* A heartbeat's metrics lines hold whole name=value pairs only, and
+ * its task stats come on a line of their own */
+static void heartbeat_seen(const char *msg) {
+  const char *p = strstr(msg, "### Heartbeat ");
+  const char *eq;
+  size_t n;
+
+  if (!p) return;
+  p += strlen("### Heartbeat ");
+  if (!strncmp(p, "tasks", 5)) {
+    heartbeat_tasks++;
+    return;
+  }
+  heartbeat_lines++;
+  for (; *p && *p != '\n'; p += n + (p[n] == ' ')) {
+    n = strcspn(p, " \n");
+    eq = memchr(p, '=', n);
+    if (!eq || eq == p || eq + 1 == p + n ||
+	strspn(eq + 1, "0123456789/-") != (size_t)(p + n - eq - 1)) {
+      heartbeat_cut++;
+      return;
+    }
+  }
+}
+
+static void syslog_drain(void) {
+  char buf[2048], *p;
+  ssize_t n;
+  int line;
+
+  if (syslog_sock < 0) return;
+  while ((n = recv(syslog_sock, buf, sizeof(buf) - 1, MSG_DONTWAIT)) > 0) {
+    buf[n] = 0;
+    /* counted, not printed */
+    if ((p = strstr(buf, " outage - ")) && (p = strstr(p, "line ")) &&
+	sscanf(p, "line %d", &line) == 1 && line >= 0 && line < OUTAGE_LINES) {
+      outage_seen[line]++;
+      /* logged 20 lines to each 500 ms step */
+      if (message_utc(buf) != SNTP_UTC_US + outage_start_us + line / 20 * 500000 - sntp_at_us)
+	outage_mistimed++;
+      continue;
+    }
+    heartbeat_seen(buf);
+    print_time();
+    printf("syslog %s\n", buf);
+  }
+}
+
+static void relay_report(int pin, const char *name, bool *pulled) {
+  bool now = hal_sim_gpio_output(pin) == 0;
+
+  if (now != *pulled) {
+    *pulled = now;
+    print_time();
+    printf("%s relay %s\n", name, now ? "pulled" : "released");
+  }
+}
+
+/* Run for ms, reporting relay pulses as they start and end */
+static void run(int ms) {
+  static bool open_pulled, close_pulled;
+
+  for (int t = 0; t < ms; t += 10) {
+    hal_sim_advance(10 * 1000);
+    relay_report(GARAGE_OPEN_CONTROL_PIN, "open", &open_pulled);
+    relay_report(GARAGE_CLOSE_CONTROL_PIN, "close", &close_pulled);
+  }
+  /* the receiving socket is real, give the kernel a moment */
+  usleep(1000);
+  syslog_drain();
+}
+
+/* Reed contacts chatter for a few ms when they change */
+static void sensor(int pin, int level) {
+  for (int i = 0; i < 3; i++) {
+    hal_sim_gpio_input(pin, level);
+    hal_sim_advance(2 * 1000);
+    hal_sim_gpio_input(pin, !level);
+    hal_sim_advance(3 * 1000);
+  }
+  hal_sim_gpio_input(pin, level);
+}
+
+/* Every pulse is the configured width, and a pulse on one relay only
+ * starts the gap after the other's ends */
+static int check_pulses(void) {
+  hal_sim_pulse_t pulses[32];
+  size_t n = hal_sim_pulses(pulses, 32);
+  int bad = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    int64_t width = pulses[i].end_us - pulses[i].start_us;
+    if (pulses[i].end_us >= 0 && width != GARAGE_CONTROL_PULSE_MILLISECONDS * 1000) {
+      printf("--- pulse on %d was %lld us\n", pulses[i].pin, (long long)width);
+      bad++;
+    }
+    if (i > 0 && pulses[i].pin != pulses[i - 1].pin &&
+	(pulses[i - 1].end_us < 0 ||
+	 pulses[i].start_us < pulses[i - 1].end_us + GARAGE_CONTROL_GAP_MILLISECONDS * 1000)) {
+      printf("--- pulse on %d overlaps %d\n", pulses[i].pin, pulses[i - 1].pin);
+      bad++;
+    }
+  }
+  printf("--- %u relay pulses, %s\n", (unsigned)n, bad ? "FAILED" : "widths exact, interlock held");
+  return bad != 0;
+}
+
+/* The notifications sent were the ones expected, in order */
+static int check_notify(void) {
+  int want = sizeof(expected_notify) / sizeof(expected_notify[0]);
+  int bad = notify_count != want;
+
+  for (int i = 0; i < want && i < notify_count && i < NOTIFY_MAX; i++) {
+    if (strcmp(notified[i], expected_notify[i])) {
+      printf("--- notification %d was \"%s\", expected \"%s\"\n", i, notified[i],
+	     expected_notify[i]);
+      bad = 1;
+    }
+  }
+  printf("--- %d notifications, %s\n", notify_count,
+	 bad ? (notify_count != want ? "FAILED, wrong count" : "FAILED") : "as expected");
+  return bad;
+}
+
+/* Log the outage lines with the console off, as they would scroll
+ * everything else away */
+static void log_outage(void) {
+  int console = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+
+  fflush(stdout);
+  dup2(null, STDOUT_FILENO);
+  outage_start_us = hal_time_us();
+  for (int i = 0; i < OUTAGE_LINES; i++) {
+    ESP_LOGI("outage", "line %d of %d, while the network is down", i, OUTAGE_LINES);
+    if (i % 20 == 19) hal_sim_advance(500 * 1000);
+  }
+  fflush(stdout);
+  dup2(console, STDOUT_FILENO);
+  close(console);
+  close(null);
+}
+
+/* Every line came back, some twice if the reset replayed their page
+ * again */
+static int check_outage(void) {
+  hal_sim_flash_stats_t flash;
+  int missing = 0, twice = 0;
+
+  for (int i = 0; i < OUTAGE_LINES; i++) {
+    if (!outage_seen[i]) missing++;
+    if (outage_seen[i] > 1) twice++;
+  }
+  hal_sim_flash_stats(SYSLOG_SPOOL_PARTITION, &flash);
+  printf("--- %d of %d outage lines arrived, %d twice, %d with the wrong time; "
+	 "sector erases %u to %u, %u bad writes\n", OUTAGE_LINES - missing, OUTAGE_LINES, twice,
+	 outage_mistimed, (unsigned)flash.erases_min, (unsigned)flash.erases_max,
+	 (unsigned)flash.bad_writes);
+  return missing || outage_mistimed || flash.bad_writes;
+}
+
+static int check_heartbeats(void) {
+  printf("--- %d heartbeat metrics lines, %d cut short, %d task lines\n", heartbeat_lines,
+	 heartbeat_cut, heartbeat_tasks);
+  return !heartbeat_lines || heartbeat_cut || !heartbeat_tasks;
+}
+
+static void report_wakeups(void) {
+  hal_sim_wake_source_t sources[16];
+  size_t n = hal_sim_wake_sources(sources, 16);
+
+  timer_wheel_timer_stat_t timers[16];
+  size_t m = timer_wheel_timer_stats(timers, 16);
+
+  printf("--- wakeups (own/shared):");
+  for (size_t i = 0; i < n; i++)
+    printf(" %s %u/%u", sources[i].name, (unsigned)sources[i].wakeups,
+	   (unsigned)sources[i].shared);
+  printf("\n--- timer_wheel (fired/shared):");
+  for (size_t i = 0; i < m; i++)
+    printf(" %s %u/%u", timers[i].name, (unsigned)timers[i].fired, (unsigned)timers[i].shared);
+  printf("\n");
+}
+
+int main(void) {
+  hal_sim_init();
+  hal_power_init(GARAGE_LOW_POWER);
+  timer_wheel_init(GARAGE_LOW_POWER ? GARAGE_TIMER_ALIGN_MILLISECONDS * 1000 : 0);
+  syslog_listen();
+  crash_log_init();
+
+  /* door starts closed; sensors are active low */
+  hal_sim_gpio_input(GARAGE_CLOSED_SENSOR_PIN, 0);
+
+  hal_sim_flash(SYSLOG_SPOOL_PARTITION, NULL, SPOOL_BYTES);
+  wall_clock_init("127.0.0.1");
+  syslog_init();
+  heartbeat_init(30);
+  garage_init(door_config, sizeof(door_config) / sizeof(door_config[0]));
+  notify_coalesce_init(notify);
+  garage_set_state_callback(state_callback);
+  hal_heap_seal(GARAGE_STATIC_ONLY);
+  run(500);
+  hal_sim_net_up("127.0.0.1");
+  hal_sim_sntp_reply(SNTP_UTC_US);
+  sntp_at_us = hal_time_us();
+  run(1000);
+
+  printf("--- open\n");
+  homekit_set(GARAGE_OPEN);
+  run(1500);
+  sensor(GARAGE_CLOSED_SENSOR_PIN, 1);
+  run(12000);
+  sensor(GARAGE_OPEN_SENSOR_PIN, 0);
+  run(2000);
+
+  printf("--- close\n");
+  homekit_set(GARAGE_CLOSED);
+  run(1000);
+  sensor(GARAGE_OPEN_SENSOR_PIN, 1);
+  run(12000);
+  sensor(GARAGE_CLOSED_SENSOR_PIN, 0);
+  run(2000);
+
+  printf("--- closed sensor flaps\n");
+  for (int i = 0; i < 3; i++) {
+    sensor(GARAGE_CLOSED_SENSOR_PIN, 1);
+    run(400);
+    sensor(GARAGE_CLOSED_SENSOR_PIN, 0);
+    run(400);
+  }
+  run(3000);
+
+  /* nobody asked, so setting off is held until it is no flap */
+  printf("--- opened and closed from the wall button\n");
+  sensor(GARAGE_CLOSED_SENSOR_PIN, 1);
+  run(12000);
+  sensor(GARAGE_OPEN_SENSOR_PIN, 0);
+  run(3000);
+  sensor(GARAGE_OPEN_SENSOR_PIN, 1);
+  run(12000);
+  sensor(GARAGE_CLOSED_SENSOR_PIN, 0);
+  run(3000);
+
+  printf("--- open, changed to close straight away\n");
+  homekit_set(GARAGE_OPEN);
+  run(300);
+  homekit_set(GARAGE_CLOSED);
+  run(3000);
+
+  printf("--- open, door jams half way\n");
+  homekit_set(GARAGE_OPEN);
+  run(1500);
+  sensor(GARAGE_CLOSED_SENSOR_PIN, 1);
+  run((GARAGE_MAX_TRANSIT_SECONDS + 5) * 1000);
+  report_wakeups();
+
+  /* RTC memory is plain memory here: a new reset reason and another
+   * crash_log_init() stand in for the reset */
+  printf("--- watchdog reset, the saved log goes out first\n");
+  hal_sim_net_down();
+  run(100);
+  hal_sim_set_reset_reason(HAL_RESET_WATCHDOG);
+  crash_log_init();
+  hal_sim_net_up("127.0.0.1");
+  run(500);
+
+  printf("--- Wi-Fi outage, %d lines logged meanwhile\n", OUTAGE_LINES);
+  hal_sim_net_down();
+  run(100);
+  log_outage();
+  run(1000);
+  printf("--- back, then a reset half way through the replay\n");
+  /* a second at a time, so the receiving socket never overflows */
+  hal_sim_net_up("127.0.0.1");
+  for (int i = 0; i < 8; i++) run(1000);
+  hal_sim_net_down();
+  run(100);
+  syslog_spool_init(SYSLOG_SPOOL_PARTITION);
+  hal_sim_net_up("127.0.0.1");
+  for (int i = 0; i < 30; i++) run(1000);
+  return check_notify() | check_pulses() | check_outage() | check_heartbeats();
+}
@@ -0,0 +1,815 @@
+#include <assert.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal.h"
+#include "hal_sim.h"
+#include "metrics.h"
+
+/* POSIX implementation of hal.h for the host simulator.
+ *
+ * A single lock stands in for the CPU.  The simulator thread holds it
+ * whenever it is not waiting for tasks to go idle, HAL tasks hold it
+ * whenever they are not blocked in hal_queue_receive(), and timer
+ * callbacks and ISRs run on the simulator thread.  running counts the
+ * tasks that are not blocked; the clock only moves when it is zero.
+ */
+
+static pthread_mutex_t cpu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle = PTHREAD_COND_INITIALIZER;
+static int running;
+static int64_t now_us;
+static __thread const char *task_name = "main";
+static __thread int64_t run_start_ns;
+static __thread struct sim_task *current_task;
+static hal_sim_stats_t stats;
+static int64_t last_wake_us = -1;
+
+#define SIM_MAX_TASKS 8
+static struct sim_task {
+  const char *name;
+  int64_t cpu_ns;
+} tasks[SIM_MAX_TASKS];
+static size_t task_count;
+
+static int64_t thread_cpu_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* CPU time of the code under simulation is charged between these */
+static inline void cpu_start(void) {
+  run_start_ns = thread_cpu_ns();
+}
+
+static inline void cpu_stop(void) {
+  int64_t ns = thread_cpu_ns() - run_start_ns;
+  stats.cpu_ns += ns;
+  if (current_task) current_task->cpu_ns += ns;
+}
+
+/****************************************************************************
+ * clock
+ */
+
+int64_t hal_time_us(void) {
+  return now_us;
+}
+
+/* The simulator stands in for the SNTP server, hal_sim_sntp_reply() */
+static const char *sntp_server;
+static int64_t utc_offset_us;
+static bool utc_set;
+
+void hal_sntp_init(const char *server) {
+  sntp_server = server;
+}
+
+bool hal_utc_us(int64_t *utc_us) {
+  if (!utc_set) return false;
+  *utc_us = now_us + utc_offset_us;
+  return true;
+}
+
+void hal_sim_sntp_reply(int64_t utc_us) {
+  if (!sntp_server) return;
+  utc_offset_us = utc_us - now_us;
+  utc_set = true;
+}
+
+/****************************************************************************
+ * GPIO
+ */
+
+#define SIM_PINS 64
+
+static struct {
+  bool output;
+  bool pullup;
+  bool interrupt;
+  int in_level;
+  int out_level;
+  hal_isr_t isr;
+  void *arg;
+  uint32_t wakeups, shared;
+} pins[SIM_PINS];
+
+/* Everything that runs at a new instant woke the chip; anything else
+ * at the same instant shared that wakeup */
+static bool sim_wake(uint32_t *wakeups, uint32_t *shared) {
+  if (now_us == last_wake_us) {
+    (*shared)++;
+    return false;
+  }
+  last_wake_us = now_us;
+  stats.wakeups++;
+  (*wakeups)++;
+  return true;
+}
+
+static inline int pin_level(int pin) {
+  return pins[pin].output ? pins[pin].out_level : pins[pin].in_level;
+}
+
+void hal_gpio_config_input(uint64_t pin_mask, bool pullup, bool edge_interrupt) {
+  for (int pin = 0; pin < SIM_PINS; pin++) {
+    if (!(pin_mask & (1ULL << pin))) continue;
+    pins[pin].output = false;
+    pins[pin].pullup = pullup;
+    pins[pin].interrupt = edge_interrupt;
+  }
+}
+
+void hal_gpio_config_output_od(uint64_t pin_mask) {
+  for (int pin = 0; pin < SIM_PINS; pin++) {
+    if (!(pin_mask & (1ULL << pin))) continue;
+    pins[pin].output = true;
+    pins[pin].out_level = 1;
+  }
+}
+
+void hal_gpio_set_output(int pin, bool output) {
+  pins[pin].output = output;
+}
+
+void hal_gpio_set_level(int pin, int level) {
+  pins[pin].out_level = level ? 1 : 0;
+}
+
+int hal_gpio_get_level(int pin) {
+  return pin_level(pin);
+}
+
+uint64_t hal_gpio_get_levels(void) {
+  uint64_t levels = 0;
+
+  for (int pin = 0; pin < SIM_PINS; pin++)
+    if (pin_level(pin)) levels |= 1ULL << pin;
+  return levels;
+}
+
+/* every interrupt pin wakes the simulated chip anyway */
+void hal_gpio_wakeup_enable(uint64_t pin_mask) {
+}
+
+void hal_gpio_isr_add(int pin, hal_isr_t isr, void *arg) {
+  pins[pin].isr = isr;
+  pins[pin].arg = arg;
+}
+
+void hal_sim_gpio_input(int pin, int level) {
+  int before = pin_level(pin);
+
+  pins[pin].in_level = level ? 1 : 0;
+  if (pin_level(pin) != before && pins[pin].interrupt && pins[pin].isr) {
+    stats.isr_calls++;
+    sim_wake(&pins[pin].wakeups, &pins[pin].shared);
+    cpu_start();
+    pins[pin].isr(pins[pin].arg);
+    cpu_stop();
+  }
+}
+
+int hal_sim_gpio_output(int pin) {
+  return pins[pin].output ? pins[pin].out_level : -1;
+}
+
+/****************************************************************************
+ * timers
+ */
+
+struct hal_timer {
+  const char *name;
+  hal_timer_cb_t callback;
+  void *arg;
+  int64_t expiry;		/* -1 when stopped */
+  uint32_t wakeups, shared;
+  struct hal_timer *next;
+};
+
+static struct hal_timer *timers;
+
+hal_timer_t hal_timer_create(const char *name, hal_timer_cb_t callback, void *arg) {
+  struct hal_timer *timer = hal_alloc(sizeof(*timer));
+
+  timer->name = name;
+  timer->callback = callback;
+  timer->arg = arg;
+  timer->expiry = -1;
+  timer->next = timers;
+  timers = timer;
+  return timer;
+}
+
+void hal_timer_start_once(hal_timer_t timer, uint64_t timeout_us) {
+  timer->expiry = now_us + timeout_us;
+}
+
+void hal_timer_stop(hal_timer_t timer) {
+  timer->expiry = -1;
+}
+
+/****************************************************************************
+ * pulses
+ */
+
+/* The peripheral is modelled as a timer of its own, named after the
+ * pin, that drives the pin at the exact simulated instants.  Every
+ * pulse driven is logged for hal_sim_pulses(). */
+struct hal_pulse {
+  int pin;
+  char name[16];
+  hal_pulse_done_t done;
+  void *arg;
+  hal_timer_t timer;
+  bool busy;
+  bool driving;
+  uint32_t width_us;
+};
+
+#define SIM_PULSE_LOG 64
+static hal_sim_pulse_t pulse_log[SIM_PULSE_LOG];
+static size_t pulse_log_count;
+
+static void pulse_drive(struct hal_pulse *pulse) {
+  hal_sim_pulse_t *entry;
+
+  pins[pulse->pin].out_level = 0;
+  pulse->driving = true;
+  entry = &pulse_log[pulse_log_count++ % SIM_PULSE_LOG];
+  entry->pin = pulse->pin;
+  entry->start_us = now_us;
+  entry->end_us = -1;
+  hal_timer_start_once(pulse->timer, pulse->width_us);
+}
+
+static void pulse_timer(void *arg) {
+  struct hal_pulse *pulse = arg;
+
+  if (!pulse->driving) {
+    pulse_drive(pulse);
+    return;
+  }
+  pins[pulse->pin].out_level = 1;
+  /* the newest entry for this pin, others may have started since */
+  for (size_t i = pulse_log_count; i-- > 0 && pulse_log_count - i <= SIM_PULSE_LOG;) {
+    hal_sim_pulse_t *entry = &pulse_log[i % SIM_PULSE_LOG];
+    if (entry->pin == pulse->pin && entry->end_us < 0) {
+      entry->end_us = now_us;
+      break;
+    }
+  }
+  pulse->driving = false;
+  pulse->busy = false;
+  pulse->done(pulse->arg);
+}
+
+hal_pulse_t hal_pulse_create(int pin, hal_pulse_done_t done, void *arg) {
+  struct hal_pulse *pulse = hal_alloc(sizeof(*pulse));
+
+  pulse->pin = pin;
+  pulse->done = done;
+  pulse->arg = arg;
+  snprintf(pulse->name, sizeof(pulse->name), "pulse%d", pin);
+  pulse->timer = hal_timer_create(pulse->name, pulse_timer, pulse);
+  hal_gpio_config_output_od(1ULL << pin);
+  return pulse;
+}
+
+bool hal_pulse_start(hal_pulse_t pulse, uint32_t delay_us, uint32_t width_us) {
+  if (pulse->busy) return false;
+  pulse->busy = true;
+  pulse->width_us = width_us;
+  pulse->driving = false;
+  if (delay_us) hal_timer_start_once(pulse->timer, delay_us);
+  else pulse_drive(pulse);
+  return true;
+}
+
+bool hal_pulse_busy(hal_pulse_t pulse) {
+  return pulse->busy;
+}
+
+size_t hal_sim_pulses(hal_sim_pulse_t *out, size_t max) {
+  size_t n = pulse_log_count < SIM_PULSE_LOG ? pulse_log_count : SIM_PULSE_LOG;
+  size_t first = pulse_log_count - n;
+
+  if (n > max) {
+    first += n - max;
+    n = max;
+  }
+  for (size_t i = 0; i < n; i++)
+    out[i] = pulse_log[(first + i) % SIM_PULSE_LOG];
+  return n;
+}
+
+/****************************************************************************
+ * tasks and queues
+ */
+
+struct hal_queue {
+  uint8_t *items;
+  size_t length, item_size;
+  size_t head, count;
+  bool waiting;			/* the consumer is blocked in receive */
+  bool woken;			/* and has been counted as running again */
+  int64_t deadline;		/* of that receive, -1 for none */
+  pthread_cond_t cond;
+  struct hal_queue *next;
+};
+
+static struct hal_queue *queues;
+
+struct task_start {
+  hal_task_fn_t fn;
+  const char *name;
+  void *arg;
+};
+
+static void *task_thread(void *p) {
+  struct task_start start = *(struct task_start *)p;
+
+  free(p);
+  task_name = start.name;
+  pthread_mutex_lock(&cpu);
+  if (task_count < SIM_MAX_TASKS) {
+    current_task = &tasks[task_count++];
+    current_task->name = start.name;
+  }
+  cpu_start();
+  start.fn(start.arg);
+  cpu_stop();
+  if (--running == 0) pthread_cond_broadcast(&idle);
+  pthread_mutex_unlock(&cpu);
+  return NULL;
+}
+
+/* Threads have stacks of their own, the storage goes unused */
+void hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack,
+		     void *arg, int priority, void *storage) {
+  struct task_start *start = malloc(sizeof(*start));
+  pthread_t thread;
+
+  start->fn = fn;
+  start->name = name;
+  start->arg = arg;
+  running++;
+  if (pthread_create(&thread, NULL, task_thread, start) != 0) {
+    perror("pthread_create");
+    exit(1);
+  }
+  pthread_detach(thread);
+}
+
+const char *hal_task_name(void) {
+  return task_name;
+}
+
+_Static_assert(sizeof(struct hal_queue) <= HAL_QUEUE_CB_BYTES, "HAL_QUEUE_CB_BYTES too small");
+
+hal_queue_t hal_queue_create(size_t length, size_t item_size, void *storage) {
+  struct hal_queue *queue = storage;
+
+  memset(queue, 0, sizeof(*queue));
+  queue->items = (uint8_t *)storage + HAL_QUEUE_CB_BYTES;
+  queue->length = length;
+  queue->item_size = item_size;
+  queue->deadline = -1;
+  pthread_cond_init(&queue->cond, NULL);
+  queue->next = queues;
+  queues = queue;
+  return queue;
+}
+
+static void queue_wake(struct hal_queue *queue) {
+  if (queue->waiting && !queue->woken) {
+    queue->woken = true;
+    running++;
+    stats.task_wakeups++;
+    pthread_cond_signal(&queue->cond);
+  }
+}
+
+bool hal_queue_send(hal_queue_t queue, const void *item) {
+  if (queue->count == queue->length) return false;
+  memcpy(queue->items + ((queue->head + queue->count) % queue->length) * queue->item_size,
+	 item, queue->item_size);
+  queue->count++;
+  queue_wake(queue);
+  return true;
+}
+
+bool hal_queue_send_from_isr(hal_queue_t queue, const void *item) {
+  return hal_queue_send(queue, item);
+}
+
+bool hal_queue_receive(hal_queue_t queue, void *item, int64_t timeout_us) {
+  int64_t deadline = timeout_us < 0 ? -1 : now_us + timeout_us;
+
+  while (queue->count == 0) {
+    if (deadline >= 0 && now_us >= deadline) return false;
+    queue->waiting = true;
+    queue->woken = false;
+    queue->deadline = deadline;
+    cpu_stop();
+    if (--running == 0) pthread_cond_broadcast(&idle);
+    pthread_cond_wait(&queue->cond, &cpu);
+    cpu_start();
+    /* a spurious wakeup was not counted by queue_wake() */
+    if (!queue->woken) running++;
+    queue->waiting = false;
+  }
+  memcpy(item, queue->items + queue->head * queue->item_size, queue->item_size);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  return true;
+}
+
+/* Only one thing runs at a time here, so a mutex is never contended;
+ * it is a real one all the same */
+struct hal_mutex {
+  pthread_mutex_t mutex;
+};
+
+_Static_assert(sizeof(struct hal_mutex) <= HAL_MUTEX_STORAGE_SIZE, "HAL_MUTEX_STORAGE_SIZE too small");
+
+hal_mutex_t hal_mutex_create(void *storage) {
+  struct hal_mutex *mutex = storage;
+
+  pthread_mutex_init(&mutex->mutex, NULL);
+  return mutex;
+}
+
+void hal_mutex_lock(hal_mutex_t mutex) {
+  pthread_mutex_lock(&mutex->mutex);
+}
+
+void hal_mutex_unlock(hal_mutex_t mutex) {
+  pthread_mutex_unlock(&mutex->mutex);
+}
+
+/****************************************************************************
+ * simulator
+ */
+
+void hal_sim_init(void) {
+  /* undriven inputs read high, as the sensors and their pull-ups do */
+  for (int pin = 0; pin < SIM_PINS; pin++)
+    pins[pin].in_level = 1;
+  pthread_mutex_lock(&cpu);
+}
+
+static void wait_idle(void) {
+  while (running > 0)
+    pthread_cond_wait(&idle, &cpu);
+}
+
+void hal_sim_advance_to(int64_t time_us) {
+  for (;;) {
+    struct hal_timer *due = NULL;
+    int64_t next = time_us;
+    bool woke = false;
+
+    wait_idle();
+
+    /* tasks whose receive timed out go first, then timers in expiry order */
+    for (struct hal_queue *q = queues; q; q = q->next) {
+      if (q->waiting && !q->woken && q->deadline >= 0 && q->deadline <= next) {
+	if (q->deadline <= now_us) {
+	  queue_wake(q);
+	  woke = true;
+	} else {
+	  next = q->deadline;
+	}
+      }
+    }
+    if (woke) continue;
+
+    for (struct hal_timer *t = timers; t; t = t->next) {
+      if (t->expiry >= 0 && t->expiry <= next && (!due || t->expiry < due->expiry)) {
+	due = t;
+	next = t->expiry;
+      }
+    }
+
+    if (next > now_us) now_us = next;
+    if (due && due->expiry <= now_us) {
+      due->expiry = -1;
+      task_name = "esp_timer";
+      stats.timer_callbacks++;
+      sim_wake(&due->wakeups, &due->shared);
+      cpu_start();
+      due->callback(due->arg);
+      cpu_stop();
+      task_name = "main";
+      continue;
+    }
+    if (now_us >= time_us) break;
+  }
+}
+
+void hal_sim_advance(int64_t us) {
+  hal_sim_advance_to(now_us + us);
+}
+
+void hal_sim_get_stats(hal_sim_stats_t *out) {
+  *out = stats;
+}
+
+size_t hal_sim_wake_sources(hal_sim_wake_source_t *out, size_t max) {
+  size_t n = 0;
+
+  for (struct hal_timer *t = timers; t && n < max; t = t->next) {
+    if (!t->wakeups && !t->shared) continue;
+    snprintf(out[n].name, sizeof(out[n].name), "%s", t->name);
+    out[n].wakeups = t->wakeups;
+    out[n].shared = t->shared;
+    n++;
+  }
+  for (int pin = 0; pin < SIM_PINS && n < max; pin++) {
+    if (!pins[pin].wakeups && !pins[pin].shared) continue;
+    snprintf(out[n].name, sizeof(out[n].name), "gpio%d", pin);
+    out[n].wakeups = pins[pin].wakeups;
+    out[n].shared = pins[pin].shared;
+    n++;
+  }
+  return n;
+}
+
+/****************************************************************************
+ * system
+ */
+
+uint32_t hal_free_heap(void) {
+  return mallinfo2().fordblks;
+}
+
+void hal_heap_stats(hal_heap_stats_t *out) {
+  static uint32_t min_free = UINT32_MAX;
+
+  out->free = hal_free_heap();
+  if (out->free < min_free) min_free = out->free;
+  out->min_free = min_free;
+  /* glibc can always grow the heap, free space is as good as it gets */
+  out->largest_block = out->free;
+}
+
+static metric_t late_allocs = METRIC_COUNTER_INIT("heap.late_allocs");
+static bool heap_sealed, heap_strict;
+
+void *hal_alloc(size_t size) {
+  if (heap_sealed) {
+    metric_inc(&late_allocs);
+    fprintf(stderr, "hal_alloc: %zu bytes after boot\n", size);
+    assert(!heap_strict);
+  }
+  return calloc(1, size);
+}
+
+void hal_heap_seal(bool strict) {
+  metrics_register(&late_allocs);
+  heap_strict = strict;
+  heap_sealed = true;
+}
+
+/* CPU time is charged in host microseconds against simulated ones */
+size_t hal_task_stats(hal_task_stat_t *out, size_t max, uint32_t *total_runtime) {
+  size_t i;
+
+  for (i = 0; i < task_count && i < max; i++) {
+    snprintf(out[i].name, sizeof(out[i].name), "%s", tasks[i].name);
+    out[i].runtime = tasks[i].cpu_ns / 1000;
+    out[i].stack_free = 0;
+  }
+  *total_runtime = now_us;
+  return i;
+}
+
+void hal_power_init(bool light_sleep) {
+}
+
+/* Modelled: awake for the CPU time used plus HAL_SIM_WAKE_US a wakeup */
+uint32_t hal_power_sleep_pct(void) {
+  static int64_t time_last, cpu_last;
+  static uint32_t wakeups_last;
+  int64_t elapsed = now_us - time_last;
+  int64_t awake = (stats.cpu_ns - cpu_last) / 1000 +
+    (int64_t)(stats.wakeups - wakeups_last) * HAL_SIM_WAKE_US;
+  uint32_t pct = elapsed > awake ? (elapsed - awake) * 100 / elapsed : 0;
+
+  time_last = now_us;
+  cpu_last = stats.cpu_ns;
+  wakeups_last = stats.wakeups;
+  return pct;
+}
+
+static hal_reset_t reset_reason = HAL_RESET_POWER_ON;
+
+hal_reset_t hal_reset_reason(void) {
+  return reset_reason;
+}
+
+void hal_sim_set_reset_reason(hal_reset_t reason) {
+  reset_reason = reason;
+}
+
+/* table driven, like the ESP32's ROM routine, so the host benches see
+ * a similar cost */
+uint32_t hal_crc32(uint32_t crc, const void *data, size_t len) {
+  static uint32_t table[256];
+  const uint8_t *p = data;
+
+  if (!table[1]) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int bit = 0; bit < 8; bit++)
+	c = c >> 1 ^ (0xEDB88320u & -(c & 1));
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while (len--) crc = crc >> 8 ^ table[(crc ^ *p++) & 0xFF];
+  return ~crc;
+}
+
+bool hal_ptr_in_rodata(const void *ptr) {
+  /* format strings are not looked up in a host binary */
+  return false;
+}
+
+/****************************************************************************
+ * non-volatile storage, kept in memory for the length of a run
+ */
+
+struct nvs_blob {
+  char ns[16], key[16];
+  size_t len;
+  struct nvs_blob *next;
+  uint8_t data[];
+};
+
+static struct nvs_blob *nvs;
+
+static struct nvs_blob **nvs_find(const char *ns, const char *key) {
+  struct nvs_blob **b;
+
+  for (b = &nvs; *b; b = &(*b)->next)
+    if (!strcmp((*b)->ns, ns) && !strcmp((*b)->key, key)) break;
+  return b;
+}
+
+bool hal_nvs_get_blob(const char *ns, const char *key, void *data, size_t *len) {
+  struct nvs_blob *b = *nvs_find(ns, key);
+
+  if (!b || b->len > *len) return false;
+  memcpy(data, b->data, b->len);
+  *len = b->len;
+  return true;
+}
+
+bool hal_nvs_set_blob(const char *ns, const char *key, const void *data, size_t len) {
+  struct nvs_blob **b = nvs_find(ns, key);
+  struct nvs_blob *old = *b;
+  struct nvs_blob *blob = malloc(sizeof(*blob) + len);
+
+  if (!blob) return false;
+  snprintf(blob->ns, sizeof(blob->ns), "%s", ns);
+  snprintf(blob->key, sizeof(blob->key), "%s", key);
+  blob->len = len;
+  memcpy(blob->data, data, len);
+  blob->next = old ? old->next : NULL;
+  *b = blob;
+  free(old);
+  return true;
+}
+
+/****************************************************************************
+ * flash partitions, each a file
+ */
+
+#define SIM_MAX_FLASH 2
+
+static struct hal_flash {
+  char label[16];
+  FILE *file;
+  size_t size;
+  uint32_t *erases;		/* per sector */
+  uint32_t bad_writes;
+} flash_parts[SIM_MAX_FLASH];
+static size_t flash_count;
+
+static struct hal_flash *flash_find(const char *label) {
+  for (size_t i = 0; i < flash_count; i++)
+    if (!strcmp(flash_parts[i].label, label)) return &flash_parts[i];
+  return NULL;
+}
+
+bool hal_sim_flash(const char *label, const char *path, size_t size) {
+  struct hal_flash *flash;
+  long end;
+
+  if (flash_count == SIM_MAX_FLASH || size % HAL_FLASH_SECTOR) return false;
+  flash = &flash_parts[flash_count];
+  flash->file = path ? fopen(path, "r+b") : tmpfile();
+  if (!flash->file && path) flash->file = fopen(path, "w+b");
+  if (!flash->file) return false;
+  fseek(flash->file, 0, SEEK_END);
+  for (end = ftell(flash->file); end < (long)size; end++) fputc(0xFF, flash->file);
+  snprintf(flash->label, sizeof(flash->label), "%s", label);
+  flash->size = size;
+  flash->erases = calloc(size / HAL_FLASH_SECTOR, sizeof(uint32_t));
+  flash_count++;
+  return true;
+}
+
+bool hal_sim_flash_stats(const char *label, hal_sim_flash_stats_t *out) {
+  struct hal_flash *flash = flash_find(label);
+
+  if (!flash) return false;
+  out->erases_min = UINT32_MAX;
+  out->erases_max = 0;
+  for (size_t i = 0; i < flash->size / HAL_FLASH_SECTOR; i++) {
+    if (flash->erases[i] < out->erases_min) out->erases_min = flash->erases[i];
+    if (flash->erases[i] > out->erases_max) out->erases_max = flash->erases[i];
+  }
+  out->bad_writes = flash->bad_writes;
+  return true;
+}
+
+hal_flash_t hal_flash_open(const char *label) {
+  return flash_find(label);
+}
+
+size_t hal_flash_size(hal_flash_t flash) {
+  return flash->size;
+}
+
+bool hal_flash_read(hal_flash_t flash, uint32_t offset, void *data, size_t len) {
+  if (offset > flash->size || len > flash->size - offset) return false;
+  fseek(flash->file, offset, SEEK_SET);
+  return fread(data, 1, len, flash->file) == len;
+}
+
+bool hal_flash_write(hal_flash_t flash, uint32_t offset, const void *data, size_t len) {
+  const uint8_t *in = data;
+  uint8_t old[256];
+  size_t n, i;
+  bool bad = false;
+
+  while (len) {
+    n = len < sizeof(old) ? len : sizeof(old);
+    if (!hal_flash_read(flash, offset, old, n)) return false;
+    for (i = 0; i < n; i++) {
+      if (in[i] & ~old[i]) bad = true;
+      old[i] &= in[i];
+    }
+    fseek(flash->file, offset, SEEK_SET);
+    if (fwrite(old, 1, n, flash->file) != n) return false;
+    in += n;
+    offset += n;
+    len -= n;
+  }
+  if (bad) flash->bad_writes++;
+  return true;
+}
+
+bool hal_flash_erase(hal_flash_t flash, uint32_t offset, size_t len) {
+  static const uint8_t erased[HAL_FLASH_SECTOR] = { [0 ... HAL_FLASH_SECTOR - 1] = 0xFF };
+
+  if (offset % HAL_FLASH_SECTOR || len % HAL_FLASH_SECTOR ||
+      offset > flash->size || len > flash->size - offset)
+    return false;
+  for (; len; offset += HAL_FLASH_SECTOR, len -= HAL_FLASH_SECTOR) {
+    fseek(flash->file, offset, SEEK_SET);
+    if (fwrite(erased, 1, sizeof(erased), flash->file) != sizeof(erased)) return false;
+    flash->erases[offset / HAL_FLASH_SECTOR]++;
+  }
+  return true;
+}
+
+/****************************************************************************
+ * network
+ */
+
+static hal_net_cb_t net_callback;
+
+void hal_net_set_callback(hal_net_cb_t callback) {
+  net_callback = callback;
+}
+
+const char *hal_net_hostname(void) {
+  return "garage-sim";
+}
+
+void hal_sim_net_up(const char *ip) {
+  if (net_callback) net_callback(true, ip);
+}
+
+void hal_sim_net_down(void) {
+  if (net_callback) net_callback(false, NULL);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+
+/* Simulator controls for the POSIX HAL.
+ *
+ * Time only moves in hal_sim_advance().  The calling thread holds the
+ * simulated CPU from hal_sim_init() on; HAL tasks run as threads but
+ * only one thing executes at a time, and the clock is not advanced
+ * until every task is blocked, so a run is repeatable.
+ */
+
+void hal_sim_init(void);
+
+/* Run timers and tasks until the virtual clock has moved on by us */
+void hal_sim_advance(int64_t us);
+void hal_sim_advance_to(int64_t time_us);
+
+/* Drive an input pin from outside; fires its ISR on a change */
+void hal_sim_gpio_input(int pin, int level);
+/* Level an output pin is driving, or -1 if it is not an output */
+int hal_sim_gpio_output(int pin);
+
+typedef struct {
+  uint32_t timer_callbacks;
+  uint32_t isr_calls;
+  uint32_t task_wakeups;
+  uint32_t wakeups;		/* distinct instants a timer or ISR ran at */
+  /* thread CPU time spent in callbacks, ISRs and tasks, not the simulator */
+  int64_t cpu_ns;
+} hal_sim_stats_t;
+
+void hal_sim_get_stats(hal_sim_stats_t *stats);
+
+/* What a light sleeping chip would be woken for: each timer and ISR pin
+ * with the wakeups it caused and the ones it shared with another source
+ * due at the same instant */
+typedef struct {
+  char name[24];
+  uint32_t wakeups;
+  uint32_t shared;
+} hal_sim_wake_source_t;
+
+size_t hal_sim_wake_sources(hal_sim_wake_source_t *sources, size_t max);
+
+/* Modelled time awake for one wakeup: leaving light sleep, the
+ * scheduler and going back, on top of the CPU time measured */
+#define HAL_SIM_WAKE_US 1000
+
+/* The last pulses hal_pulse drove, oldest first; end_us is -1 while
+ * one is still low */
+typedef struct {
+  int pin;
+  int64_t start_us;
+  int64_t end_us;
+} hal_sim_pulse_t;
+
+size_t hal_sim_pulses(hal_sim_pulse_t *pulses, size_t max);
+
+/* What hal_reset_reason() reports from now on.  Noinit memory is
+ * plain memory on the host, so setting this and starting a module
+ * again stands in for a reset. */
+void hal_sim_set_reset_reason(hal_reset_t reason);
+
+/* Back the flash partition label with the file at path, or a
+ * temporary one if path is NULL, of size bytes; what the file lacks
+ * reads as erased.  Writes are ANDed into what is there, as on NOR
+ * flash, and the ones that would have needed an erase are counted. */
+bool hal_sim_flash(const char *label, const char *path, size_t size);
+
+typedef struct {
+  uint32_t erases_min;		/* of any one sector */
+  uint32_t erases_max;
+  uint32_t bad_writes;
+} hal_sim_flash_stats_t;
+
+bool hal_sim_flash_stats(const char *label, hal_sim_flash_stats_t *stats);
+
+/* The SNTP server answers: from now on the wall clock reads utc_us
+ * plus the virtual time since.  Ignored until hal_sntp_init(). */
+void hal_sim_sntp_reply(int64_t utc_us);
+
+void hal_sim_net_up(const char *ip);
+void hal_sim_net_down(void);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Checks and timing for the host unit tests, host/test_*.c.
+ *
+ * Each test is one program.  A CHECK that fails prints where and why
+ * and the run carries on; test_report() prints the tally and gives the
+ * exit status.  Run with -b, a test times its module instead (make -C
+ * host bench).
+ */
+
+static int test_checks, test_failures;
+
+#define CHECK(cond, ...) do {						\
+    test_checks++;							\
+    if (!(cond)) {							\
+      test_failures++;							\
+      printf("%s:%d: ", __FILE__, __LINE__);				\
+      printf(__VA_ARGS__);						\
+      printf("\n");							\
+    }									\
+  } while (0)
+
+static inline int test_report(const char *name) {
+  printf("--- %s: %d checks, %s\n", name, test_checks,
+	 test_failures ? "FAILED" : "all passed");
+  return test_failures != 0;
+}
+
+static inline int test_bench_mode(int argc, char **argv) {
+  return argc > 1 && !strcmp(argv[1], "-b");
+}
+
+static inline int64_t test_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
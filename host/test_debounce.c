@@ -0,0 +1,151 @@
+#include "host_test.h"
+#include "garage_config.h"
+#include "debounce.h"
+
+/* The debounce filter on its own: a bounce train, a glitch shorter
+ * than the window and a clean edge, with the sensors' configuration.
+ * -b times debounce_update() per sample and reports how long after
+ * the last bounce a level is accepted. */
+
+#define MS(x) ((int64_t)(x) * 1000)
+
+static const debounce_config_t config = {
+  .assert_ms = GARAGE_SENSOR_SETTLE_MILLISECONDS,
+  .release_ms = GARAGE_SENSOR_RELEASE_MILLISECONDS,
+  .glitch_ms = GARAGE_SENSOR_GLITCH_MILLISECONDS,
+};
+
+/* Chatter from !level to level starting at t: n short excursions, 2 ms
+ * at level and 3 ms back, then level for good.  Returns when the last
+ * edge was. */
+static int64_t bounce(debounce_t *db, bool level, int64_t t, int n) {
+  for (int i = 0; i < n; i++) {
+    CHECK(!debounce_update(db, level, t), "output changed on bounce %d", i);
+    t += MS(2);
+    CHECK(!debounce_update(db, !level, t), "output changed on bounce %d", i);
+    t += MS(3);
+  }
+  CHECK(!debounce_update(db, level, t), "output changed on the last edge");
+  return t;
+}
+
+/* Poll until just short of when, then at when: the output must change
+ * only at the second */
+static void expect_change_at(debounce_t *db, int64_t when, bool level) {
+  CHECK(debounce_deadline_us(db) == when, "deadline %lld, expected %lld",
+	(long long)debounce_deadline_us(db), (long long)when);
+  CHECK(!debounce_poll(db, when - 1), "changed 1 us early");
+  CHECK(debounce_level(db) != level, "already %d before the window", level);
+  CHECK(debounce_poll(db, when), "no change once the window passed");
+  CHECK(debounce_level(db) == level, "output %d, expected %d", debounce_level(db), level);
+  CHECK(debounce_is_settled(db), "not settled after the change");
+}
+
+static void test_bounce_train(void) {
+  debounce_t db;
+  int64_t last;
+
+  debounce_init(&db, &config, false, 0);
+  last = bounce(&db, true, MS(1000), 5);
+  /* the settle is timed from the last edge, the runs before it were
+   * glitches */
+  expect_change_at(&db, last + MS(config.assert_ms), true);
+  CHECK(db.stable_since_us == last, "stable since %lld, expected %lld",
+	(long long)db.stable_since_us, (long long)last);
+  CHECK(db.glitches == 5, "%u glitches counted, expected 5", (unsigned)db.glitches);
+
+  /* and back, with release_ms */
+  last = bounce(&db, false, MS(5000), 3);
+  expect_change_at(&db, last + MS(config.release_ms), false);
+}
+
+static void test_short_glitch(void) {
+  debounce_t db;
+  int64_t t = MS(1000);
+
+  /* a stable level that drops out briefly never changes */
+  debounce_init(&db, &config, true, 0);
+  CHECK(!debounce_update(&db, false, t), "changed on a glitch");
+  CHECK(!debounce_update(&db, true, t + MS(config.glitch_ms) - 1), "changed on a glitch");
+  CHECK(debounce_is_settled(&db), "glitch left a deadline pending");
+  CHECK(!debounce_poll(&db, t + MS(10000)), "changed after a glitch");
+  CHECK(debounce_level(&db), "a glitch got through");
+  CHECK(db.glitches == 1, "%u glitches counted, expected 1", (unsigned)db.glitches);
+
+  /* nor does one restart a settle already under way */
+  debounce_init(&db, &config, false, 0);
+  CHECK(!debounce_update(&db, true, t), "changed on the edge");
+  CHECK(!debounce_update(&db, false, t + MS(100)), "changed on a glitch");
+  CHECK(!debounce_update(&db, true, t + MS(105)), "changed after a glitch");
+  expect_change_at(&db, t + MS(config.assert_ms), true);
+}
+
+static void test_real_edge(void) {
+  debounce_t db;
+  int64_t t = MS(1000);
+  debounce_sample_t samples[] = {
+    { t, true }, { t + MS(config.assert_ms), true },
+  };
+
+  debounce_init(&db, &config, false, 0);
+  CHECK(debounce_is_settled(&db), "pending at init");
+  CHECK(!debounce_update(&db, true, t), "changed on the edge");
+  expect_change_at(&db, t + MS(config.assert_ms), true);
+
+  /* a batch is the same samples one at a time */
+  debounce_init(&db, &config, false, 0);
+  CHECK(debounce_update_batch(&db, samples, 2), "batch did not change the output");
+  CHECK(debounce_level(&db), "batch output still false");
+}
+
+/****************************************************************************
+ * Bench
+ */
+
+#define BENCH_SAMPLES 10000000
+
+static void bench_per_sample(const char *name, int edge_every) {
+  debounce_t db;
+  int64_t t = 0, start, ns;
+  bool level = false;
+
+  debounce_init(&db, &config, false, 0);
+  start = test_now_ns();
+  for (int i = 0; i < BENCH_SAMPLES; i++) {
+    if (edge_every && i % edge_every == 0) level = !level;
+    debounce_update(&db, level, t);
+    t += 1000;
+  }
+  ns = test_now_ns() - start;
+  printf("debounce %-24s %6.1f ns per sample\n", name, (double)ns / BENCH_SAMPLES);
+}
+
+/* Latency from the first and from the last edge of n bounces */
+static void bench_settle(int n) {
+  debounce_t db;
+  int64_t first = MS(1000), last, t;
+  char name[32];
+
+  debounce_init(&db, &config, false, 0);
+  last = bounce(&db, true, first, n);
+  for (t = last; !debounce_poll(&db, t); t += 100)
+    ;
+  snprintf(name, sizeof(name), "settle, %d bounces", n);
+  printf("debounce %-24s %6.1f ms after the first edge, %.1f after the last\n",
+	 name, (t - first) / 1e3, (t - last) / 1e3);
+}
+
+int main(int argc, char **argv) {
+  if (test_bench_mode(argc, argv)) {
+    bench_per_sample("steady input", 0);
+    bench_per_sample("edge every 10 samples", 10);
+    bench_per_sample("edge every sample", 1);
+    bench_settle(0);
+    bench_settle(5);
+    return 0;
+  }
+  test_bounce_train();
+  test_short_glitch();
+  test_real_edge();
+  return test_report("debounce");
+}
@@ -0,0 +1,164 @@
+#include "host_test.h"
+#include "door_fsm.h"
+
+/* The transition table against the if/else code it replaced: every
+ * (state, target, event) goes through door_fsm_dispatch() and through
+ * a copy of the old garage_control.c logic, and the next state, target,
+ * notification, relay pulses and stuck timer must agree.  -b times
+ * door_fsm_dispatch() per transition. */
+
+/****************************************************************************
+ * The old logic: set_current_state() and the sensor, stuck timer and
+ * command paths that called it, as garage_control.c had them before
+ * door_fsm.c
+ */
+
+typedef struct {
+  garage_state_t current, target, last_good;
+  bool stuck_running;
+  bool notified, pulse_open, pulse_close;
+} old_door_t;
+
+static void old_set_current_state(old_door_t *d, garage_state_t state) {
+  if (state == d->current) return;
+  if (d->current == GARAGE_OPEN || d->current == GARAGE_CLOSED) d->stuck_running = true;
+  d->current = state;
+  switch (state) {
+  case GARAGE_OPEN:
+  case GARAGE_CLOSED:
+  case GARAGE_STOPPED:
+    d->last_good = state;
+    d->target = (state == GARAGE_CLOSED ? GARAGE_CLOSED : GARAGE_OPEN);
+    d->stuck_running = false;
+    break;
+  case GARAGE_OPENING:
+    d->target = GARAGE_OPEN;
+    break;
+  case GARAGE_CLOSING:
+    d->target = GARAGE_CLOSED;
+    break;
+  }
+  d->notified = true;
+}
+
+static void old_event(old_door_t *d, door_event_t event) {
+  switch (event) {
+  case DOOR_EV_SENSOR_OPEN: old_set_current_state(d, GARAGE_OPEN); break;
+  case DOOR_EV_SENSOR_CLOSED: old_set_current_state(d, GARAGE_CLOSED); break;
+  case DOOR_EV_SENSOR_NONE:
+    if (d->last_good == GARAGE_OPEN) old_set_current_state(d, GARAGE_CLOSING);
+    else if (d->last_good == GARAGE_CLOSED) old_set_current_state(d, GARAGE_OPENING);
+    break;
+  case DOOR_EV_STUCK:
+    /* the timer only fires while it runs */
+    if (d->stuck_running) old_set_current_state(d, GARAGE_STOPPED);
+    d->stuck_running = false;
+    break;
+  case DOOR_EV_CMD_OPEN: d->pulse_open = true; d->target = GARAGE_OPEN; break;
+  case DOOR_EV_CMD_CLOSE: d->pulse_close = true; d->target = GARAGE_CLOSED; break;
+  default: break;
+  }
+}
+
+/* How the old code got into each state: a door in transit came from
+ * the other resting state with the stuck timer running */
+static old_door_t old_door(garage_state_t state, garage_state_t target) {
+  old_door_t d = { state, target, state, false, false, false, false };
+
+  if (state == GARAGE_OPENING) d.last_good = GARAGE_CLOSED;
+  if (state == GARAGE_CLOSING) d.last_good = GARAGE_OPEN;
+  d.stuck_running = (state == GARAGE_OPENING || state == GARAGE_CLOSING);
+  return d;
+}
+
+static void test_against_old(void) {
+  for (int s = 0; s < DOOR_STATE_COUNT; s++) {
+    for (int t = GARAGE_OPEN; t <= GARAGE_CLOSED; t++) {
+      for (int e = 0; e < DOOR_EV_COUNT; e++) {
+	old_door_t old = old_door(s, t);
+	bool stuck_running = old.stuck_running;
+	door_fsm_t fsm;
+	uint8_t actions;
+
+	door_fsm_init(&fsm, s, t);
+	actions = door_fsm_dispatch(&fsm, e, 0);
+	old_event(&old, e);
+	if (actions & DOOR_ACT_STUCK_START) stuck_running = true;
+	if (actions & DOOR_ACT_STUCK_STOP) stuck_running = false;
+
+#define CASE door_state_str(s), door_state_str(t), door_event_str(e)
+	CHECK(fsm.state == old.current, "%s/%s %s: state %s, was %s", CASE,
+	      door_state_str(fsm.state), door_state_str(old.current));
+	CHECK(fsm.target == old.target, "%s/%s %s: target %s, was %s", CASE,
+	      door_state_str(fsm.target), door_state_str(old.target));
+	CHECK(!!(actions & DOOR_ACT_NOTIFY) == old.notified, "%s/%s %s: notify %d, was %d",
+	      CASE, !!(actions & DOOR_ACT_NOTIFY), old.notified);
+	CHECK(!!(actions & DOOR_ACT_PULSE_OPEN) == old.pulse_open &&
+	      !!(actions & DOOR_ACT_PULSE_CLOSE) == old.pulse_close,
+	      "%s/%s %s: pulses open %d close %d, were %d %d", CASE,
+	      !!(actions & DOOR_ACT_PULSE_OPEN), !!(actions & DOOR_ACT_PULSE_CLOSE),
+	      old.pulse_open, old.pulse_close);
+	CHECK(stuck_running == old.stuck_running, "%s/%s %s: stuck timer %s, was %s", CASE,
+	      stuck_running ? "running" : "stopped", old.stuck_running ? "running" : "stopped");
+	/* what changed is in the trace */
+	CHECK(door_fsm_trace(&fsm, NULL, 0) == 0, "trace copied into nothing");
+	CHECK(fsm.trace_count == (actions != 0), "%s/%s %s: %u trace entries", CASE,
+	      (unsigned)fsm.trace_count);
+#undef CASE
+      }
+    }
+  }
+}
+
+static void test_trace(void) {
+  door_fsm_t fsm;
+  door_fsm_trace_t trace[DOOR_FSM_TRACE_LEN];
+  size_t n;
+
+  door_fsm_init(&fsm, GARAGE_CLOSED, GARAGE_CLOSED);
+  /* more than the ring holds: the oldest are lost */
+  for (int i = 0; i < DOOR_FSM_TRACE_LEN + 3; i++) {
+    door_fsm_dispatch(&fsm, DOOR_EV_SENSOR_NONE, i * 2);
+    door_fsm_dispatch(&fsm, DOOR_EV_SENSOR_CLOSED, i * 2 + 1);
+  }
+  n = door_fsm_trace(&fsm, trace, DOOR_FSM_TRACE_LEN);
+  CHECK(n == DOOR_FSM_TRACE_LEN, "%u trace entries", (unsigned)n);
+  CHECK(trace[0].time_us == 2 * (DOOR_FSM_TRACE_LEN + 3) - DOOR_FSM_TRACE_LEN,
+	"oldest entry at %lld", (long long)trace[0].time_us);
+  CHECK(trace[n - 1].to == GARAGE_CLOSED && trace[n - 1].from == GARAGE_OPENING,
+	"newest entry %s -> %s", door_state_str(trace[n - 1].from),
+	door_state_str(trace[n - 1].to));
+}
+
+/****************************************************************************
+ * Bench
+ */
+
+#define BENCH_ROUNDS 10000000
+
+static void bench(const char *name, const door_event_t *events, int n) {
+  door_fsm_t fsm;
+  int64_t start, ns;
+
+  door_fsm_init(&fsm, GARAGE_CLOSED, GARAGE_CLOSED);
+  start = test_now_ns();
+  for (int i = 0; i < BENCH_ROUNDS; i++) door_fsm_dispatch(&fsm, events[i % n], i);
+  ns = test_now_ns() - start;
+  printf("door_fsm %-24s %6.1f ns per transition\n", name, (double)ns / BENCH_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+  if (test_bench_mode(argc, argv)) {
+    static const door_event_t cycle[] = {
+      DOOR_EV_CMD_OPEN, DOOR_EV_SENSOR_NONE, DOOR_EV_SENSOR_OPEN,
+      DOOR_EV_CMD_CLOSE, DOOR_EV_SENSOR_NONE, DOOR_EV_SENSOR_CLOSED,
+    };
+    static const door_event_t ignored[] = { DOOR_EV_SENSOR_CLOSED };
+    bench("open/close cycle", cycle, 6);
+    bench("ignored event", ignored, 1);
+    return 0;
+  }
+  test_against_old();
+  test_trace();
+  return test_report("door_fsm");
+}
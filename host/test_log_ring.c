@@ -0,0 +1,322 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include "host_test.h"
+#include "log_ring.h"
+
+/* The log ring on its own: records of every length round several laps
+ * with the pad at the end of the buffer, commit handing back unused
+ * space with and without a reservation behind it, both drop policies
+ * and what they count, and producer threads against one consumer,
+ * which must see each producer's records whole and in order.  -b
+ * times push and pop. */
+
+#define HDR 8			/* record header */
+#define ALIGN8(x) (((x) + 7) & ~7U)
+#define RECORD(len) ALIGN8(HDR + (len))
+
+static uint64_t small_buf[256 / 8];
+static uint64_t big_buf[4096 / 8];
+
+static void fill(uint8_t *p, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; i++) p[i] = (uint8_t)(seed * 31 + i);
+}
+
+static bool intact(const uint8_t *p, size_t len, uint32_t seed) {
+  for (size_t i = 0; i < len; i++)
+    if (p[i] != (uint8_t)(seed * 31 + i)) return false;
+  return true;
+}
+
+/* Lengths 0 to 60 in turn, two queued at a time: each lap ends at a
+ * different place, some on the end of the buffer and some padded */
+static void test_wrap(void) {
+  log_ring_t ring;
+  uint8_t in[64], out[64];
+  uint32_t popped = 0;
+  size_t len;
+
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_NEWEST);
+  for (uint32_t i = 0; i < 1000; i++) {
+    fill(in, i % 61, i);
+    CHECK(log_ring_push(&ring, in, i % 61), "push %u of %u bytes failed", i, i % 61);
+    for (; popped + 2 <= i + 1; popped++)
+      CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == popped % 61 &&
+	    intact(out, len, popped), "record %u came back as %zu bytes", popped, len);
+  }
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == popped % 61 &&
+	intact(out, len, popped), "last record came back as %zu bytes", len);
+  CHECK(log_ring_empty(&ring), "ring not empty after draining");
+  CHECK(log_ring_dropped(&ring) == 0, "%u dropped", (unsigned)log_ring_dropped(&ring));
+
+  /* 16 bytes left at the end: a 20 byte record pads them out */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_NEWEST);
+  fill(in, 232, 1);
+  log_ring_push(&ring, in, 8);
+  for (int i = 0; i < 14; i++) log_ring_push(&ring, in, 8);
+  CHECK(log_ring_used(&ring) == 240, "%u used, not 240", (unsigned)log_ring_used(&ring));
+  for (int i = 0; i < 15; i++) log_ring_pop(&ring, out, sizeof(out), &len);
+  fill(in, 20, 2);
+  CHECK(log_ring_push(&ring, in, 20), "padded push failed");
+  CHECK(log_ring_used(&ring) == 16 + RECORD(20), "%u used, not the pad and %u",
+	(unsigned)log_ring_used(&ring), RECORD(20));
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 20 && intact(out, 20, 2),
+	"padded record came back as %zu bytes", len);
+  CHECK(log_ring_empty(&ring), "pad left behind");
+
+  /* pop truncates to the caller's buffer */
+  fill(in, 40, 3);
+  log_ring_push(&ring, in, 40);
+  CHECK(log_ring_pop(&ring, out, 10, &len) && len == 10 && intact(out, 10, 3),
+	"truncated pop gave %zu bytes", len);
+}
+
+static void test_commit(void) {
+  log_ring_t ring;
+  log_ring_slot_t a, b;
+  uint8_t out[128];
+  size_t len;
+
+  /* the last reservation gives back what it did not use */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_NEWEST);
+  CHECK(log_ring_reserve(&ring, 100, &a), "reserve failed");
+  CHECK(log_ring_used(&ring) == RECORD(100), "%u used after reserve", (unsigned)log_ring_used(&ring));
+  fill(a.data, 10, 4);
+  log_ring_commit(&ring, &a, 10);
+  CHECK(log_ring_used(&ring) == RECORD(10), "%u used after commit, not %u",
+	(unsigned)log_ring_used(&ring), RECORD(10));
+
+  /* one behind it keeps the space, which pop then skips */
+  CHECK(log_ring_reserve(&ring, 100, &a), "reserve failed");
+  CHECK(log_ring_reserve(&ring, 10, &b), "second reserve failed");
+  fill(b.data, 10, 5);
+  log_ring_commit(&ring, &b, 10);
+  fill(a.data, 10, 6);
+  log_ring_commit(&ring, &a, 10);
+  CHECK(log_ring_used(&ring) == RECORD(10) + RECORD(100) + RECORD(10), "%u used",
+	(unsigned)log_ring_used(&ring));
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 10 && intact(out, 10, 4),
+	"first record came back as %zu bytes", len);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 10 && intact(out, 10, 6),
+	"record committed short came back as %zu bytes", len);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 10 && intact(out, 10, 5),
+	"record behind it came back as %zu bytes", len);
+  CHECK(log_ring_empty(&ring), "ring not empty");
+
+  /* nothing is visible until it is committed, even behind a commit */
+  CHECK(log_ring_reserve(&ring, 10, &a) && log_ring_reserve(&ring, 10, &b), "reserve failed");
+  log_ring_commit(&ring, &b, 10);
+  CHECK(!log_ring_pop(&ring, out, sizeof(out), &len), "popped past an uncommitted record");
+  log_ring_commit(&ring, &a, 0);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 0, "empty record gave %zu", len);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 10, "second record gave %zu", len);
+
+  /* committing more than was reserved keeps to the reservation */
+  CHECK(log_ring_reserve(&ring, 10, &a), "reserve failed");
+  log_ring_commit(&ring, &a, 50);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 10, "overlong commit gave %zu", len);
+}
+
+static void test_drop(void) {
+  log_ring_t ring;
+  log_ring_slot_t held;
+  uint8_t in[128], out[128];
+  size_t len;
+  int pushed;
+
+  /* DROP_NEWEST refuses, and counts, what does not fit */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_NEWEST);
+  for (pushed = 0; log_ring_push(&ring, in, 24); pushed++)
+    ;
+  CHECK(pushed == 256 / RECORD(24), "%d records fit, not %d", pushed, 256 / RECORD(24));
+  CHECK(log_ring_dropped(&ring) == 1, "%u dropped, not 1", (unsigned)log_ring_dropped(&ring));
+  CHECK(!log_ring_push(&ring, in, 24) && log_ring_dropped(&ring) == 2, "second refusal not counted");
+  CHECK(!log_ring_push(&ring, in, 128) && log_ring_dropped(&ring) == 3,
+	"a record over half the ring not refused");
+
+  /* DROP_OLDEST discards from the tail, counting each record */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_OLDEST);
+  for (uint32_t i = 0; i < 20; i++) {
+    fill(in, 24, i);
+    CHECK(log_ring_push(&ring, in, 24), "push %u failed", i);
+  }
+  CHECK(log_ring_dropped(&ring) == 20 - 256 / RECORD(24), "%u dropped, not %d",
+	(unsigned)log_ring_dropped(&ring), 20 - 256 / RECORD(24));
+  for (uint32_t i = 20 - 256 / RECORD(24); i < 20; i++)
+    CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 24 && intact(out, 24, i),
+	  "record %u lost", i);
+  CHECK(log_ring_empty(&ring), "ring not empty");
+
+  /* a pad discarded on the way is not a record: of ten records, one
+   * popped and the last kept, eight were dropped */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_OLDEST);
+  for (int i = 0; i < 7; i++) log_ring_push(&ring, in, 24);	/* to 224 */
+  log_ring_pop(&ring, out, sizeof(out), &len);
+  log_ring_push(&ring, in, 32);		/* a 32 byte pad, then from the start */
+  log_ring_push(&ring, in, 120);
+  fill(in, 120, 8);
+  log_ring_push(&ring, in, 120);	/* pads again, past the first pad */
+  CHECK(log_ring_dropped(&ring) == 8, "%u dropped, not 8", (unsigned)log_ring_dropped(&ring));
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 120 && intact(out, 120, 8),
+	"last record lost");
+  CHECK(log_ring_empty(&ring), "ring not empty");
+
+  /* an uncommitted record at the tail cannot be discarded */
+  log_ring_init(&ring, small_buf, sizeof(small_buf), LOG_RING_DROP_OLDEST);
+  CHECK(log_ring_reserve(&ring, 24, &held), "reserve failed");
+  for (pushed = 0; log_ring_push(&ring, in, 24); pushed++)
+    ;
+  CHECK(pushed == 256 / RECORD(24) - 1, "%d records fit behind the reservation", pushed);
+  CHECK(log_ring_dropped(&ring) == 1, "%u dropped, not the refused one",
+	(unsigned)log_ring_dropped(&ring));
+  fill(held.data, 24, 7);
+  log_ring_commit(&ring, &held, 24);
+  CHECK(log_ring_pop(&ring, out, sizeof(out), &len) && len == 24 && intact(out, 24, 7),
+	"held record lost");
+  CHECK(log_ring_push(&ring, in, 24), "push after the commit failed");
+}
+
+/****************************************************************************
+ * Producers against one consumer
+ */
+
+#define PRODUCERS 4
+#define RECORDS 200000
+
+typedef struct {
+  uint16_t producer;
+  uint32_t seq;
+} stamp_t;
+
+static log_ring_t shared;
+static int producers_done;
+static uint32_t refused[PRODUCERS];
+
+static void *producer(void *arg) {
+  uint16_t id = (uintptr_t)arg;
+  uint8_t in[96];
+  log_ring_slot_t slot;
+
+  for (uint32_t seq = 0; seq < RECORDS; seq++) {
+    stamp_t stamp = { id, seq };
+    size_t n = sizeof(stamp) + (seq * 7 + id) % 80;
+
+    if (seq & 1) {
+      /* reserve more than is written, as the syslog formatter does */
+      if (!log_ring_reserve(&shared, 88, &slot)) {
+	refused[id]++;
+	continue;
+      }
+      memcpy(slot.data, &stamp, sizeof(stamp));
+      /* let the others in while it is half written, on one CPU too */
+      if (seq % 16 == 1) sched_yield();
+      fill(slot.data + sizeof(stamp), n - sizeof(stamp), seq + id);
+      log_ring_commit(&shared, &slot, n);
+    }else{
+      memcpy(in, &stamp, sizeof(stamp));
+      fill(in + sizeof(stamp), n - sizeof(stamp), seq + id);
+      if (!log_ring_push(&shared, in, n)) refused[id]++;
+    }
+    if (seq % 64 == 0) sched_yield();
+  }
+  __atomic_fetch_add(&producers_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void test_threads(log_ring_policy_t policy, const char *name) {
+  pthread_t threads[PRODUCERS];
+  int64_t next[PRODUCERS] = { 0 };
+  uint32_t popped = 0, bad = 0, disorder = 0, lost = 0, total_refused = 0, stuck = 0;
+  uint8_t out[128];
+  size_t len;
+
+  log_ring_init(&shared, big_buf, sizeof(big_buf), policy);
+  producers_done = 0;
+  memset(refused, 0, sizeof(refused));
+  for (uintptr_t i = 0; i < PRODUCERS; i++)
+    pthread_create(&threads[i], NULL, producer, (void *)i);
+
+  for (;;) {
+    bool done = __atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) == PRODUCERS;
+    stamp_t stamp;
+
+    if (!log_ring_pop(&shared, out, sizeof(out), &len)) {
+      if (done && log_ring_empty(&shared)) break;
+      /* with the producers gone, what is left must be poppable */
+      if (done && ++stuck > 1000) {
+	CHECK(0, "%s: ring stuck with %u bytes in it", name, (unsigned)log_ring_used(&shared));
+	break;
+      }
+      sched_yield();
+      continue;
+    }
+    popped++;
+    memcpy(&stamp, out, sizeof(stamp));
+    if (len < sizeof(stamp) || stamp.producer >= PRODUCERS ||
+	len != sizeof(stamp) + (stamp.seq * 7 + stamp.producer) % 80 ||
+	!intact(out + sizeof(stamp), len - sizeof(stamp), stamp.seq + stamp.producer)) {
+      bad++;
+      continue;
+    }
+    if (stamp.seq < next[stamp.producer]) disorder++;
+    lost += stamp.seq - next[stamp.producer];
+    next[stamp.producer] = stamp.seq + 1;
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+    total_refused += refused[i];
+    lost += RECORDS - next[i];
+  }
+
+  CHECK(bad == 0, "%s: %u of %u records torn", name, (unsigned)bad, (unsigned)popped);
+  CHECK(disorder == 0, "%s: %u records out of order", name, (unsigned)disorder);
+  CHECK(popped + log_ring_dropped(&shared) == PRODUCERS * RECORDS,
+	"%s: %u popped and %u dropped of %u", name, (unsigned)popped,
+	(unsigned)log_ring_dropped(&shared), PRODUCERS * RECORDS);
+  CHECK(lost == log_ring_dropped(&shared), "%s: %u missing, %u counted dropped", name,
+	(unsigned)lost, (unsigned)log_ring_dropped(&shared));
+  if (policy == LOG_RING_DROP_NEWEST)
+    CHECK(total_refused == log_ring_dropped(&shared), "%s: %u refused, %u counted", name,
+	  (unsigned)total_refused, (unsigned)log_ring_dropped(&shared));
+  printf("log_ring %s: %u records, %u dropped\n", name, (unsigned)popped,
+	 (unsigned)log_ring_dropped(&shared));
+}
+
+/****************************************************************************
+ * Bench
+ */
+
+#define BENCH_RECORDS 5000000
+
+static void bench(size_t n) {
+  log_ring_t ring;
+  uint8_t in[128], out[128];
+  char name[32];
+  int64_t start, ns;
+  size_t len;
+
+  log_ring_init(&ring, big_buf, sizeof(big_buf), LOG_RING_DROP_NEWEST);
+  memset(in, 'x', sizeof(in));
+  start = test_now_ns();
+  for (int i = 0; i < BENCH_RECORDS; i++) {
+    log_ring_push(&ring, in, n);
+    log_ring_pop(&ring, out, sizeof(out), &len);
+  }
+  ns = test_now_ns() - start;
+  snprintf(name, sizeof(name), "push and pop, %zu bytes", n);
+  printf("log_ring %-24s %6.1f ns per record\n", name, (double)ns / BENCH_RECORDS);
+}
+
+int main(int argc, char **argv) {
+  if (test_bench_mode(argc, argv)) {
+    bench(16);
+    bench(120);
+    return 0;
+  }
+  test_wrap();
+  test_commit();
+  test_drop();
+  test_threads(LOG_RING_DROP_NEWEST, "drop newest");
+  test_threads(LOG_RING_DROP_OLDEST, "drop oldest");
+  return test_report("log_ring");
+}
@@ -0,0 +1,190 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "host_test.h"
+#include "syslog_binary.h"
+
+/* Binary syslog records: encodes a set of messages into one frame and
+ * writes, for a prefix given on the command line,
+ *
+ *   prefix.frame     the frame
+ *   prefix.formats   the format strings by address, for
+ *                    tools/syslog_decode.py --formats
+ *   prefix.expected  what the decoder should print, from vsnprintf()
+ *
+ * make -C host test decodes the frame and compares.  The checks here
+ * cover what the decoder cannot see: a precision is never read past,
+ * and strings too long for the record are cut and marked.
+ *
+ * The decoder takes long and size_t to be 4 bytes, as on the device,
+ * so the formats here leave them out. */
+
+#define RECORD_SIZE 256			/* as syslog.c's SYSLOG_MAX_BINARY */
+#define SEVERITY 6
+#define HOSTNAME "sim"
+#define TAG "test"
+
+static uint8_t frame[16 * 1024];
+static size_t frame_len;
+static FILE *formats, *expected;
+static uint32_t msgid = 1;
+static int format_count;
+
+static void json_string(FILE *f, const char *s) {
+  fputc('"', f);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20) fprintf(f, "\\u%04x", *s);
+    else fputc(*s, f);
+  }
+  fputc('"', f);
+}
+
+/* Encode a record and return its length; text gets what vsnprintf()
+ * makes of the same message */
+static size_t encode(uint8_t *out, size_t size, char *text, size_t text_size,
+		     const char *fmt, ...) {
+  va_list args;
+  size_t len;
+
+  va_start(args, fmt);
+  len = syslog_binary_encode(out, size, SEVERITY, msgid, 1000, TAG, fmt, 0, args);
+  va_end(args);
+  va_start(args, fmt);
+  vsnprintf(text, text_size, fmt, args);
+  va_end(args);
+  return len;
+}
+
+/* A message the frame carries: encode it and note what the decoder
+ * should print */
+static void add(const char *fmt, ...) {
+  uint8_t record[RECORD_SIZE];
+  char text[1024];
+  va_list args;
+  size_t len;
+
+  va_start(args, fmt);
+  len = syslog_binary_encode(record, sizeof(record), SEVERITY, msgid, 1000, TAG, fmt, 0, args);
+  va_end(args);
+  va_start(args, fmt);
+  vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  CHECK(len > 0, "\"%s\" did not encode", fmt);
+  if (!len) return;
+
+  frame[frame_len++] = len;
+  frame[frame_len++] = len >> 8;
+  memcpy(frame + frame_len, record, len);
+  frame_len += len;
+  fprintf(formats, "%s\"0x%08x\": ", format_count++ ? ",\n " : "{", (uint32_t)(uintptr_t)fmt);
+  json_string(formats, fmt);
+  fprintf(expected, "<%d>1 - %s %s - %u %s\n", 8 + SEVERITY, HOSTNAME, TAG, msgid, text);
+  msgid++;
+}
+
+/* Four bytes with no terminator, right before a page that faults */
+static const char *unterminated(void) {
+  long page = sysconf(_SC_PAGESIZE);
+  char *p = mmap(NULL, 2 * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (p == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  mprotect(p + page, page, PROT_NONE);
+  memcpy(p + page - 4, "wxyz", 4);
+  return p + page - 4;
+}
+
+static void test_round_trip(void) {
+  const char *wxyz = unterminated();
+
+  add("plain text, 100%% of it");
+  add("ints %d %u %x %X %o %c|%5d|%-5d|%05d", -5, 7u, 0xabcu, 0xabcu, 8u, 'z', 42, 42, 42);
+  add("small %hhd %hd", -3, -300);
+  add("wide %lld %llu %llx", -1234567890123LL, 18446744073709551615ULL, 0x123456789abcULL);
+  add("floats %.2f %e %g %8.3f", 3.14159, 1e-3, 0.5, -2.25);
+  add("strings %s|%-6s|%6s|%s", "door", "ab", "ab", (char *)NULL);
+  add("precision %.3s|%.*s|%.0s|%.*s", "abcdef", 2, "xyz", "gone", -1, "all of it");
+  add("star %*d|%-*s|%*.*s|", 6, 42, 4, "ab", 5, 2, "abcdef");
+  add("unterminated %.4s %.*s", wxyz, 3, wxyz);
+  add("pointer %p", (void *)0x1234);
+}
+
+static void test_truncation(void) {
+  static const char long_fmt[] = "long %s end";
+  uint8_t record[RECORD_SIZE];
+  char text[1024], line[1024];
+  char long_string[400];
+  size_t len, at = 15 + 1 + strlen(TAG);
+  unsigned field;
+
+  memset(long_string, 'x', sizeof(long_string) - 1);
+  long_string[sizeof(long_string) - 1] = 0;
+  len = encode(record, sizeof(record), text, sizeof(text), long_fmt, long_string);
+  CHECK(len == sizeof(record), "long string filled %u of %u bytes", (unsigned)len,
+	(unsigned)sizeof(record));
+  field = record[at] | record[at + 1] << 8;
+  CHECK(field & SYSLOG_BINARY_TRUNCATED, "long string not marked truncated");
+  CHECK((field & ~SYSLOG_BINARY_TRUNCATED) == sizeof(record) - at - 2,
+	"long string kept %u bytes", field & ~SYSLOG_BINARY_TRUNCATED);
+
+  /* the decoder marks where it was cut */
+  frame[frame_len++] = len;
+  frame[frame_len++] = len >> 8;
+  memcpy(frame + frame_len, record, len);
+  frame_len += len;
+  fprintf(formats, ",\n \"0x%08x\": ", (uint32_t)(uintptr_t)long_fmt);
+  json_string(formats, long_fmt);
+  snprintf(line, sizeof(line), "long %.*s... end", (int)(field & ~SYSLOG_BINARY_TRUNCATED),
+	   long_string);
+  fprintf(expected, "<%d>1 - %s %s - %u %s\n", 8 + SEVERITY, HOSTNAME, TAG, msgid, line);
+  msgid++;
+
+  /* a string that just fits is not marked */
+  long_string[sizeof(record) - at - 2] = 0;
+  len = encode(record, sizeof(record), text, sizeof(text), "%s", long_string);
+  field = record[at] | record[at + 1] << 8;
+  CHECK(len == sizeof(record) && field == sizeof(record) - at - 2,
+	"a string that fits took %u bytes, length field %#x", (unsigned)len, field);
+
+  /* what follows a string has to fit too */
+  len = encode(record, sizeof(record), text, sizeof(text), "%s %d", long_string, 1);
+  CHECK(len == 0, "record too long for its buffer encoded to %u bytes", (unsigned)len);
+}
+
+int main(int argc, char **argv) {
+  char path[256];
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s prefix\n", argv[0]);
+    return 2;
+  }
+  snprintf(path, sizeof(path), "%s.formats", argv[1]);
+  formats = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s.expected", argv[1]);
+  expected = fopen(path, "w");
+  if (!formats || !expected) {
+    perror(path);
+    return 2;
+  }
+  frame_len = syslog_binary_frame_header(frame, HOSTNAME);
+  CHECK(frame_len == 4 + 1 + strlen(HOSTNAME) && !memcmp(frame, SYSLOG_BINARY_MAGIC, 4),
+	"frame header of %u bytes", (unsigned)frame_len);
+
+  test_round_trip();
+  test_truncation();
+
+  fprintf(formats, "}\n");
+  fclose(formats);
+  fclose(expected);
+  snprintf(path, sizeof(path), "%s.frame", argv[1]);
+  FILE *f = fopen(path, "wb");
+  if (!f || fwrite(frame, 1, frame_len, f) != frame_len || fclose(f)) {
+    perror(path);
+    return 2;
+  }
+  return test_report("syslog_binary");
+}
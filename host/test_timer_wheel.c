@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include "host_test.h"
+#include "hal_sim.h"
+#include "timer_wheel.h"
+
+/* The timer wheel against a model of what each timer should do, on the
+ * simulated clock: random starts, restarts, stops and periodic timers,
+ * from the test and from callbacks, with timeouts from under a tick to
+ * past the top level's span, with and without slack and an alignment
+ * grid.  Every expiry must be for an armed timer, never early and no
+ * later than its due time, slack and one tick; no timer may be left
+ * behind; and the armed count must agree.  -b times start and stop. */
+
+#define TIMERS 24
+#define OPS 200000
+#define TICK TIMER_WHEEL_TICK_US
+#define HOUR (3600LL * 1000000)
+
+typedef struct {
+  wheel_timer_t timer;
+  bool armed;
+  int64_t due_us;
+  uint64_t period_us;
+  uint32_t slack_us;
+  uint32_t fired;
+  int64_t fired_us;
+} model_t;
+
+static model_t model[TIMERS];
+static uint32_t fires, early, late;
+/* callbacks leave the timers alone */
+static bool quiet;
+
+static uint64_t rnd(uint64_t n) {
+  return n ? ((uint64_t)random() << 31 ^ random()) % n : 0;
+}
+
+/* Mostly short, sometimes hours: past TIMER_WHEEL_LEVELS levels they
+ * go round the top level again */
+static uint64_t random_timeout(void) {
+  switch (rnd(8)) {
+  case 0: return rnd(TICK);
+  case 1: return rnd(10 * HOUR);
+  case 2: return rnd(HOUR);
+  case 3: return rnd(60 * 1000000);
+  default: return rnd(500 * 1000);
+  }
+}
+
+static uint32_t random_slack(void) {
+  return rnd(3) ? 0 : rnd(2 * 1000000);
+}
+
+static void model_start(model_t *m, bool periodic) {
+  uint64_t timeout = random_timeout();
+
+  m->slack_us = random_slack();
+  if (periodic) {
+    /* long enough to outlast its slack, and not to spin through the
+     * hours the clock jumps */
+    timeout = rnd(4) ? 1000000 + rnd(60 * 1000000) : rnd(10 * HOUR);
+    if (timeout < m->slack_us + TICK) timeout = m->slack_us + TICK;
+    m->period_us = timeout;
+    timer_wheel_start_periodic(m->timer, timeout, m->slack_us);
+  }else{
+    m->period_us = 0;
+    timer_wheel_start_once(m->timer, timeout, m->slack_us);
+  }
+  m->armed = true;
+  m->due_us = hal_time_us() + timeout;
+}
+
+static void model_stop(model_t *m) {
+  timer_wheel_stop(m->timer);
+  m->armed = false;
+}
+
+static void callback(void *arg) {
+  model_t *m = arg;
+  int64_t now = hal_time_us();
+
+  fires++;
+  m->fired++;
+  m->fired_us = now;
+  if (!m->armed) {
+    CHECK(0, "timer %d fired while stopped", (int)(m - model));
+    return;
+  }
+  if (now < m->due_us) {
+    early++;
+    CHECK(early < 5, "timer %d fired %lld us early", (int)(m - model),
+	  (long long)(m->due_us - now));
+  }
+  if (now > m->due_us + m->slack_us + TICK) {
+    late++;
+    CHECK(late < 5, "timer %d fired %lld us late, slack %u", (int)(m - model),
+	  (long long)(now - m->due_us), (unsigned)m->slack_us);
+  }
+  if (m->period_us) m->due_us += m->period_us;
+  else m->armed = false;
+
+  /* callbacks start and stop timers too, themselves included */
+  if (quiet) return;
+  switch (rnd(8)) {
+  case 0: model_start(m, false); break;
+  case 1: model_stop(m); break;
+  case 2: model_stop(&model[rnd(TIMERS)]); break;
+  case 3: model_start(&model[rnd(TIMERS)], rnd(2)); break;
+  }
+}
+
+/* Nothing armed may be overdue, and the wheel agrees on what is armed */
+static void check_state(void) {
+  int64_t now = hal_time_us();
+  timer_wheel_stats_t stats;
+  uint32_t armed = 0;
+
+  for (int i = 0; i < TIMERS; i++) {
+    model_t *m = &model[i];
+    CHECK(timer_wheel_armed(m->timer) == m->armed, "timer %d armed %d, model %d", i,
+	  timer_wheel_armed(m->timer), m->armed);
+    if (m->armed && now > m->due_us + m->slack_us + TICK) {
+      late++;
+      CHECK(late < 5, "timer %d overdue by %lld us", i,
+	    (long long)(now - m->due_us - m->slack_us));
+      /* report it once */
+      m->due_us = now;
+    }
+    armed += m->armed;
+  }
+  timer_wheel_stats(&stats);
+  CHECK(stats.armed == armed, "wheel has %u armed, model %u", (unsigned)stats.armed,
+	(unsigned)armed);
+}
+
+static void test_random(uint32_t align_us) {
+  timer_wheel_init(align_us);
+  for (int op = 0; op < OPS; op++) {
+    model_t *m = &model[rnd(TIMERS)];
+
+    switch (rnd(6)) {
+    case 0: case 1: model_start(m, false); break;
+    case 2: model_start(m, true); break;
+    case 3: model_stop(m); break;
+    }
+    /* mostly a few ticks, now and then long enough to cascade */
+    hal_sim_advance(rnd(100) ? rnd(5 * TICK) : rnd(2 * HOUR));
+    if (op % 64 == 0) check_state();
+  }
+  /* run out everything still armed */
+  for (int i = 0; i < TIMERS; i++) {
+    model[i].period_us = 0;
+    if (timer_wheel_armed(model[i].timer)) model_start(&model[i], false);
+  }
+  hal_sim_advance(12 * HOUR);
+  check_state();
+  for (int i = 0; i < TIMERS; i++) model_stop(&model[i]);
+  check_state();
+}
+
+/* A timer alone, its callback leaving the others be */
+static int64_t fire_once(model_t *m, uint64_t timeout_us, uint32_t slack_us) {
+  uint32_t fired = m->fired;
+
+  m->period_us = 0;
+  m->slack_us = slack_us;
+  m->armed = true;
+  m->due_us = hal_time_us() + timeout_us;
+  timer_wheel_start_once(m->timer, timeout_us, slack_us);
+  hal_sim_advance_to(m->due_us + slack_us + 2 * TICK);
+  CHECK(m->fired == fired + 1, "timer %d fired %u times", (int)(m - model),
+	(unsigned)(m->fired - fired));
+  return m->fired_us;
+}
+
+static void test_directed(void) {
+  model_t *m = &model[0];
+  int64_t base, at;
+
+  timer_wheel_init(0);
+  quiet = true;
+
+  /* the one tick in [due, due + slack] on a 1024 tick boundary */
+  base = hal_time_us() / TICK / 4096 * 4096 + 4096;
+  hal_sim_advance_to(base * TICK);
+  at = fire_once(m, 1000 * TICK, 100 * TICK);
+  CHECK(at == (base + 1024) * TICK, "slack fired at tick %+lld, not 1024",
+	(long long)(at / TICK - base));
+
+  /* past the top level: round the top slot again, then on time */
+  base = hal_time_us();
+  at = fire_once(m, 6 * HOUR, 0);
+  CHECK(at - base >= 6 * HOUR && at - base <= 6 * HOUR + TICK,
+	"6 h timer fired after %lld us", (long long)(at - base));
+
+  /* on the alignment grid when it falls inside the slack */
+  timer_wheel_init(1000 * 1000);
+  hal_sim_advance_to(hal_time_us() / 1000000 * 1000000 + 1000000);
+  at = fire_once(m, 1500 * 1000, 900 * 1000);
+  CHECK(at % (1000 * 1000) == 0, "aligned timer fired %lld us off the grid",
+	(long long)(at % (1000 * 1000)));
+  timer_wheel_init(0);
+
+  quiet = false;
+  check_state();
+}
+
+/****************************************************************************
+ * Bench
+ */
+
+#define BENCH_OPS 2000000
+
+static void bench(void) {
+  int64_t start, ns;
+
+  timer_wheel_init(0);
+  for (int i = 0; i < TIMERS; i++) model_start(&model[i], false);
+  start = test_now_ns();
+  for (int i = 0; i < BENCH_OPS; i++)
+    timer_wheel_start_once(model[i % TIMERS].timer, i * 7919ULL % (60 * 1000000), 0);
+  ns = test_now_ns() - start;
+  printf("timer_wheel %-21s %6.1f ns per call\n", "restart", (double)ns / BENCH_OPS);
+  start = test_now_ns();
+  for (int i = 0; i < BENCH_OPS; i++) {
+    timer_wheel_stop(model[i % TIMERS].timer);
+    timer_wheel_start_once(model[i % TIMERS].timer, i * 7919ULL % (60 * 1000000), 0);
+  }
+  ns = test_now_ns() - start;
+  printf("timer_wheel %-21s %6.1f ns per call\n", "stop and start", (double)ns / BENCH_OPS / 2);
+}
+
+int main(int argc, char **argv) {
+  hal_sim_init();
+  timer_wheel_init(0);
+  for (int i = 0; i < TIMERS; i++)
+    model[i].timer = timer_wheel_create("test", callback, &model[i]);
+  if (test_bench_mode(argc, argv)) {
+    bench();
+    return 0;
+  }
+  srandom(1);
+  test_random(0);
+  test_random(1000 * 1000);
+  test_directed();
+  printf("timer_wheel: %u expiries\n", (unsigned)fires);
+  return test_report("timer_wheel");
+}
@@ -0,0 +1,121 @@
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "crash_log.h"
+
+static HAL_NOINIT_ATTR crash_log_record_t crash_ring[CRASH_LOG_RECORDS];
+
+/* the last boot's records, copied out before this boot overwrites them */
+static crash_log_record_t saved[CRASH_LOG_RECORDS];
+static size_t saved_count;
+
+static uint32_t next_seq = 1;
+static uint16_t boot = 1;
+static hal_reset_t reset_reason = HAL_RESET_POWER_ON;
+
+static const char *reset_names[] = {
+  "power on", "software", "panic", "watchdog", "brownout", "other",
+};
+
+/* from seq to the end of the text in use */
+static uint32_t crash_log_check(const crash_log_record_t *record) {
+  return hal_crc32(0, &record->seq,
+		   offsetof(crash_log_record_t, text) - offsetof(crash_log_record_t, seq) +
+		   record->len);
+}
+
+static bool crash_log_valid(const crash_log_record_t *record) {
+  return record->seq && record->len <= CRASH_LOG_TEXT_LEN &&
+    record->check == crash_log_check(record);
+}
+
+void crash_log_init(void) {
+  const crash_log_record_t *last = NULL;
+  size_t i, j;
+
+  reset_reason = hal_reset_reason();
+  saved_count = 0;
+  next_seq = 1;
+  boot = 1;
+  if (reset_reason != HAL_RESET_POWER_ON) {
+    for (i = 0; i < CRASH_LOG_RECORDS; i++)
+      if (crash_log_valid(&crash_ring[i]) && (!last || crash_ring[i].seq > last->seq))
+	last = &crash_ring[i];
+  }
+  if (!last) {
+    memset(crash_ring, 0, sizeof(crash_ring));
+    return;
+  }
+
+  /* the ring may also hold the boot before; keep the last one's, by seq */
+  for (i = 0; i < CRASH_LOG_RECORDS; i++) {
+    const crash_log_record_t *record = &crash_ring[i];
+    if (!crash_log_valid(record) || record->boot != last->boot) continue;
+    for (j = saved_count; j > 0 && saved[j - 1].seq > record->seq; j--)
+      saved[j] = saved[j - 1];
+    saved[j] = *record;
+    saved_count++;
+  }
+  next_seq = last->seq + 1;
+  boot = last->boot + 1;
+  ESP_LOGW(__FUNCTION__, "%s reset, %u records kept from boot %u",
+	   reset_names[reset_reason], (unsigned)saved_count, (unsigned)last->boot);
+}
+
+void crash_log_add(crash_log_kind_t kind, uint8_t severity, const char *tag,
+		   uint32_t msgid, const void *text, size_t len) {
+  uint32_t seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+  crash_log_record_t *record = &crash_ring[seq % CRASH_LOG_RECORDS];
+
+  if (len > CRASH_LOG_TEXT_LEN) {
+    /* a cut short binary record can't be decoded */
+    if (kind == CRASH_LOG_BINARY) return;
+    len = CRASH_LOG_TEXT_LEN;
+  }
+  record->check = 0;		/* invalid while it is rewritten */
+  record->seq = seq;
+  record->time_ms = hal_time_us() / 1000;
+  record->msgid = msgid;
+  record->boot = boot;
+  record->len = len;
+  record->severity = severity;
+  record->kind = kind;
+  record->reserved = 0;
+  strncpy(record->tag, tag, CRASH_LOG_TAG_LEN);
+  memcpy(record->text, text, len);
+  record->check = crash_log_check(record);
+}
+
+void crash_log_printf(uint8_t severity, const char *tag, const char *fmt, ...) {
+  char text[CRASH_LOG_TEXT_LEN + 1];
+  va_list args;
+  int n;
+
+  va_start(args, fmt);
+  n = vsnprintf(text, sizeof(text), fmt, args);
+  va_end(args);
+  if (n < 0) return;
+  crash_log_add(CRASH_LOG_TEXT, severity, tag, 0, text,
+		n < CRASH_LOG_TEXT_LEN ? n : CRASH_LOG_TEXT_LEN);
+}
+
+size_t crash_log_saved(const crash_log_record_t **records) {
+  *records = saved;
+  return saved_count;
+}
+
+void crash_log_discard_saved(void) {
+  saved_count = 0;
+}
+
+hal_reset_t crash_log_reset_reason(void) {
+  return reset_reason;
+}
+
+const char *crash_log_reset_str(hal_reset_t reason) {
+  return reason <= HAL_RESET_OTHER ? reset_names[reason] : "?";
+}
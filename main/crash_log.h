@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+
+/* Log and trace records that survive a crash.
+ *
+ * The last CRASH_LOG_RECORDS log messages and door transitions are
+ * also kept as fixed size records in a ring in RTC slow memory, which a
+ * panic, watchdog or software reset leaves alone.  Keeping one is a
+ * memcpy and a CRC, with no locks and no heap, so it is always on.
+ *
+ * At boot, after anything but power on, the records of the boot that
+ * ended and pass their CRC are copied out, oldest first, for syslog to
+ * send ahead of the new boot's messages.  Messages too long for a
+ * record are cut short.
+ */
+
+#define CRASH_LOG_RECORDS 24
+#define CRASH_LOG_TAG_LEN 16
+#define CRASH_LOG_TEXT_LEN 88
+
+typedef enum {
+  CRASH_LOG_TEXT,		/* message text */
+  CRASH_LOG_BINARY,		/* a syslog_binary record */
+} crash_log_kind_t;
+
+typedef struct {
+  uint32_t check;		/* CRC-32 of the rest, up to len bytes of text */
+  uint32_t seq;
+  uint32_t time_ms;		/* since that boot */
+  uint32_t msgid;		/* 0 if not a syslog message */
+  uint16_t boot;
+  uint16_t len;
+  uint8_t severity;
+  uint8_t kind;
+  uint16_t reserved;
+  char tag[CRASH_LOG_TAG_LEN];
+  char text[CRASH_LOG_TEXT_LEN];
+} crash_log_record_t;
+
+/* Checks the ring and keeps what the last boot left; call first thing */
+void crash_log_init(void);
+
+/* Keep a composed message, from any task */
+void crash_log_add(crash_log_kind_t kind, uint8_t severity, const char *tag,
+		   uint32_t msgid, const void *text, size_t len);
+
+/* Format a record; for events too rare for the cost to matter */
+void crash_log_printf(uint8_t severity, const char *tag, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/* Records saved from before the reset, oldest first, until discarded */
+size_t crash_log_saved(const crash_log_record_t **records);
+void crash_log_discard_saved(void);
+
+hal_reset_t crash_log_reset_reason(void);
+const char *crash_log_reset_str(hal_reset_t reason);
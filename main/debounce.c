@@ -0,0 +1,73 @@
+#include "debounce.h"
+
+#define MS_TO_US(x) ((int64_t)(x) * 1000)
+
+static int64_t settle_us(const debounce_t *db, bool level) {
+  return MS_TO_US(level ? db->config.assert_ms : db->config.release_ms);
+}
+
+void debounce_init(debounce_t *db, const debounce_config_t *config,
+		   bool level, int64_t now_us) {
+  db->config = *config;
+  db->stable = level;
+  db->filtered = level;
+  db->raw = level;
+  db->raw_since_us = now_us;
+  db->filtered_since_us = now_us;
+  db->stable_since_us = now_us;
+  db->glitches = 0;
+}
+
+/* Bring filtered and stable up to date with the current raw level */
+static bool debounce_advance(debounce_t *db, int64_t now_us) {
+  if (db->raw != db->filtered &&
+      now_us - db->raw_since_us >= MS_TO_US(db->config.glitch_ms)) {
+    db->filtered = db->raw;
+    db->filtered_since_us = db->raw_since_us;
+  }
+
+  if (db->filtered != db->stable &&
+      now_us - db->filtered_since_us >= settle_us(db, db->filtered)) {
+    db->stable = db->filtered;
+    db->stable_since_us = db->filtered_since_us;
+    return true;
+  }
+  return false;
+}
+
+bool debounce_update(debounce_t *db, bool level, int64_t now_us) {
+  bool changed = debounce_advance(db, now_us);
+
+  if (level != db->raw) {
+    /* the previous run ends here; was it too short to count? */
+    if (db->raw != db->filtered) db->glitches++;
+    db->raw = level;
+    db->raw_since_us = now_us;
+    if (debounce_advance(db, now_us)) changed = true;
+  }
+  return changed;
+}
+
+bool debounce_update_batch(debounce_t *db, const debounce_sample_t *samples,
+			   size_t count) {
+  bool changed = false;
+  size_t i;
+  for (i=0; i<count; i++) {
+    if (debounce_update(db, samples[i].level, samples[i].time_us)) changed = true;
+  }
+  return changed;
+}
+
+int64_t debounce_deadline_us(const debounce_t *db) {
+  int64_t glitch_us = MS_TO_US(db->config.glitch_ms);
+
+  if (db->raw != db->filtered) {
+    if (db->raw == db->stable) return db->raw_since_us + glitch_us;
+    /* filtered_since will be back-dated to raw_since once it passes */
+    int64_t settle = settle_us(db, db->raw);
+    return db->raw_since_us + (settle > glitch_us ? settle : glitch_us);
+  }
+  if (db->filtered != db->stable)
+    return db->filtered_since_us + settle_us(db, db->filtered);
+  return DEBOUNCE_SETTLED;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Time based debounce filter for a single binary input.
+ *
+ * Raw samples (or edges) are fed in with their timestamp.  Excursions
+ * shorter than glitch_ms are discarded outright, without restarting a
+ * settle already in progress.  A level that survives the glitch filter
+ * becomes the stable output once it has been held for assert_ms (level
+ * true) or release_ms (level false); different windows give hysteresis.
+ *
+ * Nothing here touches hardware, so the filter runs unchanged on a host.
+ */
+
+#define DEBOUNCE_SETTLED (-1LL)
+
+typedef struct {
+  uint32_t assert_ms;     /* hold time before a true level is accepted */
+  uint32_t release_ms;    /* hold time before a false level is accepted */
+  uint32_t glitch_ms;     /* excursions shorter than this are ignored */
+} debounce_config_t;
+
+typedef struct {
+  int64_t time_us;
+  bool level;
+} debounce_sample_t;
+
+typedef struct {
+  debounce_config_t config;
+  bool stable;                /* debounced output */
+  bool filtered;              /* level after glitch rejection */
+  bool raw;                   /* most recent sample */
+  int64_t raw_since_us;
+  int64_t filtered_since_us;
+  int64_t stable_since_us;    /* when the current stable level began */
+  uint32_t glitches;          /* rejected excursions */
+} debounce_t;
+
+void debounce_init(debounce_t *db, const debounce_config_t *config,
+		   bool level, int64_t now_us);
+
+/* Feed one sample; returns true if the stable output changed */
+bool debounce_update(debounce_t *db, bool level, int64_t now_us);
+
+/* Feed samples in time order; returns true if the stable output changed */
+bool debounce_update_batch(debounce_t *db, const debounce_sample_t *samples,
+			   size_t count);
+
+/* Advance time without a new sample */
+static inline bool debounce_poll(debounce_t *db, int64_t now_us) {
+  return debounce_update(db, db->raw, now_us);
+}
+
+static inline bool debounce_level(const debounce_t *db) {
+  return db->stable;
+}
+
+/* Time at which the output may next change, or DEBOUNCE_SETTLED if the
+ * input agrees with the output and nothing is pending */
+int64_t debounce_deadline_us(const debounce_t *db);
+
+static inline bool debounce_is_settled(const debounce_t *db) {
+  return debounce_deadline_us(db) == DEBOUNCE_SETTLED;
+}
+
+/* Time since the input last made a stable transition */
+static inline int64_t debounce_stable_for_us(const debounce_t *db, int64_t now_us) {
+  return now_us - db->stable_since_us;
+}
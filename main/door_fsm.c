@@ -0,0 +1,119 @@
+#include "door_fsm.h"
+
+#define KEEP DOOR_TARGET_KEEP
+#define NOTIFY DOOR_ACT_NOTIFY
+
+/* Arrive at a resting state: the stuck monitor is no longer needed */
+#define SETTLE(s) { s, s, NOTIFY | DOOR_ACT_STUCK_STOP }
+/* Leave a resting state: watch for the door getting stuck on the way */
+#define DEPART(s, t) { s, t, NOTIFY | DOOR_ACT_STUCK_START }
+#define IGNORE(s) { s, KEEP, 0 }
+#define CMD_OPEN(s) { s, GARAGE_OPEN, DOOR_ACT_PULSE_OPEN }
+#define CMD_CLOSE(s) { s, GARAGE_CLOSED, DOOR_ACT_PULSE_CLOSE }
+
+static const door_transition_t door_transitions[DOOR_STATE_COUNT][DOOR_EV_COUNT] = {
+  [GARAGE_OPEN] = {
+    [DOOR_EV_SENSOR_OPEN]   = IGNORE(GARAGE_OPEN),
+    [DOOR_EV_SENSOR_CLOSED] = SETTLE(GARAGE_CLOSED),
+    [DOOR_EV_SENSOR_NONE]   = DEPART(GARAGE_CLOSING, GARAGE_CLOSED),
+    [DOOR_EV_STUCK]         = IGNORE(GARAGE_OPEN),
+    [DOOR_EV_CMD_OPEN]      = CMD_OPEN(GARAGE_OPEN),
+    [DOOR_EV_CMD_CLOSE]     = CMD_CLOSE(GARAGE_OPEN),
+  },
+  [GARAGE_CLOSED] = {
+    [DOOR_EV_SENSOR_OPEN]   = SETTLE(GARAGE_OPEN),
+    [DOOR_EV_SENSOR_CLOSED] = IGNORE(GARAGE_CLOSED),
+    [DOOR_EV_SENSOR_NONE]   = DEPART(GARAGE_OPENING, GARAGE_OPEN),
+    [DOOR_EV_STUCK]         = IGNORE(GARAGE_CLOSED),
+    [DOOR_EV_CMD_OPEN]      = CMD_OPEN(GARAGE_CLOSED),
+    [DOOR_EV_CMD_CLOSE]     = CMD_CLOSE(GARAGE_CLOSED),
+  },
+  [GARAGE_OPENING] = {
+    [DOOR_EV_SENSOR_OPEN]   = SETTLE(GARAGE_OPEN),
+    [DOOR_EV_SENSOR_CLOSED] = SETTLE(GARAGE_CLOSED),
+    [DOOR_EV_SENSOR_NONE]   = IGNORE(GARAGE_OPENING),
+    [DOOR_EV_STUCK]         = { GARAGE_STOPPED, GARAGE_OPEN, NOTIFY | DOOR_ACT_STUCK_STOP },
+    [DOOR_EV_CMD_OPEN]      = CMD_OPEN(GARAGE_OPENING),
+    [DOOR_EV_CMD_CLOSE]     = CMD_CLOSE(GARAGE_OPENING),
+  },
+  [GARAGE_CLOSING] = {
+    [DOOR_EV_SENSOR_OPEN]   = SETTLE(GARAGE_OPEN),
+    [DOOR_EV_SENSOR_CLOSED] = SETTLE(GARAGE_CLOSED),
+    [DOOR_EV_SENSOR_NONE]   = IGNORE(GARAGE_CLOSING),
+    [DOOR_EV_STUCK]         = { GARAGE_STOPPED, GARAGE_OPEN, NOTIFY | DOOR_ACT_STUCK_STOP },
+    [DOOR_EV_CMD_OPEN]      = CMD_OPEN(GARAGE_CLOSING),
+    [DOOR_EV_CMD_CLOSE]     = CMD_CLOSE(GARAGE_CLOSING),
+  },
+  /* a stopped door has no known direction; wait for a sensor to make */
+  [GARAGE_STOPPED] = {
+    [DOOR_EV_SENSOR_OPEN]   = SETTLE(GARAGE_OPEN),
+    [DOOR_EV_SENSOR_CLOSED] = SETTLE(GARAGE_CLOSED),
+    [DOOR_EV_SENSOR_NONE]   = IGNORE(GARAGE_STOPPED),
+    [DOOR_EV_STUCK]         = IGNORE(GARAGE_STOPPED),
+    [DOOR_EV_CMD_OPEN]      = CMD_OPEN(GARAGE_STOPPED),
+    [DOOR_EV_CMD_CLOSE]     = CMD_CLOSE(GARAGE_STOPPED),
+  },
+};
+
+void door_fsm_init(door_fsm_t *fsm, garage_state_t state, garage_state_t target) {
+  fsm->state = state;
+  fsm->target = target;
+  fsm->trace_count = 0;
+}
+
+uint8_t door_fsm_dispatch(door_fsm_t *fsm, door_event_t event, int64_t now_us) {
+  const door_transition_t *t;
+  door_fsm_trace_t *tr;
+
+  if ((unsigned)fsm->state >= DOOR_STATE_COUNT || (unsigned)event >= DOOR_EV_COUNT)
+    return 0;
+  t = &door_transitions[fsm->state][event];
+  if (t->actions == 0) return 0;
+
+  tr = &fsm->trace[fsm->trace_count % DOOR_FSM_TRACE_LEN];
+  tr->time_us = now_us;
+  tr->event = event;
+  tr->from = fsm->state;
+  tr->to = t->next;
+  tr->target = (t->target == KEEP ? fsm->target : t->target);
+  fsm->trace_count++;
+
+  fsm->state = t->next;
+  fsm->target = tr->target;
+  return t->actions;
+}
+
+size_t door_fsm_trace(const door_fsm_t *fsm, door_fsm_trace_t *out, size_t max) {
+  uint32_t n = fsm->trace_count < DOOR_FSM_TRACE_LEN ? fsm->trace_count : DOOR_FSM_TRACE_LEN;
+  uint32_t first = fsm->trace_count - n;
+  size_t i;
+  if (n > max) {
+    first += n - max;
+    n = max;
+  }
+  for (i=0; i<n; i++) out[i] = fsm->trace[(first + i) % DOOR_FSM_TRACE_LEN];
+  return n;
+}
+
+const char *door_state_str(garage_state_t state) {
+  switch (state) {
+  case GARAGE_OPEN:    return "OPEN";
+  case GARAGE_CLOSED:  return "CLOSED";
+  case GARAGE_OPENING: return "OPENING";
+  case GARAGE_CLOSING: return "CLOSING";
+  case GARAGE_STOPPED: return "STOPPED";
+  default:             return "UNKNOWN";
+  }
+}
+
+const char *door_event_str(door_event_t event) {
+  switch (event) {
+  case DOOR_EV_SENSOR_OPEN:   return "SENSOR_OPEN";
+  case DOOR_EV_SENSOR_CLOSED: return "SENSOR_CLOSED";
+  case DOOR_EV_SENSOR_NONE:   return "SENSOR_NONE";
+  case DOOR_EV_STUCK:         return "STUCK";
+  case DOOR_EV_CMD_OPEN:      return "CMD_OPEN";
+  case DOOR_EV_CMD_CLOSE:     return "CMD_CLOSE";
+  default:                    return "UNKNOWN";
+  }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "garage_control.h"
+
+/* Door state machine.
+ *
+ * All door behaviour lives in one const transition table indexed by
+ * (current state, event).  Each entry gives the next state, the new
+ * target state and a set of actions for the caller to carry out, so the
+ * machine itself has no hardware or timer dependencies.
+ *
+ * Every dispatch that does something is also recorded, with its
+ * timestamp, in a small ring so an incident can be reconstructed later.
+ */
+
+typedef enum {
+  DOOR_EV_SENSOR_OPEN,      /* open sensor made */
+  DOOR_EV_SENSOR_CLOSED,    /* closed sensor made */
+  DOOR_EV_SENSOR_NONE,      /* both sensors released, door in transit */
+  DOOR_EV_STUCK,            /* transit took too long */
+  DOOR_EV_CMD_OPEN,
+  DOOR_EV_CMD_CLOSE,
+  DOOR_EV_COUNT
+} door_event_t;
+
+/* actions */
+#define DOOR_ACT_NOTIFY      0x01  /* current or target changed */
+#define DOOR_ACT_STUCK_START 0x02
+#define DOOR_ACT_STUCK_STOP  0x04
+#define DOOR_ACT_PULSE_OPEN  0x08
+#define DOOR_ACT_PULSE_CLOSE 0x10
+
+#define DOOR_STATE_COUNT (GARAGE_STOPPED + 1)
+#define DOOR_TARGET_KEEP 0xFF
+
+typedef struct {
+  uint8_t next;
+  uint8_t target;           /* garage_state_t or DOOR_TARGET_KEEP */
+  uint8_t actions;
+} door_transition_t;
+
+#define DOOR_FSM_TRACE_LEN 32
+
+typedef struct {
+  int64_t time_us;
+  uint8_t event;
+  uint8_t from;
+  uint8_t to;
+  uint8_t target;
+} door_fsm_trace_t;
+
+typedef struct {
+  garage_state_t state;
+  garage_state_t target;
+  uint32_t trace_count;     /* total recorded, ring index is count % LEN */
+  door_fsm_trace_t trace[DOOR_FSM_TRACE_LEN];
+} door_fsm_t;
+
+void door_fsm_init(door_fsm_t *fsm, garage_state_t state, garage_state_t target);
+
+/* Apply an event; returns the DOOR_ACT_* flags for the caller to perform */
+uint8_t door_fsm_dispatch(door_fsm_t *fsm, door_event_t event, int64_t now_us);
+
+/* Copy out up to max trace entries, oldest first; returns the number copied */
+size_t door_fsm_trace(const door_fsm_t *fsm, door_fsm_trace_t *out, size_t max);
+
+const char *door_state_str(garage_state_t state);
+const char *door_event_str(door_event_t event);
@@ -0,0 +1,167 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "garage_config.h"
+#include "metrics.h"
+#include "door_store.h"
+#include "timer_wheel.h"
+
+#define DOOR_STORE_MAGIC 0x44535432	/* "DST2" */
+#define DOOR_STORE_NS "garage"
+#define DOOR_STORE_KEY "door"
+
+/* the same layout in RTC memory and in NVS */
+typedef struct {
+  uint32_t magic;
+  uint32_t boot;
+  int64_t changed_us;
+  uint8_t state;
+  uint8_t target;
+  uint16_t reserved;
+  uint32_t check;		/* CRC-32 of everything above */
+} door_store_blob_t;
+
+static void door_store_timer_callback(void* arg);
+
+static HAL_NOINIT_ATTR door_store_blob_t rtc_blob[GARAGE_MAX_DOORS];
+static HAL_NOINIT_ATTR uint32_t rtc_boots;
+static HAL_NOINIT_ATTR uint32_t rtc_boots_check;
+
+static uint32_t boot;
+static size_t store_doors;
+static door_store_blob_t nvs_blob[GARAGE_MAX_DOORS];	 /* what flash holds */
+static door_store_blob_t pending_blob[GARAGE_MAX_DOORS]; /* what it should hold */
+static int64_t nvs_written_us;
+static bool nvs_written = false;
+static bool nvs_armed = false;
+static wheel_timer_t nvs_timer;
+
+static metric_t nvs_writes = METRIC_COUNTER_INIT("store.nvs_writes");
+
+static uint32_t door_store_check(const door_store_blob_t *blob) {
+  return hal_crc32(0, blob, offsetof(door_store_blob_t, check));
+}
+
+static bool door_store_valid(const door_store_blob_t *blob) {
+  return blob->magic == DOOR_STORE_MAGIC && blob->check == door_store_check(blob) &&
+    blob->state <= GARAGE_STOPPED && blob->target <= GARAGE_STOPPED;
+}
+
+static void door_store_fill(door_store_blob_t *blob, garage_state_t state,
+			    garage_state_t target, int64_t now_us) {
+  memset(blob, 0, sizeof(*blob));
+  blob->magic = DOOR_STORE_MAGIC;
+  blob->boot = boot;
+  blob->changed_us = now_us;
+  blob->state = state;
+  blob->target = target;
+  blob->check = door_store_check(blob);
+}
+
+/* door 0 keeps the key a single door controller used */
+static void door_store_key(size_t door, char *key, size_t size) {
+  if (door == 0) snprintf(key, size, "%s", DOOR_STORE_KEY);
+  else snprintf(key, size, "%s%u", DOOR_STORE_KEY, (unsigned)door);
+}
+
+void door_store_init(size_t doors) {
+  char key[16];
+  size_t door, len;
+
+  metrics_register(&nvs_writes);
+  nvs_timer = timer_wheel_create("door_store_timer", door_store_timer_callback, NULL);
+
+  boot = 1;
+  store_doors = doors < GARAGE_MAX_DOORS ? doors : GARAGE_MAX_DOORS;
+  for (door = 0; door < store_doors; door++) {
+    door_store_blob_t *blob = &nvs_blob[door];
+    door_store_key(door, key, sizeof(key));
+    len = sizeof(*blob);
+    if (!hal_nvs_get_blob(DOOR_STORE_NS, key, blob, &len) || len != sizeof(*blob) ||
+	!door_store_valid(blob))
+      memset(blob, 0, sizeof(*blob));
+    if (blob->magic && blob->boot >= boot) boot = blob->boot + 1;
+    pending_blob[door] = *blob;
+  }
+  /* RTC memory is newer if it survived, NVS only has settled states */
+  if (rtc_boots_check == ~rtc_boots && rtc_boots >= boot) boot = rtc_boots + 1;
+  rtc_boots = boot;
+  rtc_boots_check = ~boot;
+  ESP_LOGI(__FUNCTION__, "boot %u", (unsigned)boot);
+}
+
+bool door_store_load(size_t door, door_store_record_t *record) {
+  const door_store_blob_t *found = NULL;
+  const char *source = NULL;
+
+  if (door >= store_doors) return false;
+  if (door_store_valid(&rtc_blob[door])) {
+    found = &rtc_blob[door];
+    source = "rtc";
+  }else if (nvs_blob[door].magic) {
+    found = &nvs_blob[door];
+    source = "nvs";
+  }
+  if (!found) return false;
+  record->state = found->state;
+  record->target = found->target;
+  record->boot = found->boot;
+  record->changed_us = found->changed_us;
+  ESP_LOGI(__FUNCTION__, "door %u state %u target %u from %s (boot %u at %lld ms)",
+	   (unsigned)door, found->state, found->target, source, (unsigned)found->boot,
+	   (long long)(found->changed_us / 1000));
+  return true;
+}
+
+void door_store_save(size_t door, garage_state_t state, garage_state_t target, int64_t now_us) {
+  int64_t delay_us, holdoff_us;
+
+  if (door >= store_doors) return;
+  door_store_fill(&rtc_blob[door], state, target, now_us);
+  if (state != target && state != GARAGE_STOPPED) return;
+
+  pending_blob[door] = rtc_blob[door];
+  if (nvs_armed) return;
+  delay_us = GARAGE_STORE_COALESCE_SECONDS * 1000000LL;
+  holdoff_us = nvs_written_us + GARAGE_STORE_MIN_INTERVAL_SECONDS * 1000000LL - now_us;
+  if (nvs_written && holdoff_us > delay_us) delay_us = holdoff_us;
+  nvs_armed = true;
+  timer_wheel_start_once(nvs_timer, delay_us, GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
+}
+
+/* Every door whose settled state differs from flash, in one go */
+static void door_store_write_event(const event_t *event) {
+  char key[16];
+  size_t door;
+  bool wrote = false;
+
+  nvs_armed = false;
+  for (door = 0; door < store_doors; door++) {
+    door_store_blob_t *pending = &pending_blob[door];
+    /* back where flash already is, e.g. opened and closed again */
+    if (!pending->magic || (pending->state == nvs_blob[door].state &&
+			    pending->target == nvs_blob[door].target && nvs_blob[door].magic))
+      continue;
+    door_store_key(door, key, sizeof(key));
+    if (!hal_nvs_set_blob(DOOR_STORE_NS, key, pending, sizeof(*pending))) {
+      ESP_LOGW(__FUNCTION__, "NVS write of %s failed", key);
+      continue;
+    }
+    nvs_blob[door] = *pending;
+    metric_inc(&nvs_writes);
+    wrote = true;
+  }
+  if (wrote) {
+    nvs_written_us = hal_time_us();
+    nvs_written = true;
+  }
+}
+
+static void door_store_timer_callback(void* arg) {
+  if (!garage_post(door_store_write_event, 0))
+    timer_wheel_start_once(nvs_timer, GARAGE_STORE_COALESCE_SECONDS * 1000000LL,
+			   GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "garage_control.h"
+
+/* Door state kept across resets, for each door.
+ *
+ * Every state change is written at once to a record in RTC slow memory,
+ * which survives a watchdog or software reset but not power loss.  Only
+ * settled states (the door is at its target, or stopped) also go to
+ * NVS, and not straight away: a change waits
+ * GARAGE_STORE_COALESCE_SECONDS, and at least
+ * GARAGE_STORE_MIN_INTERVAL_SECONDS since the last write, so a door
+ * cycling or a flapping sensor costs one flash write rather than one
+ * per transition.  A record equal to the one in flash is never written.
+ *
+ * Runs on the garage event task.
+ */
+
+typedef struct {
+  garage_state_t state;
+  garage_state_t target;
+  uint32_t boot;		/* boot count when it was saved */
+  int64_t changed_us;		/* uptime of that boot at the transition */
+} door_store_record_t;
+
+/* Reads what NVS holds for the doors and counts the boot, so call
+ * once, before loading */
+void door_store_init(size_t doors);
+
+/* Load a door's saved state, preferring RTC memory to NVS; false if
+ * neither holds a valid record */
+bool door_store_load(size_t door, door_store_record_t *record);
+
+void door_store_save(size_t door, garage_state_t state, garage_state_t target, int64_t now_us);
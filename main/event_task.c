@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "metrics.h"
+#include "event_task.h"
+
+struct event_task {
+  hal_queue_t queue;
+  char latency_name[32];
+  char worst_name[32];
+  char dropped_name[32];
+  metric_histogram_t latency;
+  metric_t worst;
+  metric_t dropped;
+};
+
+static struct event_task event_tasks[EVENT_TASK_MAX];
+static int event_task_count = 0;
+
+static void event_task_run(void *arg) {
+  struct event_task *task = arg;
+  event_t event;
+  int64_t latency;
+  for (;;) {
+    if (!hal_queue_receive(task->queue, &event, HAL_WAIT_FOREVER)) continue;
+    latency = hal_time_us() - event.time_us;
+    metric_observe(&task->latency, latency);
+    if ((uint32_t)latency > task->worst.value) metric_set(&task->worst, latency);
+    event.handler(&event);
+  }
+}
+
+event_task_t event_task_create(const char *name, uint32_t stack, int priority,
+			       uint32_t queue_len, void *storage) {
+  struct event_task *task;
+  if (event_task_count == EVENT_TASK_MAX) {
+    ESP_LOGE(__FUNCTION__, "no room for event task %s", name);
+    return NULL;
+  }
+  task = &event_tasks[event_task_count++];
+  task->queue = hal_queue_create(queue_len, sizeof(event_t),
+			       (uint8_t *)storage + HAL_TASK_STORAGE_SIZE(stack));
+
+  snprintf(task->latency_name, sizeof(task->latency_name), "ev.%s.latency_us", name);
+  snprintf(task->worst_name, sizeof(task->worst_name), "ev.%s.worst_us", name);
+  snprintf(task->dropped_name, sizeof(task->dropped_name), "ev.%s.dropped", name);
+  task->latency.metric.name = task->latency_name;
+  task->latency.metric.type = METRIC_HISTOGRAM;
+  task->worst.name = task->worst_name;
+  task->worst.type = METRIC_GAUGE;
+  task->dropped.name = task->dropped_name;
+  task->dropped.type = METRIC_COUNTER;
+  metrics_register(&task->latency.metric);
+  metrics_register(&task->worst);
+  metrics_register(&task->dropped);
+
+  hal_task_create(event_task_run, name, stack, task, priority, storage);
+  return task;
+}
+
+bool event_post(event_task_t task, event_handler_t handler, uint32_t arg) {
+  event_t event = { .handler = handler, .arg = arg, .time_us = hal_time_us() };
+  if (hal_queue_send(task->queue, &event)) return true;
+  metric_inc(&task->dropped);
+  return false;
+}
+
+bool HAL_ISR_ATTR event_post_from_isr(event_task_t task, event_handler_t handler, uint32_t arg) {
+  event_t event = { .handler = handler, .arg = arg, .time_us = hal_time_us() };
+  if (hal_queue_send_from_isr(task->queue, &event)) return true;
+  metric_inc(&task->dropped);
+  return false;
+}
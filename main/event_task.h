@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "hal.h"
+
+/* Event dispatch tasks.
+ *
+ * Timer callbacks and ISRs must not block or do slow work: they run on
+ * the shared esp_timer task, or with interrupts masked.  Instead they
+ * post a small event to the event task of the subsystem they belong to,
+ * which runs the handler at that subsystem's priority.  Events on one
+ * task are handled in the order posted, so a subsystem's state needs no
+ * locking as long as only its handlers touch it.
+ *
+ * Each task reports, through the metrics registry, the latency from
+ * post to handler start ("ev.<name>.latency_us", and the worst ever in
+ * "ev.<name>.worst_us") and the events lost to a full queue
+ * ("ev.<name>.dropped").
+ */
+
+typedef struct event event_t;
+typedef void (*event_handler_t)(const event_t *event);
+
+struct event {
+  event_handler_t handler;
+  uint32_t arg;
+  int64_t time_us;		/* when it was posted */
+};
+
+typedef struct event_task *event_task_t;
+
+#define EVENT_TASK_MAX 4
+
+/* Storage for one task's stack and queue, for HAL_STORAGE() */
+#define EVENT_TASK_STORAGE_SIZE(stack, queue_len) \
+  (HAL_TASK_STORAGE_SIZE(stack) + HAL_QUEUE_STORAGE_SIZE(queue_len, sizeof(event_t)))
+
+/* Tasks come from a static pool of EVENT_TASK_MAX and are never
+ * deleted; storage is EVENT_TASK_STORAGE_SIZE(stack, queue_len) */
+event_task_t event_task_create(const char *name, uint32_t stack, int priority,
+			       uint32_t queue_len, void *storage);
+
+bool event_post(event_task_t task, event_handler_t handler, uint32_t arg);
+bool event_post_from_isr(event_task_t task, event_handler_t handler, uint32_t arg);
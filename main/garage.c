@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <esp_wifi.h>
 #include <esp_event_loop.h>
@@ -10,10 +11,18 @@
 #include <homekit/homekit.h>
 #include <homekit/characteristics.h>
 #include "wifi.h"
+#include "wifi_conn.h"
+#include "hal.h"
+#include "garage_config.h"
 #include "garage_control.h"
+#include "span_trace.h"
+#include "notify_coalesce.h"
 
 #include "syslog.h"
+#include "crash_log.h"
 #include "heartbeat.h"
+#include "timer_wheel.h"
+#include "wall_clock.h"
 
 #define ALLOW_REMOTE_OPEN
 #define ALLOW_REMOTE_CLOSE
@@ -24,10 +33,10 @@ void on_wifi_ready();
 
 esp_err_t event_handler(void *ctx, system_event_t *event)
 {
+    wifi_conn_event(event);
     switch(event->event_id) {
         case SYSTEM_EVENT_STA_START:
             printf("STA start\n");
-            esp_wifi_connect();
             break;
         case SYSTEM_EVENT_STA_GOT_IP:
             printf("WiFI ready\n");
@@ -35,7 +44,6 @@ esp_err_t event_handler(void *ctx, system_event_t *event)
             break;
         case SYSTEM_EVENT_STA_DISCONNECTED:
             printf("STA disconnected\n");
-            esp_wifi_connect();
             break;
         default:
             break;
@@ -50,32 +58,62 @@ static void wifi_init() {
     wifi_init_config_t wifi_init_config = WIFI_INIT_CONFIG_DEFAULT();
     ESP_ERROR_CHECK(esp_wifi_init(&wifi_init_config));
     ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+}
 
-    wifi_config_t wifi_config = {
-        .sta = {
-            .ssid = WIFI_SSID,
-            .password = WIFI_PASSWORD,
-        },
-    };
-
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
-    ESP_ERROR_CHECK(esp_wifi_start());
+/* Once the doors' services are built: on_wifi_ready() starts the
+ * HomeKit server on them */
+static void wifi_start() {
+    wifi_conn_start(WIFI_SSID, WIFI_PASSWORD);
+#if GARAGE_LOW_POWER
+    /* wake for every DTIM beacon rather than a longer listen interval:
+     * HomeKit controllers expect their keep-alives and requests to be
+     * answered promptly */
+    ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+#endif
 }
 
 const int GPIO_LED = 2;
 //bool garage_open = false;
-static garage_state_t garage_target = GARAGE_OPEN;
-static garage_state_t garage_current = GARAGE_OPEN;
-extern homekit_characteristic_t c_current_door_state;
-extern homekit_characteristic_t c_target_door_state;
+
+static const garage_door_config_t door_config[] = GARAGE_DOORS;
+#define DOOR_COUNT (sizeof(door_config) / sizeof(door_config[0]))
+
+/* The HomeKit side of a door, one GARAGE_DOOR_OPENER service each;
+ * the index matches garage_door() */
+typedef struct {
+  garage_state_t current;
+  garage_state_t target;
+  bool obstructed;
+  homekit_characteristic_t name;
+  homekit_characteristic_t current_state;
+  homekit_characteristic_t target_state;
+  homekit_characteristic_t obstruction;
+  homekit_characteristic_t *characteristics[5];
+  homekit_service_t service;
+} homekit_door_t;
+
+static homekit_door_t homekit_doors[GARAGE_MAX_DOORS];
+
+#define HOMEKIT_DOOR_OF(ch, member) \
+  ((homekit_door_t *)((char *)(ch) - offsetof(homekit_door_t, member)))
 
 void led_write(bool on) {
     gpio_set_level(GPIO_LED, on ? 1 : 0);
 }
 
 
+/* The identify blink has a task of its own from boot, woken through a
+ * one deep queue; a request while it blinks is dropped */
+#define IDENTIFY_TASK_STACK 1024
+static hal_queue_t identify_queue;
+HAL_STORAGE(identify_task_storage, HAL_TASK_STORAGE_SIZE(IDENTIFY_TASK_STACK));
+HAL_STORAGE(identify_queue_storage, HAL_QUEUE_STORAGE_SIZE(1, sizeof(uint8_t)));
+
 void led_identify_task(void *_args) {
+  uint8_t request;
+
+  for (;;) {
+    if (!hal_queue_receive(identify_queue, &request, HAL_WAIT_FOREVER)) continue;
     for (int i=0; i<3; i++) {
         for (int j=0; j<2; j++) {
             led_write(true);
@@ -88,37 +126,67 @@ void led_identify_task(void *_args) {
     }
 
     led_write(false);
-
-    vTaskDelete(NULL);
+  }
 }
 
 void garage_identify(homekit_value_t _value) {
+  uint8_t request = 1;
+
   ESP_LOGI(__FUNCTION__, "Garage identify");
-  xTaskCreate(led_identify_task, "LED identify", 512, NULL, 2, NULL);
+  hal_queue_send(identify_queue, &request);
 }
 
-homekit_value_t garage_current_get(void) {
-  return HOMEKIT_UINT8(garage_current);
+static void identify_init(void) {
+  identify_queue = hal_queue_create(1, sizeof(uint8_t), identify_queue_storage);
+  hal_task_create(led_identify_task, "LED identify", IDENTIFY_TASK_STACK, NULL, 2,
+		  identify_task_storage);
 }
 
-/* This is called to provide state updates, and may repeat existing states, so filter */
-void garage_state_callback(garage_state_t current_state, garage_state_t target_state) {
-  if (garage_target != target_state) {
-    garage_target = target_state;
-    homekit_characteristic_notify(&c_target_door_state, HOMEKIT_UINT8(garage_target));
-  }
-  if (garage_current != current_state) {
-    garage_current = current_state;
-    homekit_characteristic_notify(&c_current_door_state, HOMEKIT_UINT8(garage_current));
+homekit_value_t garage_current_get(const homekit_characteristic_t *ch) {
+  return HOMEKIT_UINT8(HOMEKIT_DOOR_OF(ch, current_state)->current);
+}
+
+/* Controllers hear about changes through the coalescer, which has
+ * already dropped repeats of the state last sent */
+static void garage_notify(garage_door_t *door, bool current_changed, garage_state_t current,
+			  bool target_changed, garage_state_t target) {
+  homekit_door_t *hd = &homekit_doors[garage_door_index(door)];
+  if (target_changed)
+    homekit_characteristic_notify(&hd->target_state, HOMEKIT_UINT8(target));
+  if (current_changed)
+    homekit_characteristic_notify(&hd->current_state, HOMEKIT_UINT8(current));
+  if (current == target) garage_span_mark(door, SPAN_NOTIFY, hal_time_us());
+}
+
+homekit_value_t garage_obstruction_get(const homekit_characteristic_t *ch) {
+  return HOMEKIT_BOOL(HOMEKIT_DOOR_OF(ch, obstruction)->obstructed);
+}
+
+/* This is called to provide state updates, and may repeat existing states.
+ * The getters answer with the latest state straight away.  Obstruction
+ * only changes with a stuck door, too rarely to need coalescing. */
+void garage_state_callback(garage_door_t *door, garage_state_t current_state,
+			   garage_state_t target_state) {
+  homekit_door_t *hd = &homekit_doors[garage_door_index(door)];
+  bool obstructed = garage_get_obstructed(door);
+  hd->target = target_state;
+  hd->current = current_state;
+  if (obstructed != hd->obstructed) {
+    hd->obstructed = obstructed;
+    homekit_characteristic_notify(&hd->obstruction, HOMEKIT_BOOL(obstructed));
   }
+  notify_coalesce_update(door, current_state, target_state);
 }
 
 
-homekit_value_t garage_target_get(void) {
-  return HOMEKIT_UINT8(garage_target);
+homekit_value_t garage_target_get(const homekit_characteristic_t *ch) {
+  return HOMEKIT_UINT8(HOMEKIT_DOOR_OF(ch, target_state)->target);
 }
 
-void garage_target_set(homekit_value_t value) {
+void garage_target_set(homekit_characteristic_t *ch, const homekit_value_t value) {
+    int64_t entry = hal_time_us();
+    homekit_door_t *hd = HOMEKIT_DOOR_OF(ch, target_state);
+    garage_door_t *door = garage_door(hd - homekit_doors);
     if (value.format != homekit_format_uint8) {
       ESP_LOGE(__FUNCTION__, "Invalid value format: %d", value.format);
         return;
@@ -126,19 +194,23 @@ void garage_target_set(homekit_value_t value) {
 
     switch (value.int_value) {
     case GARAGE_OPEN:
-      if (garage_target == GARAGE_OPEN) return;
+      if (hd->target == GARAGE_OPEN) return;
 #ifdef ALLOW_REMOTE_OPEN
-      garage_action_open();
+      garage_span_begin(door, entry);
+      notify_coalesce_request(door, GARAGE_OPEN);
+      garage_action_open(door);
 #else
-    homekit_characteristic_notify(&c_target_door_state, HOMEKIT_UINT8(garage_target));
+    homekit_characteristic_notify(ch, HOMEKIT_UINT8(hd->target));
 #endif
       break;
     case GARAGE_CLOSED:
-      if (garage_target == GARAGE_CLOSED) return;
+      if (hd->target == GARAGE_CLOSED) return;
 #ifdef ALLOW_REMOTE_CLOSE
-      garage_action_close();
+      garage_span_begin(door, entry);
+      notify_coalesce_request(door, GARAGE_CLOSED);
+      garage_action_close(door);
 #else
-    homekit_characteristic_notify(&c_target_door_state, HOMEKIT_UINT8(garage_target));
+    homekit_characteristic_notify(ch, HOMEKIT_UINT8(hd->target));
 #endif
       break;
     default:
@@ -147,18 +219,8 @@ void garage_target_set(homekit_value_t value) {
     }
 }
 
-
-homekit_characteristic_t c_current_door_state =
-		  HOMEKIT_CHARACTERISTIC_(CURRENT_DOOR_STATE, 0,
-					 .getter=garage_current_get);
-
-homekit_characteristic_t c_target_door_state =
-		  HOMEKIT_CHARACTERISTIC_(TARGET_DOOR_STATE, 0,
-					 .getter=garage_target_get,
-					 .setter=garage_target_set);
-
-homekit_accessory_t *accessories[] = {
-    HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_lightbulb, .services=(homekit_service_t*[]){
+/* accessory information, then a service per door */
+static homekit_service_t *services[GARAGE_MAX_DOORS + 2] = {
         HOMEKIT_SERVICE(ACCESSORY_INFORMATION, .characteristics=(homekit_characteristic_t*[]){
             HOMEKIT_CHARACTERISTIC(NAME, "Garage Controller"),
             HOMEKIT_CHARACTERISTIC(MANUFACTURER, "PAO"),
@@ -168,15 +230,10 @@ homekit_accessory_t *accessories[] = {
             HOMEKIT_CHARACTERISTIC(IDENTIFY, garage_identify),
             NULL
         }),
-	  HOMEKIT_SERVICE(GARAGE_DOOR_OPENER, .primary=true, .characteristics=(homekit_characteristic_t*[]){
-	        HOMEKIT_CHARACTERISTIC(NAME, "Garage"),
-		  &c_current_door_state,
-		  &c_target_door_state,
-		  HOMEKIT_CHARACTERISTIC(OBSTRUCTION_DETECTED, false),
-		  NULL,
-		  }),
-        NULL
-    }),
+};
+
+homekit_accessory_t *accessories[] = {
+    HOMEKIT_ACCESSORY(.id=1, .category=homekit_accessory_category_lightbulb, .services=services),
     NULL
 };
 
@@ -185,7 +242,41 @@ homekit_server_config_t config = {
     .password = "222-22-222"
 };
 
+/* After garage_init(): seeded from the sensors and the saved state, so
+ * the first values controllers read are already right */
+static void homekit_doors_init(void) {
+  size_t i;
+  for (i = 0; i < garage_door_count(); i++) {
+    homekit_door_t *hd = &homekit_doors[i];
+    garage_door_t *door = garage_door(i);
+
+    hd->current = garage_get_current_state(door);
+    hd->target = garage_get_target_state(door);
+    hd->name = (homekit_characteristic_t)
+      HOMEKIT_CHARACTERISTIC_(NAME, (char *)garage_door_name(door));
+    hd->current_state = (homekit_characteristic_t)
+      HOMEKIT_CHARACTERISTIC_(CURRENT_DOOR_STATE, hd->current, .getter_ex=garage_current_get);
+    hd->target_state = (homekit_characteristic_t)
+      HOMEKIT_CHARACTERISTIC_(TARGET_DOOR_STATE, hd->target,
+			      .getter_ex=garage_target_get, .setter_ex=garage_target_set);
+    hd->obstruction = (homekit_characteristic_t)
+      HOMEKIT_CHARACTERISTIC_(OBSTRUCTION_DETECTED, false, .getter_ex=garage_obstruction_get);
+    hd->characteristics[0] = &hd->name;
+    hd->characteristics[1] = &hd->current_state;
+    hd->characteristics[2] = &hd->target_state;
+    hd->characteristics[3] = &hd->obstruction;
+    hd->characteristics[4] = NULL;
+    hd->service = (homekit_service_t)
+      HOMEKIT_SERVICE_(GARAGE_DOOR_OPENER, .primary=(i == 0), .characteristics=hd->characteristics);
+    services[i + 1] = &hd->service;
+  }
+}
+
+/* Runs on every reconnect, the server must only be started once */
 void on_wifi_ready() {
+    static bool homekit_started = false;
+    if (homekit_started) return;
+    homekit_started = true;
     homekit_server_init(&config);
 }
 
@@ -198,10 +289,20 @@ void app_main(void) {
     }
     ESP_ERROR_CHECK( ret );
 
+    crash_log_init();
     ESP_LOGI(__FUNCTION__, "System startup");
+    hal_power_init(GARAGE_LOW_POWER);
+    timer_wheel_init(GARAGE_LOW_POWER ? GARAGE_TIMER_ALIGN_MILLISECONDS * 1000 : 0);
     wifi_init();
+    wall_clock_init(GARAGE_SNTP_SERVER);
     syslog_init();
     heartbeat_init(30);
-    garage_init();
+    garage_init(door_config, DOOR_COUNT);
+    homekit_doors_init();
+    notify_coalesce_init(garage_notify);
     garage_set_state_callback(garage_state_callback);
+    wifi_start();
+    identify_init();
+    /* everything of ours is in place; from here on our RAM is fixed */
+    hal_heap_seal(GARAGE_STATIC_ONLY);
 }
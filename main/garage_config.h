@@ -7,6 +7,76 @@
 #define GARAGE_CLOSE_CONTROL_PIN 12
 #define GARAGE_STATUS_LED_PIN 14
 
+/* The doors on this controller, see garage_door_config_t; one HomeKit
+ * service each.  Single button openers give the same control pin twice. */
+#define GARAGE_MAX_DOORS 8
+#define GARAGE_DOORS {							\
+    { "Garage", GARAGE_OPEN_SENSOR_PIN, GARAGE_CLOSED_SENSOR_PIN,	\
+      GARAGE_OPEN_CONTROL_PIN, GARAGE_CLOSE_CONTROL_PIN },		\
+  }
+
 #define GARAGE_MAX_TRANSIT_SECONDS 30
+/* A learned travel is overdue after mean + SIGMAS * sigma + MARGIN,
+ * once MIN_SAMPLES travels that way are known (travel_profile.h) */
+#define GARAGE_TRAVEL_MIN_SAMPLES 3
+#define GARAGE_TRAVEL_SIGMAS 4
+#define GARAGE_TRAVEL_MARGIN_MILLISECONDS 2000
 #define GARAGE_SENSOR_POLL_MILLISECONDS 100
+#define GARAGE_SENSOR_SETTLE_MILLISECONDS 300   /* sensor made */
+#define GARAGE_SENSOR_RELEASE_MILLISECONDS 300  /* sensor released */
+#define GARAGE_SENSOR_GLITCH_MILLISECONDS 20
 #define GARAGE_CONTROL_PULSE_MILLISECONDS 1000
+/* Least time between the end of one relay pulse and the start of the
+ * other relay's on the same door */
+#define GARAGE_CONTROL_GAP_MILLISECONDS 250
+
+/* Sensor sampling mode.
+ * INTERRUPT: pin edges wake a deferred handler, which only runs the
+ *            debounce until the signal has settled again.
+ * POLL:      sample every GARAGE_SENSOR_POLL_MILLISECONDS, forever.
+ */
+#define GARAGE_SENSOR_MODE_POLL 0
+#define GARAGE_SENSOR_MODE_INTERRUPT 1
+#define GARAGE_SENSOR_MODE GARAGE_SENSOR_MODE_INTERRUPT
+
+/* The garage event task runs the door state machine, the sensor
+ * filters and the HomeKit notify; timers and the ISR post to it */
+#define GARAGE_EVENT_TASK_PRIORITY 6
+#define GARAGE_EVENT_TASK_STACK 4096
+#define GARAGE_EVENT_QUEUE_LEN 32
+/* A timer whose event finds that queue full, say behind a burst of
+ * sensor edges, tries again this much later rather than lose it */
+#define GARAGE_EVENT_RETRY_MILLISECONDS 10
+
+/* HomeKit notifications: state changes within the coalesce window go
+ * out as one notify cycle, and after a notify further changes are held
+ * for the flap interval so a door bouncing A->B->A faster than that is
+ * reported once, with the final state */
+#define GARAGE_NOTIFY_COALESCE_MILLISECONDS 50
+#define GARAGE_NOTIFY_FLAP_MILLISECONDS 2000
+
+/* Settled door states are journalled to NVS at most this often, and
+ * only once the door has stayed put for the coalesce time */
+#define GARAGE_STORE_COALESCE_SECONDS 10
+#define GARAGE_STORE_MIN_INTERVAL_SECONDS 300
+
+/* Syslog TIMESTAMPs come from SNTP (main/wall_clock.h) */
+#define GARAGE_SNTP_SERVER "pool.ntp.org"
+
+/* Low power: DFS and automatic light sleep whenever every task is
+ * blocked, woken by the sensor pins and timers.  Timers that tolerate
+ * a delay (heartbeat, syslog sends, NVS writes) get more slack and fire
+ * on a common grid so they share wakeups.  Needs CONFIG_PM_ENABLE and
+ * CONFIG_FREERTOS_USE_TICKLESS_IDLE. */
+#define GARAGE_LOW_POWER 0
+#define GARAGE_TIMER_ALIGN_MILLISECONDS 1000
+
+/* How late those timers may fire (timer_wheel.h) */
+#define GARAGE_TIMER_SLACK_MILLISECONDS (GARAGE_LOW_POWER ? GARAGE_TIMER_ALIGN_MILLISECONDS : 100)
+
+/* Memory: our tasks, queues and buffers are static, and
+ * `make -C host ram` lists the RAM each module owns.  A heap allocation
+ * by our code once app_main() is done is counted in heap.late_allocs
+ * and, with GARAGE_STATIC_ONLY, fails an assert.  Needs
+ * CONFIG_SUPPORT_STATIC_ALLOCATION. */
+#define GARAGE_STATIC_ONLY 1
@@ -1,225 +1,599 @@
 #include <stdio.h>
-#include <esp_event_loop.h>
 #include <esp_log.h>
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/task.h>
-
+#include "hal.h"
 #include "garage_config.h"
 #include "garage_control.h"
+#include "debounce.h"
+#include "door_fsm.h"
+#include "metrics.h"
+#include "span_trace.h"
+#include "event_task.h"
+#include "door_store.h"
+#include "crash_log.h"
+#include "travel_profile.h"
+#include "syslog.h"
+#include "timer_wheel.h"
 
-#define STATE_STR(x) (x==GARAGE_OPEN ? "OPEN" : \
-		      x==GARAGE_CLOSED ? "CLOSED" : \
-		      x==GARAGE_OPENING ? "OPENING" : \
-		      x==GARAGE_CLOSING ? "CLOSING" : \
-		      x==GARAGE_STOPPED ? "STOPPED" : "UNKNOWN")
-
+struct garage_door {
+  const garage_door_config_t *config;
+  door_fsm_t fsm;
+  debounce_t open_sensor;
+  debounce_t closed_sensor;
+  hal_pulse_t open_relay;
+  hal_pulse_t close_relay;
+  hal_pulse_t relay_queued;	/* waiting for the other relay */
+  wheel_timer_t stuck_timer;
+  bool obstructed;		/* overdue on its last travel */
+  int64_t travel_start_us;	/* -1 if not moving, or not known when it set off */
+  uint32_t travel_expected_ms;	/* learned mean for this travel, 0 if none */
+  int64_t stuck_due_us;		/* when stuck_timer fires, INT64_MAX if stopped */
+};
 
-static void set_target_state(garage_state_t state);
-static void set_current_state(garage_state_t state);
+static void garage_dispatch(garage_door_t *door, door_event_t event);
 
-static void control_pin_timer_callback(void* arg);
+static void open_relay_done(void *arg);
+static void close_relay_done(void *arg);
 static void sensor_pin_timer_callback(void* arg);
 static void stuck_timer_callback(void* arg);
+static void sensor_pins_init(void);
 
 
-static garage_state_t last_good_state = 0;
-static garage_state_t current_state = GARAGE_OPEN;
-static garage_state_t target_state = GARAGE_OPEN;
+/* Everything below runs on the garage event task except where noted:
+ * timer callbacks and the ISR only post to it.  Per door events carry
+ * the door index in the low byte of their argument. */
+static event_task_t garage_events;
+HAL_STORAGE(garage_events_storage,
+	    EVENT_TASK_STORAGE_SIZE(GARAGE_EVENT_TASK_STACK, GARAGE_EVENT_QUEUE_LEN));
+static garage_door_t doors[GARAGE_MAX_DOORS];
+static size_t door_count;
 static garage_state_callback_t garage_state_callback = NULL;
 
-const static esp_timer_create_args_t control_pin_timer_args = {
-  .callback = control_pin_timer_callback,
-  .arg = 0,
-  .dispatch_method =  ESP_TIMER_TASK,
-  .name = "control_pin_timer" };
-static esp_timer_handle_t control_pin_timer;
-
-const static esp_timer_create_args_t sensor_pin_timer_args = {
-  .callback = sensor_pin_timer_callback,
-  .arg = 0,
-  .dispatch_method =  ESP_TIMER_TASK,
-  .name = "sensor_pin_timer" };
-static esp_timer_handle_t sensor_pin_timer;
-
-const static esp_timer_create_args_t stuck_timer_args = {
-  .callback = stuck_timer_callback,
-  .arg = 0,
-  .dispatch_method =  ESP_TIMER_TASK,
-  .name = "stuck_timer" };
-static esp_timer_handle_t stuck_timer;
+/* sensor pin to door, for the ISR and the edge handler */
+#define GARAGE_PINS 64
+static int8_t pin_door[GARAGE_PINS];
+static uint64_t sensor_pin_mask;
+
+/* The door whose request the span trace is following, and the relay
+ * that request pulsed */
+static garage_door_t *span_door;
+static hal_pulse_t span_relay;
+
+static wheel_timer_t sensor_pin_timer;
+
+static metric_t sensor_edges = METRIC_COUNTER_INIT("garage.sensor_edges");
+static metric_t door_transitions = METRIC_COUNTER_INIT("garage.transitions");
+static metric_t relay_interlocked = METRIC_COUNTER_INIT("garage.relay_interlocked");
+static metric_t travel_overdue = METRIC_COUNTER_INIT("garage.travel_overdue");
+static metric_histogram_t travel_ms = METRIC_HISTOGRAM_CUMULATIVE_INIT("garage.travel_ms");
+static metric_histogram_t sensor_us = METRIC_HISTOGRAM_INIT("garage.sensor_us");
+static metric_histogram_t notify_us = METRIC_HISTOGRAM_INIT("garage.notify_us");
 
 #define GPIO_SEL_(x) ((uint64_t)(((uint64_t)1)<<x))
-void garage_init(void) {
-  gpio_config_t control_pins = {
-    .pin_bit_mask = GPIO_SEL_(GARAGE_OPEN_CONTROL_PIN) | GPIO_SEL_(GARAGE_CLOSE_CONTROL_PIN),
-    .mode = GPIO_MODE_OUTPUT_OD,
-    .pull_up_en = GPIO_PULLUP_DISABLE,
-    .pull_down_en = GPIO_PULLDOWN_DISABLE,
-    .intr_type = GPIO_INTR_DISABLE,
-  };
-  gpio_config_t sensor_pins = {
-    .pin_bit_mask = GPIO_SEL_(GARAGE_OPEN_SENSOR_PIN) | GPIO_SEL_(GARAGE_CLOSED_SENSOR_PIN),
-    .mode = GPIO_MODE_INPUT,
-    .pull_up_en = GPIO_PULLUP_ENABLE,
-    .pull_down_en = GPIO_PULLDOWN_DISABLE,
-    .intr_type = GPIO_INTR_DISABLE,
-  };
-
-  gpio_config(&sensor_pins);
-  gpio_config(&control_pins);
-  gpio_set_level(GARAGE_OPEN_CONTROL_PIN, 1);
-  gpio_set_level(GARAGE_CLOSE_CONTROL_PIN, 1);
-
-  gpio_set_level(GARAGE_STATUS_LED_PIN, 0);
-  gpio_set_direction(GARAGE_STATUS_LED_PIN, GPIO_MODE_OUTPUT);
-
-  esp_timer_create(&control_pin_timer_args, &control_pin_timer);
-  esp_timer_create(&sensor_pin_timer_args, &sensor_pin_timer);
-  esp_timer_create(&stuck_timer_args, &stuck_timer);
-  esp_timer_start_periodic(sensor_pin_timer, GARAGE_SENSOR_POLL_MILLISECONDS);
-  ESP_LOGI(__FUNCTION__, "Completed garage_init");
+void garage_init(const garage_door_config_t *config, size_t count) {
+  size_t i;
+
+  if (count > GARAGE_MAX_DOORS) {
+    ESP_LOGE(__FUNCTION__, "%u doors, only %u supported", (unsigned)count, GARAGE_MAX_DOORS);
+    count = GARAGE_MAX_DOORS;
+  }
+  garage_events = event_task_create("garage", GARAGE_EVENT_TASK_STACK,
+				    GARAGE_EVENT_TASK_PRIORITY, GARAGE_EVENT_QUEUE_LEN,
+				    garage_events_storage);
+  door_count = count;
+  for (i = 0; i < count; i++) {
+    doors[i].config = &config[i];
+    doors[i].open_relay = hal_pulse_create(config[i].open_control_pin, open_relay_done, &doors[i]);
+    /* a single button opener's one relay is shared: a second pulse
+     * object would drive the same pin behind the first one's back */
+    if (config[i].close_control_pin == config[i].open_control_pin)
+      doors[i].close_relay = doors[i].open_relay;
+    else
+      doors[i].close_relay = hal_pulse_create(config[i].close_control_pin, close_relay_done,
+					      &doors[i]);
+    doors[i].stuck_timer = timer_wheel_create("stuck_timer", stuck_timer_callback, &doors[i]);
+    doors[i].stuck_due_us = INT64_MAX;
+  }
+
+  hal_gpio_set_level(GARAGE_STATUS_LED_PIN, 0);
+  hal_gpio_set_output(GARAGE_STATUS_LED_PIN, true);
+
+  sensor_pin_timer = timer_wheel_create("sensor_pin_timer", sensor_pin_timer_callback, NULL);
+  metrics_register(&sensor_edges);
+  metrics_register(&door_transitions);
+  metrics_register(&relay_interlocked);
+  metrics_register(&travel_overdue);
+  metrics_register(&travel_ms.metric);
+  metrics_register(&sensor_us.metric);
+  metrics_register(&notify_us.metric);
+  span_init();
+  travel_profile_init(count);
+  sensor_pins_init();
+  ESP_LOGI(__FUNCTION__, "Completed garage_init, %u doors", (unsigned)count);
+}
+
+size_t garage_door_count(void) {
+  return door_count;
+}
+
+garage_door_t *garage_door(size_t index) {
+  return index < door_count ? &doors[index] : NULL;
+}
+
+size_t garage_door_index(const garage_door_t *door) {
+  return door - doors;
+}
+
+const char *garage_door_name(const garage_door_t *door) {
+  return door->config->name;
+}
+
+static void garage_notify_event(const event_t *event) {
+  size_t i;
+  if (!garage_state_callback) return;
+  for (i = 0; i < door_count; i++)
+    garage_state_callback(&doors[i], doors[i].fsm.state, doors[i].fsm.target);
 }
 
+bool garage_post(event_handler_t handler, uint32_t arg) {
+  return event_post(garage_events, handler, arg);
+}
+
+/* The callback always runs on the garage event task */
 void garage_set_state_callback(garage_state_callback_t fn) {
   garage_state_callback = fn;
-  if (garage_state_callback) garage_state_callback(current_state, target_state);
+  event_post(garage_events, garage_notify_event, 0);
+}
+
+garage_state_t garage_get_current_state(const garage_door_t *door) {
+  return TO_HOMEKIT(door->fsm.state);
+}
+
+garage_state_t garage_get_target_state(const garage_door_t *door) {
+  return TO_HOMEKIT(door->fsm.target);
 }
 
-garage_state_t garage_get_current_state(void) {
-  return TO_HOMEKIT(current_state);
+bool garage_get_obstructed(const garage_door_t *door) {
+  return door->obstructed;
 }
 
+bool garage_get_travel(const garage_door_t *door, garage_travel_t *travel) {
+  int64_t start = door->travel_start_us;
+  uint32_t expected = door->travel_expected_ms;
+  uint32_t elapsed, moved;
 
-static bool garage_is_open(void) {
-  return gpio_get_level(GARAGE_OPEN_SENSOR_PIN) == 0 ? true : false;
+  if (start < 0 || !expected) return false;
+  elapsed = (hal_time_us() - start) / 1000;
+  moved = elapsed < expected ? (uint64_t)elapsed * 100 / expected : 100;
+  /* not there until the sensor says so */
+  if (moved > 99) moved = 99;
+  travel->position = door->fsm.state == GARAGE_OPENING ? moved : 100 - moved;
+  travel->eta_ms = elapsed < expected ? expected - elapsed : 0;
+  return true;
 }
-static bool garage_is_closed(void) {
-  return gpio_get_level(GARAGE_CLOSED_SENSOR_PIN) == 0 ? true : false;
+
+/* Span stages are only marked for the door the span follows */
+void garage_span_mark(const garage_door_t *door, span_stage_t stage, int64_t now) {
+  if (door == span_door) span_mark(stage, now);
 }
 
-void garage_action_open(void) {
-  ESP_LOGI(__FUNCTION__, "*** OPENING GARAGE");
-  gpio_set_direction(GARAGE_OPEN_CONTROL_PIN, GPIO_MODE_OUTPUT);
-  gpio_set_level(GARAGE_OPEN_CONTROL_PIN, 0);
-  esp_timer_stop(control_pin_timer);
-  esp_timer_start_once(control_pin_timer, GARAGE_CONTROL_PULSE_MILLISECONDS * 1000);
-  set_target_state(GARAGE_OPEN);
+/* A request is followed from the command posted for it, or from the
+ * setter if garage_span_begin() came first.  arg is the door index,
+ * with the event in bits 8 and up. */
+static void garage_command_event(const event_t *event) {
+  garage_door_t *door = &doors[event->arg & 0xFF];
+
+  if (door == span_door) {
+    span_mark(SPAN_COMMAND, event->time_us);
+  }else{
+    span_door = door;
+    span_begin(SPAN_COMMAND, event->time_us);
+  }
+  span_relay = NULL;
+  garage_dispatch(door, event->arg >> 8);
 }
 
-void garage_action_close(void) {
-  ESP_LOGI(__FUNCTION__, "*** CLOSING GARAGE");
-  gpio_set_direction(GARAGE_CLOSE_CONTROL_PIN, GPIO_MODE_OUTPUT);
-  gpio_set_level(GARAGE_CLOSE_CONTROL_PIN, 0);
-  esp_timer_stop(control_pin_timer);
-  esp_timer_start_once(control_pin_timer, GARAGE_CONTROL_PULSE_MILLISECONDS * 1000);
-  set_target_state(GARAGE_CLOSED);
+/* arg is the door index, with how long before the post the setter was
+ * entered in bits 8 and up, in us */
+static void garage_span_begin_event(const event_t *event) {
+  span_door = &doors[event->arg & 0xFF];
+  span_relay = NULL;
+  span_begin(SPAN_SETTER, event->time_us - (event->arg >> 8));
+}
+
+/* Called from any task */
+void garage_span_begin(garage_door_t *door, int64_t setter_us) {
+  int64_t before = hal_time_us() - setter_us;
+
+  if (before > 0xFFFFFF) before = 0xFFFFFF;
+  event_post(garage_events, garage_span_begin_event,
+	     garage_door_index(door) | (uint32_t)before << 8);
 }
 
-static void control_pin_timer_callback(void* arg) {
-  //  gpio_set_level(GARAGE_OPEN_CONTROL_PIN, 0);
-  //  gpio_set_level(GARAGE_CLOSE_CONTROL_PIN, 0);
-  gpio_set_direction(GARAGE_OPEN_CONTROL_PIN, GPIO_MODE_INPUT);
-  gpio_set_direction(GARAGE_CLOSE_CONTROL_PIN, GPIO_MODE_INPUT);
+/* Called from any task */
+void garage_action_open(garage_door_t *door) {
+  ESP_LOGI(__FUNCTION__, "*** OPENING %s", door->config->name);
+  event_post(garage_events, garage_command_event,
+	     garage_door_index(door) | DOOR_EV_CMD_OPEN << 8);
+}
+
+void garage_action_close(garage_door_t *door) {
+  ESP_LOGI(__FUNCTION__, "*** CLOSING %s", door->config->name);
+  event_post(garage_events, garage_command_event,
+	     garage_door_index(door) | DOOR_EV_CMD_CLOSE << 8);
+}
+
+/*******************************************************************
+ * Relays
+ *
+ * Pulses are timed by the pulse hardware.  A door's two relays are
+ * interlocked: a pulse asked for while the other relay is busy waits,
+ * latest request only, and follows GARAGE_CONTROL_GAP_MILLISECONDS
+ * after it ends.  Asking again for a relay that is already pulsing
+ * does nothing.  A single button opener has one relay for both, so
+ * nothing to interlock.
+ */
+/* Relay stages are only marked for the relay the span's request pulsed */
+static void relay_span_mark(garage_door_t *door, hal_pulse_t relay, span_stage_t stage,
+			    int64_t now) {
+  if (relay == span_relay) garage_span_mark(door, stage, now);
+}
+
+static void relay_pulse(garage_door_t *door, hal_pulse_t relay) {
+  hal_pulse_t other = relay == door->open_relay ? door->close_relay : door->open_relay;
+
+  if (other != relay && hal_pulse_busy(other)) {
+    door->relay_queued = relay;
+    if (door == span_door) span_relay = relay;
+    metric_inc(&relay_interlocked);
+    return;
+  }
+  door->relay_queued = NULL;
+  if (hal_pulse_start(relay, 0, GARAGE_CONTROL_PULSE_MILLISECONDS * 1000)) {
+    if (door == span_door) span_relay = relay;
+    relay_span_mark(door, relay, SPAN_RELAY_ON, hal_time_us());
+  }
+}
+
+/* arg is the door index, with RELAY_DONE_CLOSE for the close relay */
+#define RELAY_DONE_CLOSE 0x100
+
+static void relay_done_event(const event_t *event) {
+  garage_door_t *door = &doors[event->arg & 0xFF];
+  hal_pulse_t done = event->arg & RELAY_DONE_CLOSE ? door->close_relay : door->open_relay;
+  hal_pulse_t queued = door->relay_queued;
+  int64_t now = hal_time_us();
+
+  relay_span_mark(door, done, SPAN_RELAY_OFF, now);
+  if (!queued || hal_pulse_busy(door->open_relay) || hal_pulse_busy(door->close_relay)) return;
+  door->relay_queued = NULL;
+  if (hal_pulse_start(queued, GARAGE_CONTROL_GAP_MILLISECONDS * 1000,
+		      GARAGE_CONTROL_PULSE_MILLISECONDS * 1000))
+    relay_span_mark(door, queued, SPAN_RELAY_ON, now + GARAGE_CONTROL_GAP_MILLISECONDS * 1000);
+}
+
+/* From interrupt context */
+static void HAL_ISR_ATTR open_relay_done(void *arg) {
+  event_post_from_isr(garage_events, relay_done_event, (garage_door_t *)arg - doors);
+}
+
+static void HAL_ISR_ATTR close_relay_done(void *arg) {
+  event_post_from_isr(garage_events, relay_done_event,
+		      ((garage_door_t *)arg - doors) | RELAY_DONE_CLOSE);
 }
 
 /*******************************************************************
  * Stuck door monitor
+ *
+ * A travel is overdue after the time learned for that door and
+ * direction (see travel_profile.h), or GARAGE_MAX_TRANSIT_SECONDS until
+ * enough travels are known.  An overdue door is stopped and reported as
+ * obstructed until it next sets off or reaches a sensor.
  */
-static bool door_is_stuck = false;
+static void start_stuck_timer(garage_door_t *door, int64_t now) {
+  bool opening = door->fsm.state == GARAGE_OPENING;
+  travel_stats_t stats;
+  bool learned = travel_profile_get(garage_door_index(door), opening, &stats);
 
-static void start_stuck_timer(void) {
-  door_is_stuck = false;
-  esp_timer_stop(stuck_timer);
-  esp_timer_start_once(stuck_timer, GARAGE_MAX_TRANSIT_SECONDS * 1000000);
+  door->obstructed = false;
+  door->travel_start_us = now;
+  door->travel_expected_ms = learned ? stats.mean_ms : 0;
+  /* set off before a reset: the time already spent is unknown */
+  if (now < 0) stats.timeout_ms = GARAGE_MAX_TRANSIT_SECONDS * 1000;
+  door->stuck_due_us = hal_time_us() + stats.timeout_ms * 1000LL;
+  timer_wheel_start_once(door->stuck_timer, stats.timeout_ms * 1000ULL, 0);
+  if (learned && now >= 0)
+    ESP_LOGI(__FUNCTION__, "%s %s, due in %u.%u s, overdue after %u.%u s", door->config->name,
+	     door_state_str(door->fsm.state), (unsigned)(stats.mean_ms / 1000),
+	     (unsigned)(stats.mean_ms / 100 % 10), (unsigned)(stats.timeout_ms / 1000),
+	     (unsigned)(stats.timeout_ms / 100 % 10));
 }
-static void stop_stuck_timer(void) {
-  esp_timer_stop(stuck_timer);
-  door_is_stuck = false;
+
+/* A travel from one sensor to the other teaches the profile */
+static void stop_stuck_timer(garage_door_t *door, garage_state_t from, int64_t now) {
+  uint32_t travel;
+
+  timer_wheel_stop(door->stuck_timer);
+  door->stuck_due_us = INT64_MAX;
+  if (door->fsm.state != GARAGE_STOPPED) door->obstructed = false;
+  if (door->travel_start_us >= 0 &&
+      ((from == GARAGE_OPENING && door->fsm.state == GARAGE_OPEN) ||
+       (from == GARAGE_CLOSING && door->fsm.state == GARAGE_CLOSED))) {
+    travel = (now - door->travel_start_us) / 1000;
+    metric_observe(&travel_ms, travel);
+    travel_profile_add(garage_door_index(door), from == GARAGE_OPENING, travel);
+  }
+  door->travel_start_us = -1;
+  door->travel_expected_ms = 0;
+}
+
+static void stuck_event(const event_t *event) {
+  garage_door_t *door = &doors[event->arg];
+
+  /* the timer fired as the travel ended or set off again, and that
+   * event was handled first */
+  if (event->time_us < door->stuck_due_us) return;
+  door->stuck_due_us = INT64_MAX;
+  /* set first, the state callback reports it */
+  door->obstructed = true;
+  metric_inc(&travel_overdue);
+  ESP_LOGW(__FUNCTION__, "*** %s MAY BE STUCK", door->config->name);
+  garage_dispatch(door, DOOR_EV_STUCK);
+  if (door == span_door) span_abort();
+  garage_log_trace(door);
 }
+
 static void stuck_timer_callback(void* arg) {
-  door_is_stuck = true;
-  ESP_LOGW(__FUNCTION__, "*** DOOR MAY BE STUCK");
-  set_current_state(GARAGE_STOPPED);
+  garage_door_t *door = arg;
+  /* the queue is full; a lost event would leave a jam unreported */
+  if (!event_post(garage_events, stuck_event, garage_door_index(door)))
+    timer_wheel_start_once(door->stuck_timer, GARAGE_EVENT_RETRY_MILLISECONDS * 1000, 0);
 }
 
 /******************************************************************
- * 
+ * State machine glue: run an event through the door table and carry
+ * out whatever actions it asks for
  */
-static void set_target_state(garage_state_t state) {
-  target_state = state;
-}
-static void set_current_state(garage_state_t state) {
-  if (state == current_state) return;
-  if (current_state == GARAGE_OPEN || current_state == GARAGE_CLOSED) start_stuck_timer();
-  current_state = state;
-  switch (state) {
-  case GARAGE_OPEN:
-  case GARAGE_CLOSED:
-  case GARAGE_STOPPED:
-    last_good_state = state;
-    target_state = (state == GARAGE_CLOSED ? GARAGE_CLOSED : GARAGE_OPEN);
-    stop_stuck_timer();
-    break;
-  case GARAGE_OPENING:
-    target_state = GARAGE_OPEN;
-    break;
-  case GARAGE_CLOSING:
-    target_state = GARAGE_CLOSED;
-    break;
-  default:
-    break;
+static void garage_dispatch(garage_door_t *door, door_event_t event) {
+  int64_t now = hal_time_us();
+  garage_state_t from = door->fsm.state;
+  uint8_t actions = door_fsm_dispatch(&door->fsm, event, now);
+
+  if (actions)
+    crash_log_printf(SYSLOG_PRIO_NOTICE, door->config->name, "%s: %s -> %s (target %s)",
+		     door_event_str(event), door_state_str(from),
+		     door_state_str(door->fsm.state), door_state_str(door->fsm.target));
+
+  if (actions & DOOR_ACT_STUCK_START) start_stuck_timer(door, now);
+  if (actions & DOOR_ACT_STUCK_STOP) stop_stuck_timer(door, from, now);
+  if (actions & DOOR_ACT_PULSE_OPEN) relay_pulse(door, door->open_relay);
+  if (actions & DOOR_ACT_PULSE_CLOSE) relay_pulse(door, door->close_relay);
+  if (actions & DOOR_ACT_NOTIFY) {
+    ESP_LOGD(__FUNCTION__, "%s NEW STATE: %s => %s", door->config->name,
+	     door_state_str(door->fsm.state), door_state_str(door->fsm.target));
+    metric_inc(&door_transitions);
+    if (door->fsm.state == door->fsm.target) garage_span_mark(door, SPAN_SETTLED, now);
+    door_store_save(garage_door_index(door), door->fsm.state, door->fsm.target, now);
+    if (garage_state_callback) garage_state_callback(door, door->fsm.state, door->fsm.target);
+    /* state change to HomeKit notified */
+    metric_observe(&notify_us, hal_time_us() - now);
   }
-  ESP_LOGI(__FUNCTION__, "NEW STATE: %s => %s", STATE_STR(current_state),
-	   STATE_STR(target_state));
-  if (garage_state_callback) garage_state_callback(current_state, target_state);
 }
-static bool door_was_open(void) {
-  if (last_good_state == GARAGE_OPEN) return true;
-  return false;
-}
-static bool door_was_closed(void) {
-  if (last_good_state == GARAGE_CLOSED) return true;
-  return false;
+
+void garage_log_trace(const garage_door_t *door) {
+  door_fsm_trace_t trace[DOOR_FSM_TRACE_LEN];
+  size_t n = door_fsm_trace(&door->fsm, trace, DOOR_FSM_TRACE_LEN);
+  size_t i;
+  for (i=0; i<n; i++) {
+    ESP_LOGI(__FUNCTION__, "%s %lld %s: %s -> %s (target %s)", door->config->name,
+	     (long long)trace[i].time_us, door_event_str(trace[i].event),
+	     door_state_str(trace[i].from), door_state_str(trace[i].to),
+	     door_state_str(trace[i].target));
+  }
 }
 
 /******************************************************************
- * 
+ * Sensor sampling
+ *
+ * Each sensor has its own time based debounce filter, so settle time is
+ * set in milliseconds rather than in samples.
+ *
+ * All doors are sampled together: one read of the GPIO input registers
+ * gives every sensor pin, and each door then costs two filter updates,
+ * however many doors there are.
+ *
+ * In GARAGE_SENSOR_MODE_INTERRUPT the sensor pins raise an interrupt on
+ * every edge.  The ISR only posts the timestamped edge to the garage
+ * event task, which feeds it to that door's filters; sensor_pin_timer
+ * is armed for the earliest debounce deadline of any door, and once
+ * every input has settled nothing runs at all until the next edge, so
+ * idle doors cost no CPU.
+ *
+ * In GARAGE_SENSOR_MODE_POLL sensor_pin_timer samples every door every
+ * GARAGE_SENSOR_POLL_MILLISECONDS, forever.
  */
+static const debounce_config_t sensor_debounce_config = {
+  .assert_ms = GARAGE_SENSOR_SETTLE_MILLISECONDS,
+  .release_ms = GARAGE_SENSOR_RELEASE_MILLISECONDS,
+  .glitch_ms = GARAGE_SENSOR_GLITCH_MILLISECONDS,
+};
 
-static void sensor_pin_timer_callback(void* arg) {
-#define MAX_COUNT 3
-  static int open_count=0;
-  static int closed_count=0;
-  static int unknown_count=0;
-
-  if (garage_is_open()) {
-    closed_count=0;
-    unknown_count=0;
-    if (open_count < MAX_COUNT) open_count++;
+/* sensors are active low */
+static inline bool sensor_made(uint64_t levels, int pin) {
+  return !(levels & GPIO_SEL_(pin));
+}
+
+/* Map the debounced sensors onto a door state */
+static void sensor_evaluate(garage_door_t *door) {
+  if (debounce_level(&door->open_sensor)) {
+    garage_dispatch(door, DOOR_EV_SENSOR_OPEN);
+  }else if (debounce_level(&door->closed_sensor)) {
+    garage_dispatch(door, DOOR_EV_SENSOR_CLOSED);
   }else{
-    open_count=0;
-    if (garage_is_closed()) {
-      open_count=0;
-      unknown_count=0;
-      if (closed_count < MAX_COUNT) closed_count++;
-    }else{
-      closed_count = 0;
-      if (unknown_count < MAX_COUNT) unknown_count++;
-    }
+    garage_dispatch(door, DOOR_EV_SENSOR_NONE);
   }
+}
 
-  if (open_count >= MAX_COUNT) {
-    set_current_state(GARAGE_OPEN);
-    return;
-  }else if (closed_count >= MAX_COUNT) {
-    set_current_state(GARAGE_CLOSED);
+/* Bring a door's filters up to date with the pins and act on the result */
+static void sensor_sync_door(garage_door_t *door, uint64_t levels, int64_t now) {
+  debounce_update(&door->open_sensor, sensor_made(levels, door->config->open_sensor_pin), now);
+  debounce_update(&door->closed_sensor, sensor_made(levels, door->config->closed_sensor_pin), now);
+  sensor_evaluate(door);
+}
+
+#if GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT
+static int64_t sensor_earliest(int64_t deadline, int64_t other) {
+  if (deadline == DEBOUNCE_SETTLED || (other != DEBOUNCE_SETTLED && other < deadline))
+    return other;
+  return deadline;
+}
+
+static int64_t sensor_door_deadline(const garage_door_t *door) {
+  return sensor_earliest(debounce_deadline_us(&door->open_sensor),
+			 debounce_deadline_us(&door->closed_sensor));
+}
+
+static void sensor_arm_deadline(void) {
+  int64_t deadline = DEBOUNCE_SETTLED;
+  int64_t wait_us;
+  size_t i;
+
+  for (i = 0; i < door_count; i++)
+    deadline = sensor_earliest(deadline, sensor_door_deadline(&doors[i]));
+  if (deadline == DEBOUNCE_SETTLED) {
+    timer_wheel_stop(sensor_pin_timer);
     return;
-  }else if (unknown_count >= MAX_COUNT) {
-    if (door_was_open()) {
-      set_current_state(GARAGE_CLOSING);
-    }else if (door_was_closed()) {
-      set_current_state(GARAGE_OPENING);
-    }
   }
+
+  wait_us = deadline - hal_time_us();
+  timer_wheel_start_once(sensor_pin_timer, wait_us > 0 ? wait_us : 0, 0);
+}
+#endif
+
+/* Sample every door that is not settled, or all of them */
+static void sensor_sync(bool all) {
+  int64_t now = hal_time_us();
+  uint64_t levels = hal_gpio_get_levels();
+  garage_door_t *door;
+  size_t i;
+
+  for (i = 0; i < door_count; i++) {
+    door = &doors[i];
+#if GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT
+    if (!all && sensor_door_deadline(door) == DEBOUNCE_SETTLED) continue;
+#endif
+    if (sensor_made(levels, door->config->open_sensor_pin) != door->open_sensor.raw ||
+	sensor_made(levels, door->config->closed_sensor_pin) != door->closed_sensor.raw)
+      garage_span_mark(door, SPAN_SENSOR_EDGE, now);
+    sensor_sync_door(door, levels, now);
+  }
+#if GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT
+  sensor_arm_deadline();
+#endif
+  metric_observe(&sensor_us, hal_time_us() - now);
+}
+
+/* arg is true to sample every door */
+static void sensor_poll_event(const event_t *event) {
+  sensor_sync(event->arg || GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_POLL);
+}
+
+static void sensor_pin_timer_callback(void* arg) {
+  /* the queue is full.  A lost deadline leaves a door that has gone
+   * quiet unsettled, as no edge comes to arm it again; a lost poll is
+   * only one period late. */
+  if (!event_post(garage_events, sensor_poll_event, 0) &&
+      GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT)
+    timer_wheel_start_once(sensor_pin_timer, GARAGE_EVENT_RETRY_MILLISECONDS * 1000, 0);
+}
+
+#if GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT
+/* arg is the pin, with its level in bit 8 */
+static void sensor_edge_event(const event_t *event) {
+  int pin = event->arg & 0xFF;
+  garage_door_t *door = &doors[pin_door[pin]];
+  debounce_t *db = (pin == door->config->open_sensor_pin ? &door->open_sensor :
+		    &door->closed_sensor);
+  int64_t now;
+
+  debounce_update(db, (event->arg >> 8) == 0, event->time_us);
+  garage_span_mark(door, SPAN_SENSOR_EDGE, event->time_us);
+  /* also resyncs with the pins if an edge was lost to a full queue:
+   * the queue was full of this burst, and this runs after it */
+  now = hal_time_us();
+  sensor_sync_door(door, hal_gpio_get_levels(), now);
+  sensor_arm_deadline();
+  metric_observe(&sensor_us, hal_time_us() - now);
+}
+
+static void HAL_ISR_ATTR sensor_pin_isr(void* arg) {
+  uint32_t pin = (uintptr_t)arg;
+  metric_inc(&sensor_edges);
+  event_post_from_isr(garage_events, sensor_edge_event,
+		      pin | (hal_gpio_get_level(pin) << 8));
+}
+#endif
+
+/* Start from the sensors if either is made, else from the state saved
+ * before the reset, so the first report is already right */
+static void garage_seed_state(garage_door_t *door) {
+  door_store_record_t saved;
+  bool have_saved = door_store_load(garage_door_index(door), &saved);
+  garage_state_t state = GARAGE_OPEN, target = GARAGE_OPEN;
+
+  if (debounce_level(&door->open_sensor)) {
+    state = target = GARAGE_OPEN;
+  }else if (debounce_level(&door->closed_sensor)) {
+    state = target = GARAGE_CLOSED;
+  }else if (have_saved) {
+    state = saved.state;
+    target = saved.target;
+  }
+  door_fsm_init(&door->fsm, state, target);
+  door->travel_start_us = -1;
+  if (state == GARAGE_OPENING || state == GARAGE_CLOSING) start_stuck_timer(door, -1);
+  ESP_LOGI(__FUNCTION__, "%s starts %s (target %s)", door->config->name,
+	   door_state_str(state), door_state_str(target));
+}
+
+static void sensor_pins_init(void) {
+  uint64_t levels;
+  int64_t now;
+  size_t i;
+
+  for (i = 0; i < GARAGE_PINS; i++) pin_door[i] = -1;
+  sensor_pin_mask = 0;
+  for (i = 0; i < door_count; i++) {
+    pin_door[doors[i].config->open_sensor_pin] = i;
+    pin_door[doors[i].config->closed_sensor_pin] = i;
+    sensor_pin_mask |= GPIO_SEL_(doors[i].config->open_sensor_pin) |
+      GPIO_SEL_(doors[i].config->closed_sensor_pin);
+  }
+  hal_gpio_config_input(sensor_pin_mask, true,
+			GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT);
+
+  /* one synchronous read seeds the filters and the door states */
+  door_store_init(door_count);
+  now = hal_time_us();
+  levels = hal_gpio_get_levels();
+  for (i = 0; i < door_count; i++) {
+    garage_door_t *door = &doors[i];
+    debounce_init(&door->open_sensor, &sensor_debounce_config,
+		  sensor_made(levels, door->config->open_sensor_pin), now);
+    debounce_init(&door->closed_sensor, &sensor_debounce_config,
+		  sensor_made(levels, door->config->closed_sensor_pin), now);
+    garage_seed_state(door);
+  }
+
+#if GARAGE_SENSOR_MODE == GARAGE_SENSOR_MODE_INTERRUPT
+#if GARAGE_LOW_POWER
+  hal_gpio_wakeup_enable(sensor_pin_mask);
+#endif
+  for (i = 0; i < GARAGE_PINS; i++)
+    if (pin_door[i] >= 0) hal_gpio_isr_add(i, sensor_pin_isr, (void*)(uintptr_t)i);
+#else
+  timer_wheel_start_periodic(sensor_pin_timer, GARAGE_SENSOR_POLL_MILLISECONDS * 1000, 0);
+#endif
+  /* report the state the doors are in now */
+  event_post(garage_events, sensor_poll_event, true);
 }
@@ -1,5 +1,9 @@
+#pragma once
 
-void garage_init(void);
+#include <stdbool.h>
+#include <stddef.h>
+#include "event_task.h"
+#include "span_trace.h"
 
 /* Homekit compatible enumeration */
 typedef enum {
@@ -13,9 +17,61 @@ typedef enum {
 //#define TO_HOMEKIT(x) (x==GARAGE_STUCK ? GARAGE_OPEN : x)
 #define TO_HOMEKIT(x) (x)
 
-typedef void (*garage_state_callback_t)(garage_state_t current_state, garage_state_t target_state);
+/* One door: its sensors (active low) and the relays that drive it */
+typedef struct {
+  const char *name;
+  int open_sensor_pin;
+  int closed_sensor_pin;
+  int open_control_pin;
+  int close_control_pin;	/* may be open_control_pin for one button openers */
+} garage_door_config_t;
 
+typedef struct garage_door garage_door_t;
+
+/* Up to GARAGE_MAX_DOORS doors; the table must outlive the controller */
+void garage_init(const garage_door_config_t *config, size_t count);
+
+size_t garage_door_count(void);
+garage_door_t *garage_door(size_t index);
+size_t garage_door_index(const garage_door_t *door);
+const char *garage_door_name(const garage_door_t *door);
+
+typedef void (*garage_state_callback_t)(garage_door_t *door, garage_state_t current_state,
+					garage_state_t target_state);
+
+/* Called once for every door straight away, then on every change */
 void garage_set_state_callback(garage_state_callback_t fn);
-garage_state_t garage_get_current_state(void);
-void garage_action_open(void);
-void garage_action_close(void);
+garage_state_t garage_get_current_state(const garage_door_t *door);
+garage_state_t garage_get_target_state(const garage_door_t *door);
+/* Stopped for taking longer than its learned travel time; cleared
+ * when it sets off again or reaches a sensor */
+bool garage_get_obstructed(const garage_door_t *door);
+
+typedef struct {
+  uint8_t position;		/* percent open */
+  uint32_t eta_ms;		/* until it should arrive, 0 once overdue */
+} garage_travel_t;
+
+/* Estimated from the learned travel time while the door moves; false
+ * if it is not moving or its travel times are not known yet */
+bool garage_get_travel(const garage_door_t *door, garage_travel_t *travel);
+
+void garage_action_open(garage_door_t *door);
+void garage_action_close(garage_door_t *door);
+
+/* Follow the next request for door in the span trace from its HomeKit
+ * setter, entered at setter_us.  Called from any task, before the
+ * action; without it a span starts at the command. */
+void garage_span_begin(garage_door_t *door, int64_t setter_us);
+
+/* Run handler on the garage event task, serialised with the state
+ * machines and the state callback */
+bool garage_post(event_handler_t handler, uint32_t arg);
+
+/* Mark a stage of the span trace (span_trace.h) for door; ignored
+ * unless the span follows a request for that door.  Garage event task
+ * only. */
+void garage_span_mark(const garage_door_t *door, span_stage_t stage, int64_t now);
+
+/* Log the recent state transitions kept in RAM */
+void garage_log_trace(const garage_door_t *door);
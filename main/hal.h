@@ -0,0 +1,192 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Thin hardware abstraction for the garage modules.
+ *
+ * garage_control, syslog and heartbeat reach the GPIO, timer, clock,
+ * task, NVS and network APIs only through here.  hal_esp32.c maps it
+ * onto ESP-IDF; host/hal_posix.c implements it on a virtual clock so
+ * the same modules run in a Linux simulator.
+ */
+
+/* HAL_NOINIT_ATTR puts a variable in RTC slow memory that no reset
+ * other than power on clears; its contents are garbage after power on */
+#ifdef GARAGE_HOST
+#define HAL_ISR_ATTR
+#define HAL_NOINIT_ATTR
+#else
+#include <esp_attr.h>
+#define HAL_ISR_ATTR IRAM_ATTR
+#define HAL_NOINIT_ATTR RTC_NOINIT_ATTR
+#endif
+
+#define HAL_WAIT_FOREVER (-1LL)
+
+/* clock */
+int64_t hal_time_us(void);
+
+/* wall clock, set by SNTP from server and kept by the system; UTC
+ * microseconds since 1970, false until it has been set */
+void hal_sntp_init(const char *server);
+bool hal_utc_us(int64_t *utc_us);
+
+/* GPIO */
+typedef void (*hal_isr_t)(void *arg);
+
+void hal_gpio_config_input(uint64_t pin_mask, bool pullup, bool edge_interrupt);
+void hal_gpio_config_output_od(uint64_t pin_mask);
+void hal_gpio_set_output(int pin, bool output);
+void hal_gpio_set_level(int pin, int level);
+int hal_gpio_get_level(int pin);
+/* Every input level at once, bit n for GPIO n, from the input registers */
+uint64_t hal_gpio_get_levels(void);
+void hal_gpio_isr_add(int pin, hal_isr_t isr, void *arg);
+/* Let these input pins wake the chip from light sleep.  Their interrupt
+ * becomes level triggered and is re-armed for the opposite level each
+ * time, which still gives one interrupt per change.  Call before
+ * hal_gpio_isr_add(). */
+void hal_gpio_wakeup_enable(uint64_t pin_mask);
+
+/* one shot timers, callbacks run on a shared timer task; a callback
+ * running for longer than HAL_TIMER_BUDGET_US holds up all the others
+ * and is counted as an overrun.  The modules' timers are multiplexed
+ * onto one of these by timer_wheel. */
+#define HAL_TIMER_BUDGET_US 5000
+
+typedef struct hal_timer *hal_timer_t;
+typedef void (*hal_timer_cb_t)(void *arg);
+
+hal_timer_t hal_timer_create(const char *name, hal_timer_cb_t callback, void *arg);
+/* Restarting a running timer needs hal_timer_stop() first */
+void hal_timer_start_once(hal_timer_t timer, uint64_t timeout_us);
+void hal_timer_stop(hal_timer_t timer);
+
+/* hardware timed pulses.  A pulse takes over its pin as an open drain
+ * output, released (high) when idle, and drives it low for width_us
+ * after a delay of delay_us.  A peripheral times both, so the width
+ * does not depend on how busy the timer task or the CPU is.  done runs
+ * in interrupt context once the pin is released again. */
+typedef struct hal_pulse *hal_pulse_t;
+typedef void (*hal_pulse_done_t)(void *arg);
+
+hal_pulse_t hal_pulse_create(int pin, hal_pulse_done_t done, void *arg);
+/* false, and nothing is started, while this pin's last pulse runs */
+bool hal_pulse_start(hal_pulse_t pulse, uint32_t delay_us, uint32_t width_us);
+bool hal_pulse_busy(hal_pulse_t pulse);
+
+/* tasks and queues */
+typedef struct hal_queue *hal_queue_t;
+typedef void (*hal_task_fn_t)(void *arg);
+
+/* Tasks, queues and mutexes live in static storage their creator
+ * declares with HAL_STORAGE(), of the *_STORAGE_SIZE below; none of
+ * them comes from the heap, and the RAM shows in the owning module's
+ * .bss.  The first bytes hold the RTOS control block. */
+#define HAL_TASK_CB_BYTES 512
+#define HAL_QUEUE_CB_BYTES 128
+#define HAL_ROUND8(n) (((n) + 7) & ~7)
+#define HAL_TASK_STORAGE_SIZE(stack) (HAL_TASK_CB_BYTES + HAL_ROUND8(stack))
+#define HAL_QUEUE_STORAGE_SIZE(length, item_size) \
+  (HAL_QUEUE_CB_BYTES + HAL_ROUND8((length) * (item_size)))
+#define HAL_MUTEX_STORAGE_SIZE HAL_QUEUE_CB_BYTES
+#define HAL_STORAGE(var, size) static uint64_t var[(size) / 8]
+
+void hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack,
+		     void *arg, int priority, void *storage);
+const char *hal_task_name(void);
+
+hal_queue_t hal_queue_create(size_t length, size_t item_size, void *storage);
+bool hal_queue_send(hal_queue_t queue, const void *item);
+bool hal_queue_send_from_isr(hal_queue_t queue, const void *item);
+/* timeout_us may be HAL_WAIT_FOREVER */
+bool hal_queue_receive(hal_queue_t queue, void *item, int64_t timeout_us);
+
+/* for short critical sections between tasks, not ISRs */
+typedef struct hal_mutex *hal_mutex_t;
+
+hal_mutex_t hal_mutex_create(void *storage);
+void hal_mutex_lock(hal_mutex_t mutex);
+void hal_mutex_unlock(hal_mutex_t mutex);
+
+/* system */
+uint32_t hal_free_heap(void);
+
+typedef struct {
+  uint32_t free;
+  uint32_t min_free;		/* lowest free since boot */
+  uint32_t largest_block;	/* biggest single allocation possible */
+} hal_heap_stats_t;
+
+void hal_heap_stats(hal_heap_stats_t *stats);
+
+/* Zeroed heap memory, for HAL objects made once at boot.  After
+ * hal_heap_seal() every call is counted in heap.late_allocs and, if
+ * strict, fails an assert: from then on the firmware's own RAM is
+ * meant to stay as it is. */
+void *hal_alloc(size_t size);
+void hal_heap_seal(bool strict);
+
+typedef struct {
+  char name[16];
+  uint32_t runtime;		/* CPU used, in the units of total_runtime */
+  uint32_t stack_free;		/* bytes of stack never touched */
+} hal_task_stat_t;
+
+/* Snapshot of up to max tasks; returns how many were filled in, 0 if
+ * the platform keeps no task statistics */
+size_t hal_task_stats(hal_task_stat_t *stats, size_t max, uint32_t *total_runtime);
+
+/* power management.  With light_sleep the chip sleeps whenever every
+ * task is blocked, until a timer or a wakeup pin needs it. */
+void hal_power_init(bool light_sleep);
+
+/* Percent of the time since the last call spent asleep.  On the ESP32
+ * this is the idle tasks' share, where light sleep happens, so it is an
+ * upper bound. */
+uint32_t hal_power_sleep_pct(void);
+
+typedef enum {
+  HAL_RESET_POWER_ON,		/* RTC memory holds garbage */
+  HAL_RESET_SOFTWARE,
+  HAL_RESET_PANIC,
+  HAL_RESET_WATCHDOG,
+  HAL_RESET_BROWNOUT,
+  HAL_RESET_OTHER,
+} hal_reset_t;
+
+/* Why the chip last reset */
+hal_reset_t hal_reset_reason(void);
+
+/* CRC-32 (IEEE, as zlib) of len bytes, continuing from crc; start at 0 */
+uint32_t hal_crc32(uint32_t crc, const void *data, size_t len);
+
+/* true if ptr is constant data in the firmware image */
+bool hal_ptr_in_rodata(const void *ptr);
+
+/* non-volatile storage */
+bool hal_nvs_get_blob(const char *ns, const char *key, void *data, size_t *len);
+bool hal_nvs_set_blob(const char *ns, const char *key, const void *data, size_t len);
+
+/* flash partitions, found by label in the partition table.  As NOR
+ * flash: an erase sets whole sectors to 0xFF and a write can only
+ * clear bits, so a byte is written once between erases. */
+#define HAL_FLASH_SECTOR 4096
+
+typedef struct hal_flash *hal_flash_t;
+
+/* NULL if there is no data partition of that name */
+hal_flash_t hal_flash_open(const char *label);
+size_t hal_flash_size(hal_flash_t flash);
+bool hal_flash_read(hal_flash_t flash, uint32_t offset, void *data, size_t len);
+bool hal_flash_write(hal_flash_t flash, uint32_t offset, const void *data, size_t len);
+/* offset and len are whole sectors */
+bool hal_flash_erase(hal_flash_t flash, uint32_t offset, size_t len);
+
+/* network state; ip is the station address as a dotted quad */
+typedef void (*hal_net_cb_t)(bool up, const char *ip);
+
+void hal_net_set_callback(hal_net_cb_t callback);
+const char *hal_net_hostname(void);
@@ -0,0 +1,620 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <esp_event_loop.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_partition.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_pm.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <driver/rmt.h>
+#include <lwip/apps/sntp.h>
+#include <nvs.h>
+#include <rom/crc.h>
+#include <soc/soc.h>
+#include <soc/gpio_struct.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include "hal.h"
+#include "metrics.h"
+
+/* ESP-IDF implementation of hal.h */
+
+int64_t HAL_ISR_ATTR hal_time_us(void) {
+  return esp_timer_get_time();
+}
+
+/* lwIP's SNTP client sets the system clock and retries by itself
+ * while there is no network; before that the clock starts at 1970 */
+#define HAL_UTC_VALID 1577836800	/* 2020-01-01 */
+
+void hal_sntp_init(const char *server) {
+  sntp_setoperatingmode(SNTP_OPMODE_POLL);
+  sntp_setservername(0, (char *)server);
+  sntp_init();
+}
+
+bool hal_utc_us(int64_t *utc_us) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  if (tv.tv_sec < HAL_UTC_VALID) return false;
+  *utc_us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+  return true;
+}
+
+/******************************************************************
+ * GPIO
+ */
+void hal_gpio_config_input(uint64_t pin_mask, bool pullup, bool edge_interrupt) {
+  gpio_config_t pins = {
+    .pin_bit_mask = pin_mask,
+    .mode = GPIO_MODE_INPUT,
+    .pull_up_en = pullup ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE,
+    .pull_down_en = GPIO_PULLDOWN_DISABLE,
+    .intr_type = edge_interrupt ? GPIO_INTR_ANYEDGE : GPIO_INTR_DISABLE,
+  };
+  gpio_config(&pins);
+}
+
+void hal_gpio_config_output_od(uint64_t pin_mask) {
+  gpio_config_t pins = {
+    .pin_bit_mask = pin_mask,
+    .mode = GPIO_MODE_OUTPUT_OD,
+    .pull_up_en = GPIO_PULLUP_DISABLE,
+    .pull_down_en = GPIO_PULLDOWN_DISABLE,
+    .intr_type = GPIO_INTR_DISABLE,
+  };
+  gpio_config(&pins);
+}
+
+void hal_gpio_set_output(int pin, bool output) {
+  gpio_set_direction(pin, output ? GPIO_MODE_OUTPUT : GPIO_MODE_INPUT);
+}
+
+void hal_gpio_set_level(int pin, int level) {
+  gpio_set_level(pin, level);
+}
+
+int HAL_ISR_ATTR hal_gpio_get_level(int pin) {
+  return gpio_get_level(pin);
+}
+
+uint64_t hal_gpio_get_levels(void) {
+  /* GPIO 0-31 in one register, 32-39 in the next */
+  return GPIO.in | ((uint64_t)GPIO.in1.data << 32);
+}
+
+/* Light sleep only wakes on a GPIO level, and the wakeup shares the
+ * pin's interrupt type, so wakeup pins trade their edge interrupt for a
+ * level one that flips to the opposite level every time it fires */
+static uint64_t wakeup_pins = 0;
+
+struct hal_level_isr {
+  int pin;
+  hal_isr_t isr;
+  void *arg;
+};
+
+static void HAL_ISR_ATTR hal_level_isr(void *arg) {
+  struct hal_level_isr *level_isr = arg;
+  GPIO.pin[level_isr->pin].int_type =
+    gpio_get_level(level_isr->pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+  level_isr->isr(level_isr->arg);
+}
+
+void hal_gpio_wakeup_enable(uint64_t pin_mask) {
+  wakeup_pins |= pin_mask;
+}
+
+void hal_gpio_isr_add(int pin, hal_isr_t isr, void *arg) {
+  static bool isr_service_installed = false;
+  struct hal_level_isr *level_isr;
+
+  if (!isr_service_installed) {
+    gpio_install_isr_service(0);
+    isr_service_installed = true;
+  }
+  if (!(wakeup_pins & (1ULL << pin)) || !(level_isr = hal_alloc(sizeof(*level_isr)))) {
+    gpio_isr_handler_add(pin, isr, arg);
+    return;
+  }
+  level_isr->pin = pin;
+  level_isr->isr = isr;
+  level_isr->arg = arg;
+  gpio_wakeup_enable(pin, gpio_get_level(pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+  gpio_isr_handler_add(pin, hal_level_isr, level_isr);
+}
+
+/******************************************************************
+ * Timers
+ */
+static metric_histogram_t timer_late = METRIC_HISTOGRAM_INIT("timer.late_us");
+static metric_t timer_overruns = METRIC_COUNTER_INIT("timer.overruns");
+
+/* esp_timer runs callbacks on its own task; every HAL timer goes
+ * through timer_dispatch so lateness and overruns can be measured */
+struct hal_timer {
+  esp_timer_handle_t handle;
+  hal_timer_cb_t callback;
+  void *arg;
+  int64_t due;
+};
+
+static void timer_dispatch(void *arg) {
+  struct hal_timer *timer = arg;
+  int64_t start = esp_timer_get_time();
+
+  if (start > timer->due) metric_observe(&timer_late, start - timer->due);
+  timer->callback(timer->arg);
+  if (esp_timer_get_time() - start > HAL_TIMER_BUDGET_US) metric_inc(&timer_overruns);
+}
+
+hal_timer_t hal_timer_create(const char *name, hal_timer_cb_t callback, void *arg) {
+  struct hal_timer *timer = hal_alloc(sizeof(*timer));
+  esp_timer_create_args_t args = {
+    .callback = timer_dispatch,
+    .arg = timer,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = name };
+  if (!timer) return NULL;
+  timer->callback = callback;
+  timer->arg = arg;
+  if (esp_timer_create(&args, &timer->handle) != ESP_OK) {
+    free(timer);
+    return NULL;
+  }
+  metrics_register(&timer_late.metric);
+  metrics_register(&timer_overruns);
+  return timer;
+}
+
+void hal_timer_start_once(hal_timer_t timer, uint64_t timeout_us) {
+  timer->due = esp_timer_get_time() + timeout_us;
+  esp_timer_start_once(timer->handle, timeout_us);
+}
+
+void hal_timer_stop(hal_timer_t timer) {
+  esp_timer_stop(timer->handle);
+}
+
+/******************************************************************
+ * Pulses
+ */
+
+/* Each pulse pin gets an RMT transmit channel clocked from REF_TICK,
+ * 1 us a tick whatever the CPU and APB frequency.  Light sleep would
+ * stop that clock, so a running pulse holds it off.  Pins beyond the
+ * RMT channels fall back to an esp_timer, only as exact as the timer
+ * task. */
+#define PULSE_MAX_TICKS 32767	/* in one half of an RMT item */
+#define PULSE_MAX_ITEMS 64
+
+struct hal_pulse {
+  int pin;
+  int channel;			/* -1 on the esp_timer fallback */
+  hal_pulse_done_t done;
+  void *arg;
+  volatile bool busy;
+  esp_timer_handle_t timer;	/* fallback only */
+  bool driving;
+  uint32_t width_us;
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_handle_t pm_lock;
+#endif
+  rmt_item32_t items[PULSE_MAX_ITEMS]; /* read by the RMT driver while it sends */
+};
+
+static struct hal_pulse *pulse_channels[RMT_CHANNEL_MAX];
+static int pulse_channel_count = 0;
+
+static void pulse_half(rmt_item32_t *items, size_t half, int level, uint32_t ticks) {
+  rmt_item32_t *item = &items[half / 2];
+  if (half % 2) {
+    item->level1 = level;
+    item->duration1 = ticks;
+  }else{
+    item->level0 = level;
+    item->duration0 = ticks;
+    item->level1 = level;
+    item->duration1 = 0;
+  }
+}
+
+/* Released for delay, low for width, in halves of at most
+ * PULSE_MAX_TICKS, then a zero length half to end.  Returns the number
+ * of items, 0 if they don't fit. */
+static size_t pulse_encode(rmt_item32_t *items, uint32_t delay_us, uint32_t width_us) {
+  uint32_t ticks[2] = { delay_us, width_us };
+  size_t half = 0;
+  int phase;
+
+  for (phase = 0; phase < 2; phase++) {
+    while (ticks[phase]) {
+      uint32_t n = ticks[phase] < PULSE_MAX_TICKS ? ticks[phase] : PULSE_MAX_TICKS;
+      if (half + 1 >= PULSE_MAX_ITEMS * 2) return 0;
+      pulse_half(items, half++, phase == 0, n);
+      ticks[phase] -= n;
+    }
+  }
+  pulse_half(items, half++, 1, 0);
+  return (half + 1) / 2;
+}
+
+static void HAL_ISR_ATTR pulse_tx_end(rmt_channel_t channel, void *arg) {
+  struct hal_pulse *pulse = pulse_channels[channel];
+
+  if (!pulse || !pulse->busy) return;
+  pulse->busy = false;
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_release(pulse->pm_lock);
+#endif
+  pulse->done(pulse->arg);
+}
+
+static void pulse_timer(void *arg) {
+  struct hal_pulse *pulse = arg;
+
+  if (!pulse->driving) {
+    gpio_set_level(pulse->pin, 0);
+    pulse->driving = true;
+    esp_timer_start_once(pulse->timer, pulse->width_us);
+    return;
+  }
+  gpio_set_level(pulse->pin, 1);
+  pulse->driving = false;
+  pulse->busy = false;
+  pulse->done(pulse->arg);
+}
+
+static bool pulse_rmt_init(struct hal_pulse *pulse) {
+  rmt_config_t config = {
+    .rmt_mode = RMT_MODE_TX,
+    .channel = pulse_channel_count,
+    .gpio_num = pulse->pin,
+    .clk_div = 1,
+    .mem_block_num = 1,
+    .tx_config = {
+      .idle_output_en = true,
+      .idle_level = RMT_IDLE_LEVEL_HIGH,
+    },
+  };
+
+  if (pulse_channel_count == RMT_CHANNEL_MAX) return false;
+  if (rmt_config(&config) != ESP_OK ||
+      rmt_set_source_clk(config.channel, RMT_BASECLK_REF) != ESP_OK ||
+      rmt_driver_install(config.channel, 0, 0) != ESP_OK)
+    return false;
+#if CONFIG_PM_ENABLE
+  if (esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "pulse", &pulse->pm_lock) != ESP_OK) {
+    rmt_driver_uninstall(config.channel);
+    return false;
+  }
+#endif
+  /* rmt_config() routed the pin to the channel as push-pull, idling
+   * high.  Only the pad driver changes to open drain: gpio_set_direction()
+   * would route the pin back to the GPIO output register, which is low,
+   * holding the relay on with the pulses lost. */
+  GPIO.pin[pulse->pin].pad_driver = 1;
+  if (pulse_channel_count == 0) rmt_register_tx_end_callback(pulse_tx_end, NULL);
+  pulse->channel = pulse_channel_count++;
+  pulse_channels[pulse->channel] = pulse;
+  return true;
+}
+
+hal_pulse_t hal_pulse_create(int pin, hal_pulse_done_t done, void *arg) {
+  struct hal_pulse *pulse = hal_alloc(sizeof(*pulse));
+  esp_timer_create_args_t args = {
+    .callback = pulse_timer,
+    .dispatch_method = ESP_TIMER_TASK,
+    .name = "pulse" };
+
+  if (!pulse) return NULL;
+  pulse->pin = pin;
+  pulse->channel = -1;
+  pulse->done = done;
+  pulse->arg = arg;
+  if (pulse_rmt_init(pulse)) return pulse;
+
+  ESP_LOGW(__FUNCTION__, "no RMT channel for GPIO %d, timing it in software", pin);
+  args.arg = pulse;
+  if (esp_timer_create(&args, &pulse->timer) != ESP_OK) {
+    free(pulse);
+    return NULL;
+  }
+  /* released before it becomes an output */
+  gpio_set_level(pin, 1);
+  hal_gpio_config_output_od(1ULL << pin);
+  return pulse;
+}
+
+bool hal_pulse_start(hal_pulse_t pulse, uint32_t delay_us, uint32_t width_us) {
+  size_t n;
+
+  if (pulse->busy) return false;
+  if (pulse->channel < 0) {
+    pulse->busy = true;
+    pulse->width_us = width_us;
+    pulse->driving = false;
+    if (delay_us) {
+      esp_timer_start_once(pulse->timer, delay_us);
+    }else{
+      pulse_timer(pulse);
+    }
+    return true;
+  }
+
+  n = pulse_encode(pulse->items, delay_us, width_us);
+  if (!n) {
+    ESP_LOGE(__FUNCTION__, "%u+%u us pulse is too long", (unsigned)delay_us, (unsigned)width_us);
+    return false;
+  }
+  pulse->busy = true;
+#if CONFIG_PM_ENABLE
+  esp_pm_lock_acquire(pulse->pm_lock);
+#endif
+  rmt_write_items(pulse->channel, pulse->items, n, false);
+  return true;
+}
+
+bool hal_pulse_busy(hal_pulse_t pulse) {
+  return pulse->busy;
+}
+
+/******************************************************************
+ * Tasks and queues
+ */
+
+/* Needs CONFIG_SUPPORT_STATIC_ALLOCATION; stacks are in bytes here */
+_Static_assert(sizeof(StaticTask_t) <= HAL_TASK_CB_BYTES, "HAL_TASK_CB_BYTES too small");
+_Static_assert(sizeof(StaticQueue_t) <= HAL_QUEUE_CB_BYTES, "HAL_QUEUE_CB_BYTES too small");
+
+void hal_task_create(hal_task_fn_t fn, const char *name, uint32_t stack,
+		     void *arg, int priority, void *storage) {
+  xTaskCreateStatic(fn, name, stack, arg, priority,
+		    (StackType_t *)((uint8_t *)storage + HAL_TASK_CB_BYTES),
+		    (StaticTask_t *)storage);
+}
+
+const char *hal_task_name(void) {
+  return pcTaskGetTaskName(NULL);
+}
+
+hal_queue_t hal_queue_create(size_t length, size_t item_size, void *storage) {
+  return (hal_queue_t)xQueueCreateStatic(length, item_size,
+					 (uint8_t *)storage + HAL_QUEUE_CB_BYTES,
+					 (StaticQueue_t *)storage);
+}
+
+bool hal_queue_send(hal_queue_t queue, const void *item) {
+  return xQueueSend((QueueHandle_t)queue, item, 0) == pdTRUE;
+}
+
+bool HAL_ISR_ATTR hal_queue_send_from_isr(hal_queue_t queue, const void *item) {
+  BaseType_t woken = pdFALSE;
+  BaseType_t sent = xQueueSendFromISR((QueueHandle_t)queue, item, &woken);
+  if (woken) portYIELD_FROM_ISR();
+  return sent == pdTRUE;
+}
+
+bool hal_queue_receive(hal_queue_t queue, void *item, int64_t timeout_us) {
+  TickType_t ticks;
+  if (timeout_us < 0) {
+    ticks = portMAX_DELAY;
+  }else{
+    /* round up so we never wake just short of the deadline */
+    ticks = (timeout_us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+  }
+  return xQueueReceive((QueueHandle_t)queue, item, ticks) == pdTRUE;
+}
+
+hal_mutex_t hal_mutex_create(void *storage) {
+  return (hal_mutex_t)xSemaphoreCreateMutexStatic((StaticSemaphore_t *)storage);
+}
+
+void hal_mutex_lock(hal_mutex_t mutex) {
+  xSemaphoreTake((SemaphoreHandle_t)mutex, portMAX_DELAY);
+}
+
+void hal_mutex_unlock(hal_mutex_t mutex) {
+  xSemaphoreGive((SemaphoreHandle_t)mutex);
+}
+
+/******************************************************************
+ * System
+ */
+uint32_t hal_free_heap(void) {
+  return esp_get_free_heap_size();
+}
+
+void hal_heap_stats(hal_heap_stats_t *stats) {
+  stats->free = esp_get_free_heap_size();
+  stats->min_free = esp_get_minimum_free_heap_size();
+  stats->largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+}
+
+static metric_t late_allocs = METRIC_COUNTER_INIT("heap.late_allocs");
+static bool heap_sealed, heap_strict;
+
+void *hal_alloc(size_t size) {
+  if (heap_sealed) {
+    metric_inc(&late_allocs);
+    ESP_LOGW(__FUNCTION__, "%u bytes after boot", (unsigned)size);
+    assert(!heap_strict);
+  }
+  return calloc(1, size);
+}
+
+void hal_heap_seal(bool strict) {
+  metrics_register(&late_allocs);
+  heap_strict = strict;
+  heap_sealed = true;
+}
+
+#if configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS
+#define HAL_MAX_TASKS 24
+static TaskStatus_t task_status[HAL_MAX_TASKS];
+
+size_t hal_task_stats(hal_task_stat_t *stats, size_t max, uint32_t *total_runtime) {
+  /* not reentrant, task_status is shared; only the heartbeat calls this */
+  UBaseType_t n = uxTaskGetSystemState(task_status, HAL_MAX_TASKS, total_runtime);
+  size_t i;
+  for (i = 0; i < n && i < max; i++) {
+    strlcpy(stats[i].name, task_status[i].pcTaskName, sizeof(stats[i].name));
+    stats[i].runtime = task_status[i].ulRunTimeCounter;
+    stats[i].stack_free = task_status[i].usStackHighWaterMark;
+  }
+  return i;
+}
+
+/* The idle tasks enter light sleep, so their share of the run time
+ * covers all of the sleep and whatever idling did not sleep */
+uint32_t hal_power_sleep_pct(void) {
+  static uint32_t idle_last, total_last;
+  uint32_t total, idle = 0, pct = 0;
+  UBaseType_t n = uxTaskGetSystemState(task_status, HAL_MAX_TASKS, &total);
+  UBaseType_t i;
+
+  for (i = 0; i < n; i++)
+    if (!strncmp(task_status[i].pcTaskName, "IDLE", 4)) idle += task_status[i].ulRunTimeCounter;
+  if (total != total_last)
+    pct = (uint64_t)(idle - idle_last) * 100 / ((uint64_t)(total - total_last) * portNUM_PROCESSORS);
+  idle_last = idle;
+  total_last = total;
+  return pct;
+}
+#else
+size_t hal_task_stats(hal_task_stat_t *stats, size_t max, uint32_t *total_runtime) {
+  *total_runtime = 0;
+  return 0;
+}
+
+uint32_t hal_power_sleep_pct(void) {
+  return 0;
+}
+#endif
+
+void hal_power_init(bool light_sleep) {
+#if CONFIG_PM_ENABLE
+  /* frequency scaling goes with light sleep, both are for battery use */
+  esp_pm_config_esp32_t config = {
+    .max_freq_mhz = CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+    .min_freq_mhz = light_sleep ? CONFIG_ESP32_XTAL_FREQ : CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ,
+    .light_sleep_enable = light_sleep,
+  };
+  esp_err_t err = esp_pm_configure(&config);
+  if (err != ESP_OK) ESP_LOGW(__FUNCTION__, "esp_pm_configure failed: %d", err);
+  if (light_sleep) esp_sleep_enable_gpio_wakeup();
+#else
+  if (light_sleep) ESP_LOGW(__FUNCTION__, "CONFIG_PM_ENABLE is off, no light sleep");
+#endif
+}
+
+hal_reset_t hal_reset_reason(void) {
+  switch (esp_reset_reason()) {
+  case ESP_RST_POWERON: return HAL_RESET_POWER_ON;
+  case ESP_RST_SW: return HAL_RESET_SOFTWARE;
+  case ESP_RST_PANIC: return HAL_RESET_PANIC;
+  case ESP_RST_INT_WDT:
+  case ESP_RST_TASK_WDT:
+  case ESP_RST_WDT: return HAL_RESET_WATCHDOG;
+  case ESP_RST_BROWNOUT: return HAL_RESET_BROWNOUT;
+  default: return HAL_RESET_OTHER;
+  }
+}
+
+/* the ROM routine, table driven */
+uint32_t hal_crc32(uint32_t crc, const void *data, size_t len) {
+  return crc32_le(crc, data, len);
+}
+
+bool hal_ptr_in_rodata(const void *ptr) {
+  return (uint32_t)ptr >= SOC_DROM_LOW && (uint32_t)ptr < SOC_DROM_HIGH;
+}
+
+bool hal_nvs_get_blob(const char *ns, const char *key, void *data, size_t *len) {
+  nvs_handle handle;
+  esp_err_t err;
+  if (nvs_open(ns, NVS_READONLY, &handle) != ESP_OK) return false;
+  err = nvs_get_blob(handle, key, data, len);
+  nvs_close(handle);
+  return err == ESP_OK;
+}
+
+bool hal_nvs_set_blob(const char *ns, const char *key, const void *data, size_t len) {
+  nvs_handle handle;
+  esp_err_t err;
+  if (nvs_open(ns, NVS_READWRITE, &handle) != ESP_OK) return false;
+  err = nvs_set_blob(handle, key, data, len);
+  if (err == ESP_OK) err = nvs_commit(handle);
+  nvs_close(handle);
+  return err == ESP_OK;
+}
+
+/******************************************************************
+ * Flash partitions: the handle is the partition table entry
+ */
+hal_flash_t hal_flash_open(const char *label) {
+  return (hal_flash_t)esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+					       ESP_PARTITION_SUBTYPE_ANY, label);
+}
+
+size_t hal_flash_size(hal_flash_t flash) {
+  return ((const esp_partition_t *)flash)->size;
+}
+
+bool hal_flash_read(hal_flash_t flash, uint32_t offset, void *data, size_t len) {
+  return esp_partition_read((const esp_partition_t *)flash, offset, data, len) == ESP_OK;
+}
+
+bool hal_flash_write(hal_flash_t flash, uint32_t offset, const void *data, size_t len) {
+  return esp_partition_write((const esp_partition_t *)flash, offset, data, len) == ESP_OK;
+}
+
+bool hal_flash_erase(hal_flash_t flash, uint32_t offset, size_t len) {
+  return esp_partition_erase_range((const esp_partition_t *)flash, offset, len) == ESP_OK;
+}
+
+/******************************************************************
+ * Network: chain onto the system event handler installed by app_main
+ */
+static system_event_cb_t old_event_handler = NULL;
+static hal_net_cb_t net_callback = NULL;
+
+static esp_err_t hal_event_handler(void *ctx, system_event_t *event) {
+  char ip[16];
+  /* chain to the original handler, do this first in case time critical */
+  if (old_event_handler) old_event_handler(ctx, event);
+
+  switch (event->event_id) {
+  case SYSTEM_EVENT_STA_GOT_IP:
+    sprintf(ip, IPSTR, IP2STR(&event->event_info.got_ip.ip_info.ip));
+    if (net_callback) net_callback(true, ip);
+    break;
+  case SYSTEM_EVENT_STA_DISCONNECTED:
+    if (net_callback) net_callback(false, NULL);
+    break;
+  default:
+    break;
+  }
+  return ESP_OK;
+}
+
+void hal_net_set_callback(hal_net_cb_t callback) {
+  net_callback = callback;
+  old_event_handler = esp_event_loop_set_cb(hal_event_handler, NULL);
+}
+
+const char *hal_net_hostname(void) {
+  const char *hostname = NULL;
+  if (tcpip_adapter_get_hostname(TCPIP_ADAPTER_IF_STA, &hostname) != ESP_OK) return NULL;
+  return hostname;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+/* lwIP and POSIX share the BSD socket API, so the socket layer of the
+ * HAL is just a matter of picking the right headers */
+#ifdef GARAGE_HOST
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#else
+#include <lwip/sockets.h>
+#endif
@@ -1,22 +1,145 @@
-
+#include <stdio.h>
+#include <string.h>
 #include <esp_log.h>
-#include <esp_timer.h>
-#include <esp_system.h>
+
+#include "hal.h"
+#include "garage_config.h"
+#include "hal_socket.h"
+#include "heartbeat.h"
+#include "metrics.h"
+#include "event_task.h"
+#include "timer_wheel.h"
+
+/* Also send every report as statsd gauges to this host */
+#define HEARTBEAT_STATSD 0
+#define HEARTBEAT_STATSD_ADDR "192.168.1.2"
+#define HEARTBEAT_STATSD_PORT 8125
+
+#define HEARTBEAT_MAX_TASKS 16
+
+/* Gathering and sending the report is slow; it gets the lowest priority */
+#define HEARTBEAT_TASK_PRIORITY 1
+#define HEARTBEAT_TASK_STACK 3072
+#define HEARTBEAT_TASK_QUEUE_LEN 2
 
 static void heartbeat_timer_callback(void* arg);
 
-const static esp_timer_create_args_t heartbeat_timer_args = {
-  .callback = heartbeat_timer_callback,
-  .arg = 0,
-  .dispatch_method = ESP_TIMER_TASK,
-  .name = "heartbeat_timer" };
-static esp_timer_handle_t heartbeat_timer;
+static wheel_timer_t heartbeat_timer;
+static event_task_t heartbeat_events;
+HAL_STORAGE(heartbeat_events_storage,
+	    EVENT_TASK_STORAGE_SIZE(HEARTBEAT_TASK_STACK, HEARTBEAT_TASK_QUEUE_LEN));
+
+static hal_heap_stats_t heap;
+static int32_t heap_free(void) { return heap.free; }
+static int32_t heap_min_free(void) { return heap.min_free; }
+static int32_t heap_largest_block(void) { return heap.largest_block; }
+static metric_t heap_free_metric = METRIC_GAUGE_READ_INIT("heap.free", heap_free);
+static metric_t heap_min_metric = METRIC_GAUGE_READ_INIT("heap.min_free", heap_min_free);
+static metric_t heap_largest_metric = METRIC_GAUGE_READ_INIT("heap.largest_block", heap_largest_block);
+
+/* sampled once per report, like the heap */
+static uint32_t sleep_pct;
+static int32_t power_sleep_pct(void) { return sleep_pct; }
+static metric_t sleep_metric = METRIC_GAUGE_READ_INIT("power.sleep_pct", power_sleep_pct);
+
+/* kept as static rather than on the task's stack */
+static hal_task_stat_t tasks[HEARTBEAT_MAX_TASKS];
+static struct {
+  char name[16];
+  uint32_t runtime;
+} tasks_last[HEARTBEAT_MAX_TASKS];
+static uint32_t total_runtime_last;
+/* one line of the report, which with its header has to fit a syslog
+ * datagram */
+static char report[768];
 
 void heartbeat_init(int interval_s) {
-  esp_timer_create(&heartbeat_timer_args, &heartbeat_timer);
-  esp_timer_start_periodic(heartbeat_timer, interval_s*1000000);
+  metrics_register(&heap_free_metric);
+  metrics_register(&heap_min_metric);
+  metrics_register(&heap_largest_metric);
+  metrics_register(&sleep_metric);
+  heartbeat_events = event_task_create("heartbeat", HEARTBEAT_TASK_STACK,
+				       HEARTBEAT_TASK_PRIORITY, HEARTBEAT_TASK_QUEUE_LEN,
+				       heartbeat_events_storage);
+  heartbeat_timer = timer_wheel_create("heartbeat_timer", heartbeat_timer_callback, NULL);
+  timer_wheel_start_periodic(heartbeat_timer, interval_s*1000000LL,
+			     GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
+}
+
+static uint32_t task_runtime_last(const char *name) {
+  int i;
+  for (i = 0; i < HEARTBEAT_MAX_TASKS; i++)
+    if (!strcmp(tasks_last[i].name, name)) return tasks_last[i].runtime;
+  return 0;
+}
+
+/* " name:cpu%/stack_free" for every task, CPU over the last interval */
+static size_t heartbeat_format_tasks(char *buf, size_t size) {
+  uint32_t total, elapsed;
+  size_t n, i, len = 0;
+  int w;
+
+  n = hal_task_stats(tasks, HEARTBEAT_MAX_TASKS, &total);
+  elapsed = total - total_runtime_last;
+  for (i = 0; i < n && len < size; i++) {
+    uint32_t used = tasks[i].runtime - task_runtime_last(tasks[i].name);
+    w = snprintf(buf + len, size - len, " %s:%u%%/%u", tasks[i].name,
+		 (unsigned)(elapsed ? (uint64_t)used * 100 / elapsed : 0),
+		 (unsigned)tasks[i].stack_free);
+    if (w > 0) len += w;
+  }
+  if (len >= size) len = size - 1;
+
+  memset(tasks_last, 0, sizeof(tasks_last));
+  for (i = 0; i < n; i++) {
+    memcpy(tasks_last[i].name, tasks[i].name, sizeof(tasks_last[i].name));
+    tasks_last[i].runtime = tasks[i].runtime;
+  }
+  total_runtime_last = total;
+  return len;
+}
+
+#if HEARTBEAT_STATSD
+static void heartbeat_statsd(void) {
+  static int sock = -1;
+  struct sockaddr_in to;
+  const char *prefix = hal_net_hostname();
+  metric_t *next = NULL;
+  size_t len;
+
+  if (sock < 0) sock = socket(PF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) return;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = inet_addr(HEARTBEAT_STATSD_ADDR);
+  to.sin_port = htons(HEARTBEAT_STATSD_PORT);
+
+  /* not reset, the log lines below report the interval */
+  do {
+    len = metrics_format_statsd(report, sizeof(report), prefix ? prefix : "garage", false,
+				&next);
+    sendto(sock, report, len, 0, (struct sockaddr *)&to, sizeof(to));
+  } while (next);
+}
+#endif
+
+/* As many lines as the metrics take, then one for the tasks */
+static void heartbeat_event(const event_t *event) {
+  metric_t *next = NULL;
+
+  hal_heap_stats(&heap);
+  sleep_pct = hal_power_sleep_pct();
+#if HEARTBEAT_STATSD
+  heartbeat_statsd();
+#endif
+  do {
+    metrics_format(report, sizeof(report), true, &next);
+    ESP_LOGI(__FUNCTION__, "### Heartbeat %s", report);
+  } while (next);
+  heartbeat_format_tasks(report, sizeof(report));
+  ESP_LOGI(__FUNCTION__, "### Heartbeat tasks%s", report);
 }
 
 static void heartbeat_timer_callback(void* arg) {
-  ESP_LOGI(__FUNCTION__, "### Heartbeat free_heap=%i", esp_get_free_heap_size());
+  event_post(heartbeat_events, heartbeat_event, 0);
 }
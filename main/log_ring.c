@@ -0,0 +1,144 @@
+#include <string.h>
+#include "log_ring.h"
+
+/* Every record starts with this header, 8 byte aligned.  seq is written
+ * last and equals the record's ring position once it is committed;
+ * anything else there is stale data from an earlier lap. */
+typedef struct {
+  uint32_t seq;
+  uint16_t size;              /* whole record including header and padding */
+  uint16_t len;               /* payload bytes, or LEN_PAD */
+} record_hdr_t;
+
+#define LEN_PAD 0xFFFF
+#define ALIGN8(x) (((x) + 7) & ~7U)
+
+static record_hdr_t *record_at(log_ring_t *ring, uint32_t pos) {
+  return (record_hdr_t *)(ring->buf + (pos & (ring->size - 1)));
+}
+
+static void record_publish(record_hdr_t *hdr, uint32_t pos, uint32_t size, uint16_t len) {
+  hdr->size = size;
+  hdr->len = len;
+  __atomic_store_n(&hdr->seq, pos, __ATOMIC_RELEASE);
+}
+
+void log_ring_init(log_ring_t *ring, void *buf, size_t size, log_ring_policy_t policy) {
+  ring->buf = buf;
+  ring->size = size;
+  ring->policy = policy;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->dropped = 0;
+  /* make sure no stale header can match a position of the first lap */
+  memset(buf, 0xFF, size);
+}
+
+/* Discard the committed record at tail; false if it is still being written */
+static bool log_ring_drop_oldest(log_ring_t *ring, uint32_t tail) {
+  record_hdr_t *hdr = record_at(ring, tail);
+  if (__atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) != tail) return false;
+  if (__atomic_compare_exchange_n(&ring->tail, &tail, tail + hdr->size, false,
+				  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    if (hdr->len != LEN_PAD) __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+  }
+  /* either way tail has moved on, so try again */
+  return true;
+}
+
+bool log_ring_reserve(log_ring_t *ring, size_t max_len, log_ring_slot_t *slot) {
+  uint32_t need = ALIGN8(sizeof(record_hdr_t) + max_len);
+  uint32_t head, tail, pad, total;
+
+  if (need > ring->size / 2) {
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  for (;;) {
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    /* records never wrap; pad out the end of the buffer instead */
+    pad = ring->size - (head & (ring->size - 1));
+    if (pad >= need) pad = 0;
+    total = pad + need;
+
+    if (head + total - tail > ring->size) {
+      if (ring->policy == LOG_RING_DROP_OLDEST && log_ring_drop_oldest(ring, tail)) {
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	continue;
+      }
+      __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    if (__atomic_compare_exchange_n(&ring->head, &head, head + total, false,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      break;
+  }
+
+  if (pad) {
+    record_publish(record_at(ring, head), head, pad, LEN_PAD);
+    head += pad;
+  }
+  slot->pos = head;
+  slot->size = need;
+  slot->data = (uint8_t *)(record_at(ring, head) + 1);
+  slot->max_len = max_len;
+  return true;
+}
+
+void log_ring_commit(log_ring_t *ring, log_ring_slot_t *slot, size_t len) {
+  uint32_t size = slot->size;
+  uint32_t end = slot->pos + size;
+  uint32_t used;
+
+  if (len > slot->max_len) len = slot->max_len;
+  used = ALIGN8(sizeof(record_hdr_t) + len);
+  /* hand back the unused tail if we are still the last reservation */
+  if (used < size &&
+      __atomic_compare_exchange_n(&ring->head, &end, slot->pos + used, false,
+				  __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    size = used;
+  record_publish(record_at(ring, slot->pos), slot->pos, size, len);
+}
+
+bool log_ring_push(log_ring_t *ring, const void *data, size_t len) {
+  log_ring_slot_t slot;
+  if (!log_ring_reserve(ring, len, &slot)) return false;
+  memcpy(slot.data, data, len);
+  log_ring_commit(ring, &slot, len);
+  return true;
+}
+
+bool log_ring_pop(log_ring_t *ring, void *out, size_t out_size, size_t *len) {
+  uint32_t tail, size;
+  uint16_t rec_len;
+  record_hdr_t *hdr;
+  size_t n = 0;
+
+  for (;;) {
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) return false;
+    hdr = record_at(ring, tail);
+    if (__atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE) != tail) return false;
+
+    size = hdr->size;
+    rec_len = hdr->len;
+    if (rec_len != LEN_PAD) {
+      n = rec_len < out_size ? rec_len : out_size;
+      memcpy(out, hdr + 1, n);
+    }
+    /* if a producer dropped this record meanwhile, the copy is garbage */
+    if (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + size, false,
+				     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      continue;
+    if (rec_len == LEN_PAD) continue;
+    *len = n;
+    return true;
+  }
+}
+
+bool log_ring_empty(log_ring_t *ring) {
+  return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+    __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
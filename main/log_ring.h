@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed size byte ring holding variable length records.
+ *
+ * Any number of producers may reserve, fill and commit records
+ * concurrently with a single consumer; no locks and no heap are used.
+ * Producers claim space with a compare-and-swap on head and publish a
+ * record by storing its ring position into the record header, so the
+ * consumer never sees a half written record.
+ *
+ * When the ring is full the record is either refused (DROP_NEWEST) or
+ * committed records are discarded from the tail to make room
+ * (DROP_OLDEST).  Both count towards log_ring_dropped().
+ */
+
+typedef enum {
+  LOG_RING_DROP_NEWEST,
+  LOG_RING_DROP_OLDEST,
+} log_ring_policy_t;
+
+typedef struct {
+  uint8_t *buf;
+  uint32_t size;              /* power of two */
+  log_ring_policy_t policy;
+  uint32_t head;              /* next position to reserve */
+  uint32_t tail;              /* oldest unconsumed position */
+  uint32_t dropped;
+} log_ring_t;
+
+/* A reserved but not yet committed record */
+typedef struct {
+  uint32_t pos;
+  uint32_t size;
+  uint8_t *data;
+  size_t max_len;
+} log_ring_slot_t;
+
+/* buf must be 8 byte aligned; size must be a power of two */
+void log_ring_init(log_ring_t *ring, void *buf, size_t size, log_ring_policy_t policy);
+
+/* Claim room for up to max_len bytes; on success slot->data may be
+ * written and must then be committed.  Returns false if the record was
+ * dropped. */
+bool log_ring_reserve(log_ring_t *ring, size_t max_len, log_ring_slot_t *slot);
+
+/* Publish the first len bytes of a reserved slot; unused space is given
+ * back when no other producer has reserved behind it */
+void log_ring_commit(log_ring_t *ring, log_ring_slot_t *slot, size_t len);
+
+bool log_ring_push(log_ring_t *ring, const void *data, size_t len);
+
+/* Consumer only: copy the oldest record to out, truncating to out_size */
+bool log_ring_pop(log_ring_t *ring, void *out, size_t out_size, size_t *len);
+
+bool log_ring_empty(log_ring_t *ring);
+
+static inline uint32_t log_ring_dropped(log_ring_t *ring) {
+  return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+/* Bytes reserved or queued, including record headers and padding */
+static inline uint32_t log_ring_used(log_ring_t *ring) {
+  return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) -
+    __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+static inline void log_ring_set_policy(log_ring_t *ring, log_ring_policy_t policy) {
+  ring->policy = policy;
+}
@@ -0,0 +1,148 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+
+static metric_t *metrics_list = NULL;
+
+/* Appended, so reports list metrics in the order they were registered */
+void metrics_register(metric_t *metric) {
+  metric_t **link = &metrics_list;
+  metric_t *m, *expected;
+  for (;;) {
+    while ((m = __atomic_load_n(link, __ATOMIC_ACQUIRE)) != NULL) {
+      if (m == metric) return;
+      link = &m->next;
+    }
+    metric->next = NULL;
+    expected = NULL;
+    if (__atomic_compare_exchange_n(link, &expected, metric, false,
+				    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+  }
+}
+
+typedef struct {
+  uint32_t count;
+  uint32_t sum;
+  uint32_t max;
+  uint32_t p50;
+  uint32_t p95;
+} metric_summary_t;
+
+/* Upper bound of the bucket holding the n'th smallest value (1 based) */
+static uint32_t metric_percentile(const uint32_t *buckets, uint32_t n, uint32_t max) {
+  uint32_t seen = 0;
+  int i;
+  for (i = 0; i < METRIC_HISTOGRAM_BUCKETS - 1; i++) {
+    seen += buckets[i];
+    if (seen >= n) {
+      uint32_t bound = i ? (1u << i) - 1 : 0;
+      return bound < max ? bound : max;
+    }
+  }
+  return max;
+}
+
+static void metric_summarize(metric_histogram_t *hist, metric_summary_t *s, bool reset) {
+  uint32_t buckets[METRIC_HISTOGRAM_BUCKETS];
+  int i;
+
+  if (hist->cumulative) reset = false;
+  s->count = 0;
+  for (i = 0; i < METRIC_HISTOGRAM_BUCKETS; i++) {
+    buckets[i] = reset ? __atomic_exchange_n(&hist->buckets[i], 0, __ATOMIC_RELAXED)
+		       : __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    s->count += buckets[i];
+  }
+  s->sum = reset ? __atomic_exchange_n(&hist->sum, 0, __ATOMIC_RELAXED) : hist->sum;
+  s->max = reset ? __atomic_exchange_n(&hist->max, 0, __ATOMIC_RELAXED) : hist->max;
+  s->p50 = s->count ? metric_percentile(buckets, (s->count + 1) / 2, s->max) : 0;
+  s->p95 = s->count ? metric_percentile(buckets, s->count - s->count / 20, s->max) : 0;
+}
+
+static int32_t metric_value(metric_t *m) {
+  if (m->read) return m->read();
+  return (int32_t)__atomic_load_n(&m->value, __ATOMIC_RELAXED);
+}
+
+/* snprintf that never runs past the end, so callers can keep appending */
+static size_t __attribute__ ((format (printf, 4, 5)))
+metrics_append(char *buf, size_t size, size_t len, const char *fmt, ...) {
+  va_list args;
+  int n;
+  if (len >= size) return len;
+  va_start(args, fmt);
+  n = vsnprintf(buf + len, size - len, fmt, args);
+  va_end(args);
+  if (n < 0) return len;
+  return len + n < size ? len + n : size - 1;
+}
+
+/* The first metric to format: *next, or the head of the registry */
+static metric_t *metrics_first(metric_t **next) {
+  return *next ? *next : __atomic_load_n(&metrics_list, __ATOMIC_ACQUIRE);
+}
+
+size_t metrics_format(char *buf, size_t size, bool reset, metric_t **next) {
+  metric_summary_t s;
+  size_t len = 0;
+  metric_t *m;
+
+  if (size) buf[0] = 0;
+  for (m = metrics_first(next); m; m = m->next) {
+    const char *sep = len ? " " : "";
+    /* room for the separator, the name and four numbers */
+    if (len && len + strlen(m->name) + 48 >= size) break;
+    switch (m->type) {
+    case METRIC_COUNTER:
+      len = metrics_append(buf, size, len, "%s%s=%u", sep, m->name, (unsigned)metric_value(m));
+      break;
+    case METRIC_GAUGE:
+      len = metrics_append(buf, size, len, "%s%s=%d", sep, m->name, (int)metric_value(m));
+      break;
+    case METRIC_HISTOGRAM:
+      metric_summarize((metric_histogram_t *)m, &s, reset);
+      len = metrics_append(buf, size, len, "%s%s=%u/%u/%u/%u", sep, m->name,
+			   (unsigned)s.count, (unsigned)s.p50, (unsigned)s.p95, (unsigned)s.max);
+      break;
+    }
+  }
+  *next = m;
+  return len;
+}
+
+size_t metrics_format_statsd(char *buf, size_t size, const char *prefix, bool reset,
+			     metric_t **next) {
+  metric_summary_t s;
+  size_t len = 0;
+  metric_t *m;
+
+  if (size) buf[0] = 0;
+  for (m = metrics_first(next); m; m = m->next) {
+    /* room for a histogram's five lines */
+    if (len && len + 5 * (strlen(prefix) + strlen(m->name) + 24) >= size) break;
+    switch (m->type) {
+    case METRIC_COUNTER:
+      len = metrics_append(buf, size, len, "%s.%s:%u|g\n", prefix, m->name,
+			   (unsigned)metric_value(m));
+      break;
+    case METRIC_GAUGE:
+      len = metrics_append(buf, size, len, "%s.%s:%d|g\n", prefix, m->name,
+			   (int)metric_value(m));
+      break;
+    case METRIC_HISTOGRAM:
+      metric_summarize((metric_histogram_t *)m, &s, reset);
+      len = metrics_append(buf, size, len, "%s.%s.count:%u|g\n%s.%s.avg:%u|g\n",
+			   prefix, m->name, (unsigned)s.count,
+			   prefix, m->name, (unsigned)(s.count ? s.sum / s.count : 0));
+      len = metrics_append(buf, size, len, "%s.%s.p50:%u|g\n%s.%s.p95:%u|g\n%s.%s.max:%u|g\n",
+			   prefix, m->name, (unsigned)s.p50, prefix, m->name, (unsigned)s.p95,
+			   prefix, m->name, (unsigned)s.max);
+      break;
+    }
+  }
+  *next = m;
+  return len;
+}
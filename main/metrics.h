@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Registry of runtime counters, gauges and latency histograms.
+ *
+ * Metrics are statically allocated by the module that owns them and
+ * linked into the registry once at init; updating one is a single
+ * atomic operation, safe from any task or ISR.  Gauges may instead
+ * supply a read function that is sampled when the metrics are
+ * reported.  Histograms keep power of two buckets, bucket i counting
+ * values in [2^(i-1), 2^i), and are cleared each time they are
+ * reported so every report covers one interval, unless declared
+ * cumulative for events too rare to fill an interval.
+ */
+
+typedef enum {
+  METRIC_COUNTER,
+  METRIC_GAUGE,
+  METRIC_HISTOGRAM,
+} metric_type_t;
+
+typedef struct metric {
+  const char *name;
+  metric_type_t type;
+  int32_t (*read)(void);	/* sampled gauges only */
+  struct metric *next;
+  uint32_t value;		/* counter total or gauge level */
+} metric_t;
+
+#define METRIC_HISTOGRAM_BUCKETS 24
+
+typedef struct {
+  metric_t metric;
+  bool cumulative;		/* never cleared by a report */
+  uint32_t sum;
+  uint32_t max;
+  uint32_t buckets[METRIC_HISTOGRAM_BUCKETS];
+} metric_histogram_t;
+
+#define METRIC_COUNTER_INIT(n)	    { .name = (n), .type = METRIC_COUNTER }
+#define METRIC_GAUGE_INIT(n)	    { .name = (n), .type = METRIC_GAUGE }
+#define METRIC_GAUGE_READ_INIT(n, fn) { .name = (n), .type = METRIC_GAUGE, .read = (fn) }
+#define METRIC_HISTOGRAM_INIT(n)    { .metric = { .name = (n), .type = METRIC_HISTOGRAM } }
+#define METRIC_HISTOGRAM_CUMULATIVE_INIT(n) \
+  { .metric = { .name = (n), .type = METRIC_HISTOGRAM }, .cumulative = true }
+
+/* Link a metric into the registry; registering twice is harmless */
+void metrics_register(metric_t *metric);
+
+static inline void metric_add(metric_t *metric, uint32_t n) {
+  __atomic_fetch_add(&metric->value, n, __ATOMIC_RELAXED);
+}
+
+static inline void metric_inc(metric_t *metric) {
+  metric_add(metric, 1);
+}
+
+static inline void metric_set(metric_t *metric, int32_t value) {
+  __atomic_store_n(&metric->value, (uint32_t)value, __ATOMIC_RELAXED);
+}
+
+static inline void metric_observe(metric_histogram_t *hist, uint32_t value) {
+  int bucket = value ? 32 - __builtin_clz(value) : 0;
+  uint32_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+
+  if (bucket >= METRIC_HISTOGRAM_BUCKETS) bucket = METRIC_HISTOGRAM_BUCKETS - 1;
+  __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+  while (value > max &&
+	 !__atomic_compare_exchange_n(&hist->max, &max, value, false,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* One line of "name=value" pairs, histograms as name=count/p50/p95/max.
+ * Percentiles are bucket upper bounds.  Only whole pairs are written:
+ * starting from *next, or the first metric if NULL, for as many as fit,
+ * leaving *next at the first left out or NULL once all are done.
+ * Returns the length written. */
+size_t metrics_format(char *buf, size_t size, bool reset, metric_t **next);
+
+/* The same as statsd gauges, one "prefix.name:value|g" per line */
+size_t metrics_format_statsd(char *buf, size_t size, const char *prefix, bool reset,
+			     metric_t **next);
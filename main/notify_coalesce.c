@@ -0,0 +1,118 @@
+#include <esp_log.h>
+
+#include "hal.h"
+#include "garage_config.h"
+#include "metrics.h"
+#include "notify_coalesce.h"
+#include "timer_wheel.h"
+
+static void notify_timer_callback(void* arg);
+
+typedef struct {
+  wheel_timer_t timer;
+  bool armed;
+  /* last sent to controllers, and latest from the state machine */
+  garage_state_t sent_current, sent_target;
+  garage_state_t pending_current, pending_target;
+  int64_t sent_us;
+  int64_t pending_us;		/* when the pending state last changed */
+  bool sent_once;
+  bool requested;		/* a controller asked for requested_target */
+  garage_state_t requested_target;
+} notify_door_t;
+
+static notify_send_t notify_send;
+static notify_door_t notify_doors[GARAGE_MAX_DOORS];
+
+static metric_t notify_changes = METRIC_COUNTER_INIT("notify.changes");
+static metric_t notify_sent = METRIC_COUNTER_INIT("notify.sent");
+
+void notify_coalesce_init(notify_send_t send) {
+  size_t i;
+
+  notify_send = send;
+  for (i = 0; i < garage_door_count(); i++) {
+    notify_door_t *nd = &notify_doors[i];
+    nd->sent_current = nd->pending_current = garage_get_current_state(garage_door(i));
+    nd->sent_target = nd->pending_target = garage_get_target_state(garage_door(i));
+    nd->timer = timer_wheel_create("notify_timer", notify_timer_callback, (void *)(uintptr_t)i);
+  }
+  metrics_register(&notify_changes);
+  metrics_register(&notify_sent);
+}
+
+void notify_coalesce_update(garage_door_t *door, garage_state_t current, garage_state_t target) {
+  notify_door_t *nd = &notify_doors[garage_door_index(door)];
+  int64_t now, delay_us, holdoff_us;
+
+  if (current == nd->pending_current && target == nd->pending_target) return;
+  metric_inc(&notify_changes);
+  now = hal_time_us();
+  nd->pending_current = current;
+  nd->pending_target = target;
+  nd->pending_us = now;
+  if (nd->armed) return;
+
+  delay_us = GARAGE_NOTIFY_COALESCE_MILLISECONDS * 1000LL;
+  holdoff_us = nd->sent_us + GARAGE_NOTIFY_FLAP_MILLISECONDS * 1000LL - now;
+  if (nd->sent_once && holdoff_us > delay_us) delay_us = holdoff_us;
+  nd->armed = true;
+  timer_wheel_start_once(nd->timer, delay_us, 0);
+}
+
+/* arg is the door index, with the target in bits 8 and up */
+static void notify_request_event(const event_t *event) {
+  notify_door_t *nd = &notify_doors[event->arg & 0xFF];
+
+  nd->requested = true;
+  nd->requested_target = event->arg >> 8;
+}
+
+void notify_coalesce_request(garage_door_t *door, garage_state_t target) {
+  /* with the queue full the move is only held, as if unrequested */
+  garage_post(notify_request_event, garage_door_index(door) | target << 8);
+}
+
+/* Off the settled state controllers last saw with nobody asking: maybe
+ * a flap */
+static bool notify_unrequested_departure(const notify_door_t *nd) {
+  return nd->sent_current == nd->sent_target && nd->pending_current != nd->sent_current &&
+    !(nd->requested && nd->pending_target == nd->requested_target);
+}
+
+/* arg is the door index */
+static void notify_flush_event(const event_t *event) {
+  notify_door_t *nd = &notify_doors[event->arg];
+  bool current_changed = nd->pending_current != nd->sent_current;
+  bool target_changed = nd->pending_target != nd->sent_target;
+  int64_t now = hal_time_us();
+  int64_t hold_us = nd->pending_us + GARAGE_NOTIFY_FLAP_MILLISECONDS * 1000LL - now;
+
+  nd->armed = false;
+  if (!current_changed && !target_changed) {
+    ESP_LOGD(__FUNCTION__, "flap suppressed");
+    return;
+  }
+  if (hold_us > 0 && notify_unrequested_departure(nd)) {
+    ESP_LOGD(__FUNCTION__, "held until stable");
+    nd->armed = true;
+    timer_wheel_start_once(nd->timer, hold_us, 0);
+    return;
+  }
+  nd->sent_current = nd->pending_current;
+  nd->sent_target = nd->pending_target;
+  nd->sent_us = now;
+  nd->sent_once = true;
+  nd->requested = false;
+  metric_add(&notify_sent, current_changed + target_changed);
+  notify_send(garage_door(event->arg), current_changed, nd->sent_current,
+	      target_changed, nd->sent_target);
+}
+
+static void notify_timer_callback(void* arg) {
+  uint32_t door = (uintptr_t)arg;
+  /* the garage queue is full; try again rather than leave it armed */
+  if (!garage_post(notify_flush_event, door))
+    timer_wheel_start_once(notify_doors[door].timer, GARAGE_NOTIFY_COALESCE_MILLISECONDS * 1000LL,
+			   0);
+}
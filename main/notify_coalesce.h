@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include "garage_control.h"
+
+/* Coalescing of HomeKit state notifications.
+ *
+ * Every notify is an encrypted event frame to each paired controller,
+ * so state changes are not sent as they happen.  The first change after
+ * a quiet spell is sent GARAGE_NOTIFY_COALESCE_MILLISECONDS later,
+ * together with anything else that changed in the meantime.  After a
+ * notify, changes are held until GARAGE_NOTIFY_FLAP_MILLISECONDS have
+ * passed and then only sent if the state still differs from what was
+ * last sent: a flap back to the notified state is never reported, and
+ * the final state always is.
+ *
+ * A door leaving the settled state last sent without a controller
+ * asking it to, such as a sensor dropping out for a moment, is held
+ * until it has kept its new state for GARAGE_NOTIFY_FLAP_MILLISECONDS,
+ * so a flap off a settled door and back is not reported either.  A
+ * requested move is sent straight away.
+ *
+ * Each door is coalesced on its own.  Runs on the garage event task;
+ * notify_coalesce_update() must be called from the state callback and
+ * the send function is called from the same task.
+ */
+
+typedef void (*notify_send_t)(garage_door_t *door, bool current_changed, garage_state_t current,
+			      bool target_changed, garage_state_t target);
+
+/* After garage_init(): the doors' states now are taken to be what
+ * controllers already know */
+void notify_coalesce_init(notify_send_t send);
+void notify_coalesce_update(garage_door_t *door, garage_state_t current, garage_state_t target);
+
+/* A controller asked the door for target: it setting off that way is
+ * not held as a possible flap.  Called from any task, before the
+ * garage action. */
+void notify_coalesce_request(garage_door_t *door, garage_state_t target);
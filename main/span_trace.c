@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "metrics.h"
+#include "span_trace.h"
+
+/* Only the garage event task touches spans: garage_control.c posts
+ * the setter and the command to it rather than marking them where they
+ * happen, so no locking is needed. */
+static span_t spans[SPAN_RING_LEN];
+static span_t *span_open = NULL;
+static uint32_t span_next_id = 1;
+
+static const char *span_stage_names[SPAN_STAGE_COUNT] = {
+  "setter", "command", "relay_on", "relay_off", "edge", "settled", "notify",
+};
+
+/* Per stage latency since the start of the span, in milliseconds since
+ * the door takes several seconds; kept across heartbeats because
+ * requests are rare */
+static metric_histogram_t span_stage_ms[SPAN_STAGE_COUNT] = {
+  [SPAN_COMMAND] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.command_ms"),
+  [SPAN_RELAY_ON] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.relay_on_ms"),
+  [SPAN_RELAY_OFF] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.relay_off_ms"),
+  [SPAN_SENSOR_EDGE] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.edge_ms"),
+  [SPAN_SETTLED] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.settled_ms"),
+  [SPAN_NOTIFY] = METRIC_HISTOGRAM_CUMULATIVE_INIT("span.notify_ms"),
+};
+static metric_t span_incomplete = METRIC_COUNTER_INIT("span.incomplete");
+
+void span_init(void) {
+  int i;
+  for (i = SPAN_SETTER + 1; i < SPAN_STAGE_COUNT; i++)
+    metrics_register(&span_stage_ms[i].metric);
+  metrics_register(&span_incomplete);
+}
+
+const char *span_stage_str(span_stage_t stage) {
+  return stage < SPAN_STAGE_COUNT ? span_stage_names[stage] : "?";
+}
+
+static void span_log(const span_t *span) {
+  char line[160];
+  size_t len = 0;
+  int i, n;
+
+  for (i = 0; i < SPAN_STAGE_COUNT && len < sizeof(line); i++) {
+    if (span->stage_us[i] == SPAN_NOT_REACHED) continue;
+    n = snprintf(line + len, sizeof(line) - len, " %s+%u.%u", span_stage_names[i],
+		 (unsigned)(span->stage_us[i] / 1000), (unsigned)(span->stage_us[i] / 100 % 10));
+    if (n > 0) len += n;
+  }
+  ESP_LOGI(__FUNCTION__, "span %u%s ms%s", (unsigned)span->id, line,
+	   span->done ? "" : " (incomplete)");
+}
+
+static void span_close(span_t *span, bool done) {
+  int i;
+
+  span_open = NULL;
+  span->done = done;
+  if (done) {
+    /* the first stage is the span's start, 0 by definition */
+    for (i = span->first + 1; i < SPAN_STAGE_COUNT; i++)
+      if (span->stage_us[i] != SPAN_NOT_REACHED)
+	metric_observe(&span_stage_ms[i], span->stage_us[i] / 1000);
+  }else{
+    metric_inc(&span_incomplete);
+  }
+  span_log(span);
+}
+
+uint32_t span_begin(span_stage_t stage, int64_t now_us) {
+  span_t *span;
+  int i;
+
+  if (span_open) span_close(span_open, false);
+  span = &spans[span_next_id % SPAN_RING_LEN];
+  span->id = span_next_id++;
+  span->start_us = now_us;
+  span->first = stage;
+  span->done = false;
+  for (i = 0; i < SPAN_STAGE_COUNT; i++) span->stage_us[i] = SPAN_NOT_REACHED;
+  span->stage_us[stage] = 0;
+  span_open = span;
+  return span->id;
+}
+
+void span_mark(span_stage_t stage, int64_t now_us) {
+  span_t *span = span_open;
+
+  if (!span) {
+    if (stage == SPAN_COMMAND) span_begin(stage, now_us);
+    return;
+  }
+  /* edges are timestamped by the ISR and may predate the request */
+  if (now_us < span->start_us || span->stage_us[stage] != SPAN_NOT_REACHED) return;
+  if (stage == SPAN_NOTIFY && span->stage_us[SPAN_SETTLED] == SPAN_NOT_REACHED) return;
+
+  span->stage_us[stage] = now_us - span->start_us;
+  if (stage == SPAN_NOTIFY) span_close(span, true);
+}
+
+void span_abort(void) {
+  span_t *span = span_open;
+  if (span) span_close(span, false);
+}
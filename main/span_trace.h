@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Actuation span tracing.
+ *
+ * One span follows a door request from the HomeKit setter to the
+ * notification of the settled state, recording when it passed each
+ * stage.  Spans are kept in a small ring keyed by request id, and each
+ * finished span is logged and feeds a per-stage latency histogram
+ * (metrics.h) for the stages after the one it began at, so the
+ * heartbeat reports percentiles for every stage.
+ *
+ * Only one span is open at a time: the door does one thing at once, and
+ * a new request closes the previous span as incomplete.
+ *
+ * None of this is locked: call it from the garage event task only.
+ * Other tasks go through garage_span_begin().
+ */
+
+typedef enum {
+  SPAN_SETTER,		/* HomeKit target setter entered */
+  SPAN_COMMAND,		/* garage_action_open/close */
+  SPAN_RELAY_ON,
+  SPAN_RELAY_OFF,
+  SPAN_SENSOR_EDGE,	/* first sensor edge after the command */
+  SPAN_SETTLED,		/* debounced state reached the target */
+  SPAN_NOTIFY,		/* HomeKit told of the settled state */
+  SPAN_STAGE_COUNT
+} span_stage_t;
+
+#define SPAN_RING_LEN 16
+#define SPAN_NOT_REACHED UINT32_MAX
+
+typedef struct {
+  uint32_t id;			/* 0 for an unused entry */
+  int64_t start_us;
+  span_stage_t first;		/* the stage it began at */
+  uint32_t stage_us[SPAN_STAGE_COUNT];	/* since start_us, or SPAN_NOT_REACHED */
+  bool done;
+} span_t;
+
+void span_init(void);
+
+/* Start a new request at stage, closing any open span; returns its id */
+uint32_t span_begin(span_stage_t stage, int64_t now_us);
+
+/* Record the first time the open span reaches stage.  SPAN_COMMAND
+ * with no span open begins one.  SPAN_NOTIFY after SPAN_SETTLED
+ * completes the span. */
+void span_mark(span_stage_t stage, int64_t now_us);
+
+/* Close the open span without completing it, e.g. the door is stuck */
+void span_abort(void);
+
+const char *span_stage_str(span_stage_t stage);
@@ -1,31 +1,175 @@
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
-#include <esp_wifi.h>
-#include <esp_event_loop.h>
 #include <esp_log.h>
-#include <lwip/sockets.h>
-#include <lwip/mem.h>
+#include "hal.h"
+#include "hal_socket.h"
+#include "garage_config.h"
 #include "syslog.h"
-
+#include "log_ring.h"
+#include "metrics.h"
+#include "event_task.h"
+#include "syslog_binary.h"
+#include "crash_log.h"
+#include "timer_wheel.h"
+#include "syslog_spool.h"
+#include "wall_clock.h"
+
+#ifndef RECEIVER_IP_ADDR
 #define RECEIVER_IP_ADDR "192.168.1.2"
+#endif
+#ifndef RECEIVER_PORT_NUM
 #define RECEIVER_PORT_NUM 514
+#endif
+#ifndef SENDER_PORT_NUM
 #define SENDER_PORT_NUM 5454
-#define SYSLOG_INTERVAL_MS 100
+#endif
+#define SYSLOG_INTERVAL_MS 100         /* gather messages this long before sending */
+#define SYSLOG_RING_SIZE 8192          /* power of two */
+#define SYSLOG_MAX_DATAGRAM 1024
+#define SYSLOG_OVERFLOW_POLICY LOG_RING_DROP_OLDEST
+
+/* Transmit batching: each wakeup sends at most this much ... */
+#define SYSLOG_BATCH_MAX_MSGS 16
+#define SYSLOG_BATCH_MAX_BYTES 4096
+/* ... subject to a token bucket of SYSLOG_RATE_BURST messages refilled
+ * at SYSLOG_RATE_MSGS_PER_SEC */
+#define SYSLOG_RATE_MSGS_PER_SEC 50
+#define SYSLOG_RATE_BURST 32
+
+/* UDP:        one message per datagram (RFC 5426)
+ * UDP_PACKED: newline separated messages packed into each datagram
+ * TCP:        octet counted stream (RFC 6587) */
+#define SYSLOG_TRANSPORT_UDP 0
+#define SYSLOG_TRANSPORT_UDP_PACKED 1
+#define SYSLOG_TRANSPORT_TCP 2
+#define SYSLOG_TRANSPORT SYSLOG_TRANSPORT_UDP
+#define SYSLOG_MAX_PACKET 1400
+
+/* Queue and send ESP_LOGx messages as binary records (syslog_binary.h)
+ * instead of text; decode with tools/syslog_decode.py.  UDP only. */
+#define SYSLOG_BINARY 0
+#define SYSLOG_MAX_BINARY 256
+
+/* Sends run on their own low priority task so a slow network never
+ * holds up the timer task */
+#define SYSLOG_TASK_PRIORITY 2
+#define SYSLOG_TASK_STACK 3072
+#define SYSLOG_TASK_QUEUE_LEN 8
+
+/* While the network is down the queue goes to the
+ * SYSLOG_SPOOL_PARTITION flash partition (syslog_spool.h) each time it
+ * is SYSLOG_SPOOL_THRESHOLD full, instead of dropping its oldest
+ * messages.  Once it is back the spool is replayed, at most
+ * SYSLOG_SPOOL_BATCH messages every SYSLOG_SPOOL_INTERVAL_MS and only
+ * with what live messages leave of the token bucket.  Without the
+ * partition nothing is spooled. */
+#define SYSLOG_SPOOL 1
+#define SYSLOG_SPOOL_THRESHOLD (SYSLOG_RING_SIZE / 2)
+#define SYSLOG_SPOOL_BATCH 4
+#define SYSLOG_SPOOL_INTERVAL_MS 200
+
+#if SYSLOG_BINARY && SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_TCP
+#error "SYSLOG_BINARY frames are sent over UDP"
+#endif
+#if SYSLOG_MAX_DATAGRAM > SYSLOG_SPOOL_MAX_RECORD
+#error "spooled records are at most SYSLOG_SPOOL_MAX_RECORD"
+#endif
 static char my_ip[32];
 static int syslog_socket;
 static struct sockaddr_in sa,ra;
 static uint32_t syslog_msgid = 1;
 static const char *my_hostname = "ESP32";
 
-typedef struct syslog_entry_t syslog_entry_t;
-struct syslog_entry_t {
-  syslog_entry_t *next;
-  uint32_t msgid;
-  uint32_t tick;
-  uint16_t datagram_len;
-  char datagram[];
-};
-static syslog_entry_t *syslogQueue = NULL;
+/* Composed datagrams wait here until the network is up */
+static uint64_t syslog_ring_buf[SYSLOG_RING_SIZE / sizeof(uint64_t)];
+static log_ring_t syslogQueue;
+static uint32_t syslog_drops_reported = 0;
+static bool syslog_spooling;
+
+/* Every queued record starts with the hal_time_us() it was queued at,
+ * which becomes its TIMESTAMP when it is sent */
+#define SYSLOG_STAMP_LEN sizeof(int64_t)
+static char syslog_tx_buf[SYSLOG_STAMP_LEN + SYSLOG_MAX_DATAGRAM];
+
+static int32_t syslog_queue_bytes(void) {
+  return log_ring_used(&syslogQueue);
+}
+static int32_t syslog_queue_dropped(void) {
+  return log_ring_dropped(&syslogQueue);
+}
+static metric_histogram_t syslog_queue_us = METRIC_HISTOGRAM_INIT("syslog.queue_us");
+static metric_t syslog_depth_metric = METRIC_GAUGE_READ_INIT("syslog.queue_bytes", syslog_queue_bytes);
+static metric_t syslog_dropped_metric = METRIC_GAUGE_READ_INIT("syslog.dropped", syslog_queue_dropped);
+
+static inline void syslog_stamp(uint8_t *data) {
+  int64_t now = hal_time_us();
+  memcpy(data, &now, SYSLOG_STAMP_LEN);
+}
+
+/* Put the time a text message was queued in the TIMESTAMP field
+ * syslog_compose_internal() leaves as "-", once the clock is known;
+ * a message that would then be too long loses its end */
+static size_t syslog_timestamp(char *msg, size_t len, int64_t queued_us) {
+  char *field = len && msg[0] == '<' ? memchr(msg, '>', len) : NULL;
+  char text[WALL_CLOCK_TIMESTAMP_LEN];
+  size_t n;
+
+  if (!field || field + 5 > msg + len || memcmp(field + 1, "1 - ", 4)) return len;
+  if (!(n = wall_clock_format(queued_us, text))) return len;
+  field += 3;
+  if (len + n - 1 > SYSLOG_MAX_DATAGRAM) len = SYSLOG_MAX_DATAGRAM + 1 - n;
+  memmove(field + n, field + 1, msg + len - field - 1);
+  memcpy(field, text, n);
+  return len + n - 1;
+}
+
+#if SYSLOG_BINARY || SYSLOG_TRANSPORT != SYSLOG_TRANSPORT_UDP
+/* messages framed and waiting for the next send() */
+static char syslog_pkt_buf[SYSLOG_MAX_PACKET + SYSLOG_MAX_DATAGRAM];
+static size_t syslog_pkt_len = 0;
+static uint32_t syslog_pkt_msgs = 0;
+#endif
+
+/* token bucket, in millionths of a message */
+#define SYSLOG_TOKEN 1000000LL
+static int64_t syslog_tokens = SYSLOG_RATE_BURST * SYSLOG_TOKEN;
+static int64_t syslog_tokens_time = 0;
+
+/* Sent messages, bytes and send errors as totals, and as rates over
+ * the last complete second.  Only the syslog task counts and rolls the
+ * window over; the gauges just read what it left. */
+typedef struct {
+  uint32_t msgs, bytes, errors;
+} syslog_count_t;
+static syslog_count_t syslog_window;	/* syslog_window_second so far */
+static syslog_count_t syslog_rate;	/* syslog_window_second - 1 */
+static uint32_t syslog_window_second;
+
+static metric_t syslog_sent_metric = METRIC_COUNTER_INIT("syslog.sent");
+static metric_t syslog_bytes_metric = METRIC_COUNTER_INIT("syslog.sent_bytes");
+static metric_t syslog_errors_metric = METRIC_COUNTER_INIT("syslog.send_errors");
+
+/* The rate is only current while the window is; with nothing sent for
+ * a second or more, nobody rolled it */
+static bool syslog_rate_current(void) {
+  return hal_time_us() / 1000000 - __atomic_load_n(&syslog_window_second, __ATOMIC_RELAXED) <= 1;
+}
+static int32_t syslog_msgs_per_sec(void) {
+  return syslog_rate_current() ? __atomic_load_n(&syslog_rate.msgs, __ATOMIC_RELAXED) : 0;
+}
+static int32_t syslog_bytes_per_sec(void) {
+  return syslog_rate_current() ? __atomic_load_n(&syslog_rate.bytes, __ATOMIC_RELAXED) : 0;
+}
+static int32_t syslog_errors_per_sec(void) {
+  return syslog_rate_current() ? __atomic_load_n(&syslog_rate.errors, __ATOMIC_RELAXED) : 0;
+}
+static metric_t syslog_msgs_rate_metric =
+  METRIC_GAUGE_READ_INIT("syslog.sent_per_sec", syslog_msgs_per_sec);
+static metric_t syslog_bytes_rate_metric =
+  METRIC_GAUGE_READ_INIT("syslog.bytes_per_sec", syslog_bytes_per_sec);
+static metric_t syslog_errors_rate_metric =
+  METRIC_GAUGE_READ_INIT("syslog.errors_per_sec", syslog_errors_per_sec);
 
 //#define SYSLOG_DBG
 #ifdef SYSLOG_DBG
@@ -33,10 +177,9 @@ static syslog_entry_t *syslogQueue = NULL;
 #else
 #define DBG(format, ...) do { } while(0) 
 #endif
-#define MIN_HEAP_SIZE 10000
 
 static enum syslog_state syslogState = SYSLOG_NONE;
-static void syslog_schedule_send(void);
+static void syslog_schedule_send(uint64_t delay_us);
 
 #ifdef SYSLOG_DBG
 static char  *syslog_get_status(void) {
@@ -77,159 +220,372 @@ static void syslog_set_status(enum syslog_state state) {
 }
 
 static void syslog_timer_callback(void* arg);
-const static esp_timer_create_args_t syslog_timer_args = {
-  .callback = syslog_timer_callback,
-  .arg = 0,
-  .dispatch_method = ESP_TIMER_TASK,
-  .name = "syslog_timer" };
-static esp_timer_handle_t syslog_timer;
-
-static syslog_entry_t *syslog_compose_internal(uint8_t facility, uint8_t severity,
-					       const char *tag, const char *fmt,
-					       va_list argptr
-					       ) {
-
-#define MALLOC_SIZE (sizeof(syslog_entry_t) + 1024)
-  char fmt_tmp[256];
-  DBG("[%dµs] %s id=%u\n", esp_log_timestamp(), __FUNCTION__, syslog_msgid);
-  syslog_entry_t *se = mem_malloc(MALLOC_SIZE); // allow up to 1k datagram
-  char *p = se->datagram;
-  memset(se, 0, sizeof(MALLOC_SIZE));
-  se->tick = esp_log_timestamp();
-  se->msgid = syslog_msgid;
-
-  {
-    int i,j;
-    bool in_escape_code=false;
-    for (i=0,j=0; fmt[i]!=0; i++) {
-      if (in_escape_code) {
-	if (fmt[i]=='m') in_escape_code = false;
-      }else{
-	if (fmt[i]==0x1B) {
-	  in_escape_code = true;
-	  continue;
-	}
-	fmt_tmp[j] = fmt[i];
-	j++;
-      }
+static event_task_t syslog_events;
+HAL_STORAGE(syslog_events_storage,
+	    EVENT_TASK_STORAGE_SIZE(SYSLOG_TASK_STACK, SYSLOG_TASK_QUEUE_LEN));
+static void syslog_compose(uint8_t facility, uint8_t severity,
+			   const char *tag, const char *fmt, ...);
+static wheel_timer_t syslog_timer;
+
+/* The part of the header that only changes with the hostname,
+ * "VERSION TIMESTAMP HOSTNAME ", rendered once.  Double buffered so a
+ * rename never shows a half written header to a logging task. */
+typedef struct {
+  size_t len;
+  char text[48];
+} syslog_header_t;
+static syslog_header_t syslog_headers[2];
+static syslog_header_t *volatile syslog_header = &syslog_headers[0];
+
+static void syslog_set_hostname(const char *hostname) {
+  syslog_header_t *h = (syslog_header == &syslog_headers[0] ? &syslog_headers[1] : &syslog_headers[0]);
+  int len = snprintf(h->text, sizeof(h->text), "1 - %s ", hostname);
+  if (len < 0) len = 0;
+  h->len = ((size_t)len < sizeof(h->text) ? (size_t)len : sizeof(h->text) - 1);
+  syslog_header = h;
+}
+
+static char *syslog_put_uint(char *p, uint32_t v) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  while (n) *p++ = tmp[--n];
+  return p;
+}
+
+/* Remove ANSI colour sequences (ESC ... 'm') in place, in one pass;
+ * memchr skips the plain text in word sized steps */
+static size_t syslog_strip_escapes(char *s, size_t len) {
+  char *end = s + len;
+  char *in = memchr(s, 0x1B, len);
+  char *out = in;
+  char *next;
+  if (in == NULL) return len;
+  while (in < end) {
+    if (*in == 0x1B) {
+      next = memchr(in, 'm', end - in);
+      in = (next ? next + 1 : end);
+      continue;
     }
-    fmt_tmp[j] = 0;
+    next = memchr(in, 0x1B, end - in);
+    if (next == NULL) next = end;
+    memmove(out, in, next - in);
+    out += next - in;
+    in = next;
   }
+  return out - s;
+}
+
+/* Format one message straight into a queue slot */
+static void syslog_compose_internal(uint8_t facility, uint8_t severity,
+				    const char *tag, const char *fmt,
+				    va_list argptr
+				    ) {
+  const syslog_header_t *header = syslog_header;
+  log_ring_slot_t slot;
+  char *p, *end, *msg;
+  size_t tag_len;
+  uint32_t msgid;
+  int n;
+
+  if (!log_ring_reserve(&syslogQueue, SYSLOG_STAMP_LEN + SYSLOG_MAX_DATAGRAM, &slot)) return;
+  msgid = __atomic_fetch_add(&syslog_msgid, 1, __ATOMIC_RELAXED);
+  DBG("[%dµs] %s id=%u\n", esp_log_timestamp(), __FUNCTION__, msgid);
+  syslog_stamp(slot.data);
+  p = (char *)slot.data + SYSLOG_STAMP_LEN;
+  end = p + SYSLOG_MAX_DATAGRAM;
 
   // The Priority value is calculated by first multiplying the Facility
   // number by 8 and then adding the numerical value of the Severity.
-  p += sprintf(p, "<%d>1 ", facility * 8 + severity);
-
-  {
-    //struct tm *timeinfo;
-    //time_t now = esp_log_timestamp()/1000;
-    //timeinfo=gmtime(&now);
-    //p += strftime(p, 100, "%FT%TZ ", timeinfo);
-    p += sprintf(p, "- ");
-  }
+  *p++ = '<';
+  p = syslog_put_uint(p, facility * 8 + severity);
+  *p++ = '>';
+  memcpy(p, header->text, header->len);
+  p += header->len;
+
+  // add APP-NAME PROCID MSGID
+  tag_len = strnlen(tag, 48);
+  memcpy(p, tag, tag_len);
+  p += tag_len;
+  memcpy(p, " - ", 3);
+  p += 3;
+  p = syslog_put_uint(p, msgid);
+  *p++ = ' ';
+
+  // append syslog message, truncating rather than overrunning the slot
+  msg = p;
+  n = vsnprintf(p, end - p, fmt, argptr);
+  if (n > 0) p += (n < end - p ? n : end - p - 1);
+#ifdef CONFIG_LOG_COLORS
+  p = msg + syslog_strip_escapes(msg, p - msg);
+#endif
+  if (p > msg && p[-1] == '\n') p--;
+
+  crash_log_add(CRASH_LOG_TEXT, severity, tag, msgid, msg, p - msg);
+  log_ring_commit(&syslogQueue, &slot, p - (char *)slot.data);
+}
 
-  // add HOSTNAME APP-NAME PROCID MSGID
-  p += sprintf(p, "%s %s - %u ", my_hostname, tag, syslog_msgid++);
+/* Syslog task only */
+static void syslog_stats_roll(int64_t now) {
+  uint32_t second = now / 1000000;
 
-  // append syslog message
-  p += vsprintf(p, fmt_tmp, argptr );
+  if (second == syslog_window_second) return;
+  /* a whole second or more without traffic has a rate of nothing */
+  if (second == syslog_window_second + 1) {
+    syslog_rate = syslog_window;
+  }else{
+    memset(&syslog_rate, 0, sizeof(syslog_rate));
+  }
+  memset(&syslog_window, 0, sizeof(syslog_window));
+  __atomic_store_n(&syslog_window_second, second, __ATOMIC_RELAXED);
+}
 
-  se->datagram_len = p - se->datagram;
-  se = mem_trim(se, sizeof(syslog_entry_t) + se->datagram_len + 1);
-  return se;
+static void syslog_refill_tokens(int64_t now) {
+  syslog_tokens += (now - syslog_tokens_time) * SYSLOG_RATE_MSGS_PER_SEC;
+  if (syslog_tokens > SYSLOG_RATE_BURST * SYSLOG_TOKEN)
+    syslog_tokens = SYSLOG_RATE_BURST * SYSLOG_TOKEN;
+  syslog_tokens_time = now;
 }
 
-void syslog_timer_callback(void *arg) {
+static bool syslog_transmit(const char *buf, size_t len, uint32_t msgs) {
   int sent_data;
-  syslog_entry_t *pse = syslogQueue;
-  if (syslogQueue == NULL) return;
-  DBG("[%dµs] %s id=%u\n", esp_log_timestamp(), __FUNCTION__, pse->msgid);
-  if (syslogState != SYSLOG_READY && syslogState != SYSLOG_HALTED) return;
-  syslogQueue = syslogQueue->next;
-
-  DBG("Sending UDP\n");
-  sent_data = sendto(syslog_socket, pse->datagram, pse->datagram_len,
+  DBG("Sending %u bytes\n", len);
+#if SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_TCP
+  sent_data = send(syslog_socket, buf, len, 0);
+#else
+  sent_data = sendto(syslog_socket, buf, len,
 		     0,(struct sockaddr*)&ra,sizeof(ra));
-  mem_free(pse);
-  syslog_set_status(SYSLOG_READY);
+#endif
   if(sent_data < 0)
     {
       printf("%s: send failed\n", __FUNCTION__);
+      metric_inc(&syslog_errors_metric);
+      syslog_window.errors++;
       close(syslog_socket);
       syslog_set_status(SYSLOG_WAIT);
-      return;
+      return false;
     }
+  metric_add(&syslog_sent_metric, msgs);
+  metric_add(&syslog_bytes_metric, len);
+  syslog_window.msgs += msgs;
+  syslog_window.bytes += len;
+  return true;
+}
+
+#if !SYSLOG_BINARY && SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_UDP
+static bool syslog_flush(void) {
+  return true;
+}
+
+static bool syslog_frame(const char *msg, size_t len) {
+  return syslog_transmit(msg, len, 1);
+}
+#else
+static bool syslog_flush(void) {
+  bool ok = true;
+  if (syslog_pkt_len) ok = syslog_transmit(syslog_pkt_buf, syslog_pkt_len, syslog_pkt_msgs);
+  syslog_pkt_len = 0;
+  syslog_pkt_msgs = 0;
+  return ok;
+}
 
-  if (syslogQueue != NULL) syslog_schedule_send();
-  //vTaskDelay(4000 / portTICK_PERIOD_MS);
+#if SYSLOG_BINARY
+static bool syslog_frame(const char *msg, size_t len) {
+  if (syslog_pkt_len + 2 + len > SYSLOG_MAX_PACKET) {
+    if (!syslog_flush()) return false;
+  }
+  if (syslog_pkt_len == 0)
+    syslog_pkt_len = syslog_binary_frame_header((uint8_t *)syslog_pkt_buf, my_hostname);
+  syslog_pkt_buf[syslog_pkt_len++] = len & 0xFF;
+  syslog_pkt_buf[syslog_pkt_len++] = len >> 8;
+  memcpy(syslog_pkt_buf + syslog_pkt_len, msg, len);
+  syslog_pkt_len += len;
+  syslog_pkt_msgs++;
+  return true;
+}
+#else
+static bool syslog_frame(const char *msg, size_t len) {
+#if SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_TCP
+  char prefix[8];
+  size_t prefix_len = sprintf(prefix, "%u ", (unsigned)len);
+#else
+  const char *prefix = "\n";
+  size_t prefix_len = syslog_pkt_len ? 1 : 0;
+#endif
+  if (syslog_pkt_len + prefix_len + len > SYSLOG_MAX_PACKET) {
+    if (!syslog_flush()) return false;
+#if SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_UDP_PACKED
+    prefix_len = 0;
+#endif
+  }
+  memcpy(syslog_pkt_buf + syslog_pkt_len, prefix, prefix_len);
+  memcpy(syslog_pkt_buf + syslog_pkt_len + prefix_len, msg, len);
+  syslog_pkt_len += prefix_len + len;
+  syslog_pkt_msgs++;
+  return true;
+}
+#endif
+#endif
 
+/* Network down: move the whole queue to flash, so it has room again.
+ * The spool outlives the boot its queue times belong to, so messages
+ * go there with their TIMESTAMP if the clock is known, else without. */
+static void syslog_spool_queue(void) {
+  int64_t stamp;
+  size_t len;
+
+  while (log_ring_pop(&syslogQueue, syslog_tx_buf, sizeof(syslog_tx_buf), &len)) {
+    if (len <= SYSLOG_STAMP_LEN) continue;
+    memcpy(&stamp, syslog_tx_buf, SYSLOG_STAMP_LEN);
+    len = syslog_timestamp(syslog_tx_buf + SYSLOG_STAMP_LEN, len - SYSLOG_STAMP_LEN, stamp);
+    syslog_spool_write(syslog_tx_buf + SYSLOG_STAMP_LEN, len);
+  }
+}
+
+/* Drain as much of the queue as the batch limits and the token bucket
+ * allow, then come back when the next token is due */
+static void syslog_send_event(const event_t *event) {
+  int64_t now = hal_time_us();
+  uint32_t msgs = 0, replayed;
+  size_t bytes = 0;
+  size_t len;
+  uint32_t drops;
+  int64_t stamp;
+  if (syslogState != SYSLOG_READY) {
+    if (syslog_spooling) syslog_spool_queue();
+    return;
+  }
+  DBG("[%dµs] %s\n", esp_log_timestamp(), __FUNCTION__);
+
+  syslog_stats_roll(now);
+  syslog_refill_tokens(now);
+  while (msgs < SYSLOG_BATCH_MAX_MSGS && bytes < SYSLOG_BATCH_MAX_BYTES &&
+	 syslog_tokens >= SYSLOG_TOKEN) {
+    if (!log_ring_pop(&syslogQueue, syslog_tx_buf, sizeof(syslog_tx_buf), &len)) break;
+    if (len <= SYSLOG_STAMP_LEN) continue;   /* abandoned binary record */
+    memcpy(&stamp, syslog_tx_buf, SYSLOG_STAMP_LEN);
+    metric_observe(&syslog_queue_us, now - stamp);
+    len = syslog_timestamp(syslog_tx_buf + SYSLOG_STAMP_LEN, len - SYSLOG_STAMP_LEN, stamp);
+    syslog_tokens -= SYSLOG_TOKEN;
+    msgs++;
+    bytes += len;
+    if (!syslog_frame(syslog_tx_buf + SYSLOG_STAMP_LEN, len)) return;
+  }
+  /* the spool is older than anything queued, but waits for the queue */
+  if (syslog_spooling && log_ring_empty(&syslogQueue)) {
+    for (replayed = 0; replayed < SYSLOG_SPOOL_BATCH &&
+	   syslog_tokens >= (SYSLOG_RATE_BURST / 2 + 1) * SYSLOG_TOKEN; replayed++) {
+      if (!(len = syslog_spool_read(syslog_tx_buf))) break;
+      syslog_tokens -= SYSLOG_TOKEN;
+      if (!syslog_frame(syslog_tx_buf, len)) return;
+    }
+  }
+  if (!syslog_flush()) return;
+
+  drops = log_ring_dropped(&syslogQueue);
+  if (drops != syslog_drops_reported) {
+    syslog_compose(SYSLOG_FAC_USER, SYSLOG_PRIO_CRIT, "SYSLOG",
+		   "queue overflow, %u messages dropped", drops - syslog_drops_reported);
+    syslog_drops_reported = drops;
+  }
+
+  if (!log_ring_empty(&syslogQueue)) {
+    if (syslog_tokens >= SYSLOG_TOKEN) {
+      syslog_schedule_send(1000);
+    }else{
+      syslog_schedule_send((SYSLOG_TOKEN - syslog_tokens) / SYSLOG_RATE_MSGS_PER_SEC + 1);
+    }
+  }else if (syslog_spooling && syslog_spool_pending()) {
+    syslog_schedule_send(SYSLOG_SPOOL_INTERVAL_MS * 1000);
+  }
 }
 
 /******************************************************************************
  * FunctionName : syslog_compose
- * Description  : compose a syslog_entry_t from va_args
+ * Description  : compose a datagram from va_args into the syslogQueue
  * Parameters   : va_args
- * Returns      : the malloced syslog_entry_t
+ * Returns      : none
  ******************************************************************************/
-static syslog_entry_t *syslog_compose(uint8_t facility, uint8_t severity,
-				      const char *tag, const char *fmt, ...
-				      ) {
-  syslog_entry_t *msg;
+static void syslog_compose(uint8_t facility, uint8_t severity,
+			   const char *tag, const char *fmt, ...
+			   ) {
   va_list argptr;
   va_start(argptr,fmt);
-  msg = syslog_compose_internal(facility, severity,
-				tag, fmt,
-				argptr);
+  syslog_compose_internal(facility, severity,
+			  tag, fmt,
+			  argptr);
   va_end(argptr);
-  return msg;
 }
 
-/******************************************************************************
- * FunctionName : syslog_add_entry
- * Description  : add a syslog_entry_t to the syslogQueue
- * Parameters   : entry: the syslog_entry_t
- * Returns      : none
- ******************************************************************************/
-static void syslog_add_entry(syslog_entry_t *entry) {
-  syslog_entry_t *pse = syslogQueue;
-  if (entry==NULL) {
-    return;
-  }
-
-  DBG("[%dµs] %s id=%u\n", esp_log_timestamp(), __FUNCTION__, entry->msgid);
-  // append msg to syslog_queue
-  if (pse == NULL)
-    syslogQueue = entry;
-  else {
-    while (pse->next != NULL)
-      pse = pse->next;
-    pse->next = entry;  // append msg to syslog queue
-  }
-  DBG("%p %u %d\n", entry, entry->msgid, heap_caps_get_free_size(MALLOC_CAP_8BIT));
-
-  // ensure we have sufficient heap for the rest of the system
-  if (heap_caps_get_free_size(MALLOC_CAP_8BIT) < MIN_HEAP_SIZE) {
-    if (syslogState != SYSLOG_HALTED) {
-      printf("%s: Warning: queue filled up, halted\n", __FUNCTION__);
-      entry->next = syslog_compose(SYSLOG_FAC_USER, SYSLOG_PRIO_CRIT, "SYSLOG", "queue filled up, halted");
-      syslog_set_status(SYSLOG_HALTED);
+/* Send what the crash log kept from before the reset ahead of the
+ * messages queued since.  Text records are marked with the reset reason
+ * and their time in the boot that ended. */
+static void syslog_send_crash_log(void) {
+  const syslog_header_t *header = syslog_header;
+  const crash_log_record_t *saved, *record;
+  hal_reset_t reason = crash_log_reset_reason();
+  size_t n = crash_log_saved(&saved);
+  char *buf = syslog_tx_buf;
+  const size_t size = sizeof(syslog_tx_buf);
+  char msgid[12];
+  size_t i;
+  int len;
+
+  if (!n) return;
+  len = snprintf(buf, size, "<%u>%.*scrash_log - - %s reset, the last %u records of boot %u follow",
+		 SYSLOG_FAC_USER * 8 + (reason == HAL_RESET_SOFTWARE ? SYSLOG_PRIO_NOTICE : SYSLOG_PRIO_CRIT),
+		 (int)header->len, header->text, crash_log_reset_str(reason), (unsigned)n,
+		 (unsigned)saved[0].boot);
+  if (len < 0 || !syslog_frame(buf, (size_t)len < size ? (size_t)len : size - 1)) return;
+
+  for (i = 0; i < n; i++) {
+    record = &saved[i];
+#if SYSLOG_BINARY
+    if (record->kind == CRASH_LOG_BINARY) {
+      if (!syslog_frame(record->text, record->len)) return;
+      continue;
     }
+#endif
+    if (record->kind != CRASH_LOG_TEXT) continue;
+    if (record->msgid) snprintf(msgid, sizeof(msgid), "%u", (unsigned)record->msgid);
+    else strcpy(msgid, "-");
+    len = snprintf(buf, size, "<%u>%.*s%.*s - %s [%s reset, +%u ms] %.*s",
+		   SYSLOG_FAC_USER * 8 + record->severity, (int)header->len, header->text,
+		   (int)strnlen(record->tag, CRASH_LOG_TAG_LEN), record->tag, msgid,
+		   crash_log_reset_str(reason), (unsigned)record->time_ms,
+		   (int)record->len, record->text);
+    if (len < 0) continue;
+    if (!syslog_frame(buf, (size_t)len < size ? (size_t)len : size - 1)) return;
   }
-  syslog_schedule_send();
+  if (!syslog_flush()) return;
+  crash_log_discard_saved();
 }
 
-
-static void syslog_schedule_send(void) {
-  if (syslogState != SYSLOG_READY) return;
+/* A send already pending is left alone, so a burst of messages is
+ * collected into one wakeup, and the send may wait out its slack to
+ * share a wakeup with other subsystems.  Offline, the same wakeup
+ * spools the queue once it is full enough. */
+static void syslog_schedule_send(uint64_t delay_us) {
+  if (syslogState != SYSLOG_READY &&
+      !(syslog_spooling && log_ring_used(&syslogQueue) >= SYSLOG_SPOOL_THRESHOLD))
+    return;
   DBG("Scheduling a send\n");
-  esp_timer_start_once(syslog_timer, SYSLOG_INTERVAL_MS*1000);
+  if (!timer_wheel_armed(syslog_timer))
+    timer_wheel_start_once(syslog_timer, delay_us, GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
 }
 
 static void open_syslog_socket(void){
 
   if (syslogState != SYSLOG_WAIT) return;
 
+#if SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_TCP
+  syslog_socket = socket(PF_INET, SOCK_STREAM, 0);
+#else
   syslog_socket = socket(PF_INET, SOCK_DGRAM, 0);
+#endif
 
   if ( syslog_socket < 0 )
     {
@@ -256,10 +612,22 @@ static void open_syslog_socket(void){
   ra.sin_addr.s_addr = inet_addr(RECEIVER_IP_ADDR);
   ra.sin_port = htons(RECEIVER_PORT_NUM);
 
-  ESP_ERROR_CHECK(tcpip_adapter_get_hostname(TCPIP_ADAPTER_IF_STA, &my_hostname));
+#if SYSLOG_TRANSPORT == SYSLOG_TRANSPORT_TCP
+  if (connect(syslog_socket, (struct sockaddr *)&ra, sizeof(ra)) != 0)
+    {
+      printf("Connect to %s:%d failed\n", RECEIVER_IP_ADDR, RECEIVER_PORT_NUM);
+      close(syslog_socket);
+      return;
+    }
+#endif
+
+  if (hal_net_hostname()) my_hostname = hal_net_hostname();
+  syslog_set_hostname(my_hostname);
 
   syslog_set_status(SYSLOG_READY);
-  if (syslogQueue) syslog_schedule_send();
+  syslog_send_crash_log();
+  if (!log_ring_empty(&syslogQueue) || (syslog_spooling && syslog_spool_pending()))
+    syslog_schedule_send(SYSLOG_INTERVAL_MS*1000);
 }
 
 static void close_syslog_socket(void) {
@@ -268,51 +636,201 @@ static void close_syslog_socket(void) {
   syslog_set_status(SYSLOG_WAIT);
 }
 
-/* Event handler to monitor for wifi connection/disconnection */
-static system_event_cb_t old_event_handler = NULL;
-static esp_err_t event_handler(void *ctx, system_event_t *event)
-{
-  /* chain to the original handler, do this first in case time critical */
-  old_event_handler(ctx, event);
+/* Monitor wifi connection/disconnection: do we enable/disable the service */
+static void syslog_timer_callback(void *arg) {
+  event_post(syslog_events, syslog_send_event, 0);
+}
 
-  /* analyse the event, do we enable/disable the service */
-  switch (event->event_id) {
-  case SYSTEM_EVENT_STA_GOT_IP:
-    sprintf(my_ip,IPSTR, IP2STR(&event->event_info.got_ip.ip_info.ip));
+static void syslog_net_event(const event_t *event)
+{
+  if (event->arg) {
     open_syslog_socket();
-    break;
-  case SYSTEM_EVENT_STA_DISCONNECTED:
+  }else{
     close_syslog_socket();
-    break;
-  default:
-    break;
   }
-  return ESP_OK;
 }
 
+/* Runs on the system event task; connecting may block, so defer it */
+static void syslog_net_callback(bool up, const char *ip)
+{
+  if (up) strncpy(my_ip, ip, sizeof(my_ip) - 1);
+  event_post(syslog_events, syslog_net_event, up);
+}
+
+/******************************************************************************
+ * Per-tag severity filter
+ *
+ * Messages above the minimum severity for their tag are rejected before
+ * any formatting is done.  Tags not in the table use the "*" level.  The
+ * table is kept in NVS so it survives a reboot.
+ ******************************************************************************/
+#define SYSLOG_NVS_NAMESPACE "syslog"
+#define SYSLOG_NVS_LEVELS "levels"
+#define SYSLOG_LEVEL_TAGS 8
+#define SYSLOG_LEVEL_TAG_LEN 16
+
+typedef struct {
+  uint8_t default_level;
+  uint8_t count;
+  struct {
+    char tag[SYSLOG_LEVEL_TAG_LEN];
+    uint8_t level;
+  } tags[SYSLOG_LEVEL_TAGS];
+} syslog_levels_t;
+
+static syslog_levels_t syslog_levels = {
+  .default_level = SYSLOG_PRIO_INFO,
+  .count = 0,
+};
+
+enum syslog_priority syslog_get_level(const char *tag) {
+  int i;
+  for (i=0; i<syslog_levels.count; i++) {
+    if (strncmp(syslog_levels.tags[i].tag, tag, SYSLOG_LEVEL_TAG_LEN) == 0)
+      return syslog_levels.tags[i].level;
+  }
+  return syslog_levels.default_level;
+}
+
+static void syslog_save_levels(void) {
+  hal_nvs_set_blob(SYSLOG_NVS_NAMESPACE, SYSLOG_NVS_LEVELS, &syslog_levels, sizeof(syslog_levels));
+}
+
+static void syslog_load_levels(void) {
+  syslog_levels_t levels;
+  size_t len = sizeof(levels);
+  if (hal_nvs_get_blob(SYSLOG_NVS_NAMESPACE, SYSLOG_NVS_LEVELS, &levels, &len) &&
+      len == sizeof(levels) && levels.count <= SYSLOG_LEVEL_TAGS)
+    syslog_levels = levels;
+}
+
+bool syslog_set_level(const char *tag, enum syslog_priority level) {
+  int i;
+  if (strcmp(tag, "*") == 0) {
+    syslog_levels.default_level = level;
+    syslog_save_levels();
+    return true;
+  }
+  for (i=0; i<syslog_levels.count; i++) {
+    if (strncmp(syslog_levels.tags[i].tag, tag, SYSLOG_LEVEL_TAG_LEN) == 0) break;
+  }
+  if (i == SYSLOG_LEVEL_TAGS) return false;
+  syslog_levels.tags[i].level = level;
+  if (i == syslog_levels.count) {
+    strncpy(syslog_levels.tags[i].tag, tag, SYSLOG_LEVEL_TAG_LEN);
+    /* publish the entry only once it is complete */
+    __atomic_store_n(&syslog_levels.count, i + 1, __ATOMIC_RELEASE);
+  }
+  syslog_save_levels();
+  return true;
+}
+
+/* ESP_LOGx formats start with an optional colour code, the level letter
+ * and " (%d) %s: ", consuming the timestamp and tag arguments.  Returns
+ * the length of that prefix, or 0 if fmt doesn't look like one. */
+#define ESP_LOG_PREFIX " (%d) %s: "
+static size_t syslog_parse_prefix(const char *fmt, uint8_t *severity) {
+  const char *p = fmt;
+  if (*p == 0x1B) {
+    p = strchr(p, 'm');
+    if (p == NULL) return 0;
+    p++;
+  }
+  switch (*p) {
+  case 'E': *severity = SYSLOG_PRIO_ERR; break;
+  case 'W': *severity = SYSLOG_PRIO_WARNING; break;
+  case 'I': *severity = SYSLOG_PRIO_INFO; break;
+  case 'D':
+  case 'V': *severity = SYSLOG_PRIO_DEBUG; break;
+  default: return 0;
+  }
+  p++;
+  if (strncmp(p, ESP_LOG_PREFIX, sizeof(ESP_LOG_PREFIX) - 1) != 0) return 0;
+  return p + sizeof(ESP_LOG_PREFIX) - 1 - fmt;
+}
+
+#if SYSLOG_BINARY
+/* Queue a binary record; false if the caller should fall back to text */
+static bool syslog_compose_binary(uint8_t severity, const char *tag,
+				  const char *fmt, size_t prefix, va_list args) {
+  log_ring_slot_t slot;
+  uint32_t msgid;
+  size_t len;
+
+  /* only formats in flash can be found again in the ELF */
+  if (!hal_ptr_in_rodata(fmt)) return false;
+  if (!log_ring_reserve(&syslogQueue, SYSLOG_STAMP_LEN + SYSLOG_MAX_BINARY, &slot)) return true;
+  syslog_stamp(slot.data);
+  msgid = __atomic_fetch_add(&syslog_msgid, 1, __ATOMIC_RELAXED);
+  len = syslog_binary_encode(slot.data + SYSLOG_STAMP_LEN, SYSLOG_MAX_BINARY, severity,
+			     msgid, esp_log_timestamp(), tag, fmt, prefix, args);
+  if (len) crash_log_add(CRASH_LOG_BINARY, severity, tag, msgid, slot.data + SYSLOG_STAMP_LEN, len);
+  log_ring_commit(&syslogQueue, &slot, len ? SYSLOG_STAMP_LEN + len : 0);
+  return len != 0;
+}
+#endif
+
 static vprintf_like_t old_log_vprintf;
 
 int syslog_vprintf(const char *msg, va_list arglist) {
-  syslog_entry_t *syslog_msg;
-  char task_name[16];
-  char *cur_task = pcTaskGetTaskName(xTaskGetCurrentTaskHandle());
-  strncpy(task_name, cur_task, 16);
-  task_name[15] = 0;
-  if (strncmp(task_name, "tiT", 16) != 0) {
+  va_list syslog_args;
+  uint8_t severity = SYSLOG_PRIO_INFO;
+  const char *tag = "-";
+  size_t prefix;
+  if (strcmp(hal_task_name(), "tiT") != 0) {
     // have confirmed we are not in the TCPIP task
-    //syslog_msg = syslog_compose(SYSLOG_FAC_USER, SYSLOG_PRIO_INFO,
-    //			      "TAG", msg, arglist);
-    syslog_msg = syslog_compose_internal(SYSLOG_FAC_USER, SYSLOG_PRIO_INFO,
-    					 "TAG", msg, arglist);
-    syslog_add_entry(syslog_msg);
+    va_copy(syslog_args, arglist);
+    prefix = syslog_parse_prefix(msg, &severity);
+    if (prefix) {
+      (void)va_arg(syslog_args, int);   // timestamp, syslog has its own
+      tag = va_arg(syslog_args, const char *);
+    }
+    if (severity <= syslog_get_level(tag)) {
+#if SYSLOG_BINARY
+      va_list binary_args;
+      bool sent;
+      va_copy(binary_args, syslog_args);
+      sent = prefix && syslog_compose_binary(severity, tag, msg, prefix, binary_args);
+      va_end(binary_args);
+      if (!sent)
+#endif
+	syslog_compose_internal(SYSLOG_FAC_USER, severity,
+				tag, msg + prefix, syslog_args);
+      syslog_schedule_send(SYSLOG_INTERVAL_MS*1000);
+    }
+    va_end(syslog_args);
   }
   return old_log_vprintf(msg, arglist);
 }
 
+void syslog_set_overflow_policy(log_ring_policy_t policy) {
+  log_ring_set_policy(&syslogQueue, policy);
+}
+
+uint32_t syslog_dropped(void) {
+  return log_ring_dropped(&syslogQueue);
+}
+
 void syslog_init(void) {
   if (syslogState != SYSLOG_NONE) return;
-  esp_timer_create(&syslog_timer_args, &syslog_timer);
-  old_event_handler = esp_event_loop_set_cb(event_handler, NULL);
+  syslog_set_hostname(my_hostname);
+  syslog_load_levels();
+  log_ring_init(&syslogQueue, syslog_ring_buf, sizeof(syslog_ring_buf),
+		SYSLOG_OVERFLOW_POLICY);
+  syslog_events = event_task_create("syslog", SYSLOG_TASK_STACK, SYSLOG_TASK_PRIORITY,
+				    SYSLOG_TASK_QUEUE_LEN, syslog_events_storage);
+  syslog_timer = timer_wheel_create("syslog_timer", syslog_timer_callback, NULL);
+  syslog_spooling = SYSLOG_SPOOL && syslog_spool_init(SYSLOG_SPOOL_PARTITION);
+  metrics_register(&syslog_queue_us.metric);
+  metrics_register(&syslog_depth_metric);
+  metrics_register(&syslog_dropped_metric);
+  metrics_register(&syslog_sent_metric);
+  metrics_register(&syslog_bytes_metric);
+  metrics_register(&syslog_errors_metric);
+  metrics_register(&syslog_msgs_rate_metric);
+  metrics_register(&syslog_bytes_rate_metric);
+  metrics_register(&syslog_errors_rate_metric);
+  hal_net_set_callback(syslog_net_callback);
   syslog_set_status(SYSLOG_WAIT);
 
   old_log_vprintf = esp_log_set_vprintf(syslog_vprintf);
@@ -1,6 +1,10 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+#include "log_ring.h"
+
 enum syslog_state {
   SYSLOG_NONE,        // not initialized
   SYSLOG_WAIT,        // waiting for Wifi
@@ -52,3 +56,13 @@ enum syslog_facility {
 
 
 void syslog_init(void);
+
+/* What to do with new messages while the queue is full */
+void syslog_set_overflow_policy(log_ring_policy_t policy);
+/* Messages lost to queue overflow since boot */
+uint32_t syslog_dropped(void);
+
+/* Minimum severity forwarded for a log tag; "*" sets the default.
+ * Persisted in NVS.  Returns false if the tag table is full. */
+bool syslog_set_level(const char *tag, enum syslog_priority level);
+enum syslog_priority syslog_get_level(const char *tag);
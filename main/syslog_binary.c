@@ -0,0 +1,150 @@
+#include <stdbool.h>
+#include <string.h>
+#include "syslog_binary.h"
+
+#define NEED(n) do { if (end - p < (ptrdiff_t)(n)) return 0; } while (0)
+
+static uint8_t *put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+  return p + 4;
+}
+
+static uint8_t *put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v;
+  p[1] = v >> 8;
+  return p + 2;
+}
+
+static uint8_t *put_bytes(uint8_t *p, const void *data, size_t len) {
+  memcpy(p, data, len);
+  return p + len;
+}
+
+size_t syslog_binary_encode(uint8_t *out, size_t out_size,
+			    uint8_t severity, uint32_t msgid, uint32_t timestamp,
+			    const char *tag, const char *fmt, size_t prefix,
+			    va_list args) {
+  uint8_t *p = out;
+  uint8_t *end = out + out_size;
+  const char *f;
+  size_t len;
+
+  len = strnlen(tag, SYSLOG_BINARY_MAX_STRING);
+  NEED(15 + 1 + len);
+  *p++ = SYSLOG_BINARY_RECORD;
+  *p++ = severity;
+  *p++ = prefix;
+  p = put_u32(p, (uint32_t)(uintptr_t)fmt);
+  p = put_u32(p, timestamp);
+  p = put_u32(p, msgid);
+  *p++ = len;
+  p = put_bytes(p, tag, len);
+
+  for (f = fmt + prefix; *f; f++) {
+    size_t int_size = sizeof(int);
+    int longs = 0;
+    int precision = -1;
+    bool in_precision = false;
+    if (*f != '%') continue;
+    f++;
+    if (*f == '%') continue;
+    while (*f && strchr("-+ #0", *f)) f++;
+    /* width and precision, either of which may be an argument */
+    while (*f && strchr("0123456789.*", *f)) {
+      if (*f == '.') {
+	in_precision = true;
+	precision = 0;
+      }else if (*f == '*') {
+	int v = va_arg(args, int);
+	NEED(4);
+	p = put_u32(p, v);
+	/* a negative precision is taken as none */
+	if (in_precision) precision = (v < 0 ? -1 : v);
+      }else if (in_precision) {
+	precision = precision * 10 + (*f - '0');
+      }
+      f++;
+    }
+    while (*f && strchr("hlLqjzt", *f)) {
+      switch (*f) {
+      case 'l': int_size = (++longs == 1 ? sizeof(long) : sizeof(long long)); break;
+      case 'q': int_size = sizeof(long long); break;
+      case 'j': int_size = sizeof(intmax_t); break;
+      case 'z': int_size = sizeof(size_t); break;
+      case 't': int_size = sizeof(ptrdiff_t); break;
+      case 'L': longs = -1; break;
+      }
+      f++;
+    }
+    switch (*f) {
+    case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+      if (int_size == 8) {
+	uint64_t v = va_arg(args, unsigned long long);
+	NEED(8);
+	p = put_u32(p, v);
+	p = put_u32(p, v >> 32);
+      }else{
+	NEED(4);
+	p = put_u32(p, va_arg(args, unsigned int));
+      }
+      break;
+    case 'c':
+      NEED(4);
+      p = put_u32(p, va_arg(args, int));
+      break;
+    case 'p':
+      NEED(4);
+      p = put_u32(p, (uint32_t)(uintptr_t)va_arg(args, void *));
+      break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+      double v = (longs < 0 ? (double)va_arg(args, long double) : va_arg(args, double));
+      NEED(8);
+      p = put_bytes(p, &v, 8);
+      break;
+    }
+    case 's': {
+      const char *s = va_arg(args, const char *);
+      size_t room, max;
+      uint16_t truncated = 0;
+      if (s == NULL) s = "(null)";
+      NEED(2);
+      /* never read past the precision: the string need not be
+       * terminated within it.  One byte past the room tells us if
+       * it was cut short. */
+      room = end - p - 2;
+      if (room > SYSLOG_BINARY_TRUNCATED - 1) room = SYSLOG_BINARY_TRUNCATED - 1;
+      max = room + 1;
+      if (precision >= 0 && (size_t)precision < max) max = precision;
+      len = strnlen(s, max);
+      if (len > room) {
+	len = room;
+	truncated = SYSLOG_BINARY_TRUNCATED;
+      }
+      p = put_u16(p, len | truncated);
+      p = put_bytes(p, s, len);
+      break;
+    }
+    case 'n':
+      (void)va_arg(args, void *);
+      break;
+    case 0:
+      f--;
+      break;
+    default:
+      /* unknown conversion: we can't know what it consumes */
+      return 0;
+    }
+  }
+  return p - out;
+}
+
+size_t syslog_binary_frame_header(uint8_t *out, const char *hostname) {
+  size_t len = strnlen(hostname, SYSLOG_BINARY_MAX_STRING);
+  uint8_t *p = put_bytes(out, SYSLOG_BINARY_MAGIC, 4);
+  *p++ = len;
+  p = put_bytes(p, hostname, len);
+  return p - out;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compact binary log records.
+ *
+ * Instead of the expanded text, a record carries the address of the
+ * format string in the firmware image plus the raw arguments; the host
+ * side decoder (tools/syslog_decode.py) looks the format up in the ELF
+ * and rebuilds the RFC 5424 line.
+ *
+ * Record, little endian:
+ *   u8  SYSLOG_BINARY_RECORD
+ *   u8  severity
+ *   u8  length of the ESP_LOGx prefix at the start of the format
+ *   u32 format string address
+ *   u32 timestamp, ms since boot
+ *   u32 msgid
+ *   u8  tag length, tag bytes (at most 255)
+ *   arguments in format order:
+ *     integers (and '*' widths)  4 bytes, or 8 for ll/j
+ *     floating point             8 byte double
+ *     pointers                   4 bytes
+ *     strings                    u16 length, bytes; no more than
+ *                                the precision, and if the rest will
+ *                                not fit in the record the length has
+ *                                SYSLOG_BINARY_TRUNCATED set
+ *
+ * Frames (one per datagram):
+ *   "GLB2", u8 hostname length, hostname,
+ *   then per record: u16 length, record.
+ * A record starting with '<' is a plain RFC 5424 text message.  GLB1
+ * frames, from older firmware, had u8 string lengths.
+ */
+
+#define SYSLOG_BINARY_MAGIC "GLB2"
+#define SYSLOG_BINARY_RECORD 0xB1
+#define SYSLOG_BINARY_MAX_STRING 255	/* tag and hostname */
+#define SYSLOG_BINARY_TRUNCATED 0x8000
+
+/* Encode one record; returns its length, or 0 if it didn't fit */
+size_t syslog_binary_encode(uint8_t *out, size_t out_size,
+			    uint8_t severity, uint32_t msgid, uint32_t timestamp,
+			    const char *tag, const char *fmt, size_t prefix,
+			    va_list args);
+
+/* Write a frame header; returns its length */
+size_t syslog_binary_frame_header(uint8_t *out, const char *hostname);
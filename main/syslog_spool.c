@@ -0,0 +1,339 @@
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "metrics.h"
+#include "syslog_spool.h"
+
+#define SPOOL_MAGIC 0x53504C31		/* "SPL1" */
+#define SPOOL_PAGE HAL_FLASH_SECTOR
+#define SPOOL_FREE 0xFFFF
+#define SPOOL_NOT_DONE 0xFFFFFFFF
+#define ALIGN4(n) (((n) + 3) & ~3U)
+
+/* LZSS: a control byte, then up to eight items, from its bottom bit up
+ * a literal byte for each 0 and a match for each 1.  A match is a
+ * little endian u16, distance - 1 in the low LZ_WINDOW_BITS and
+ * length - LZ_MIN_MATCH above, copying from that far back in the page. */
+#define LZ_WINDOW_BITS 10
+#define LZ_WINDOW (1 << LZ_WINDOW_BITS)
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + (0xFFFF >> LZ_WINDOW_BITS))
+#define LZ_HASH_BITS 8
+#define LZ_NONE UINT32_MAX
+/* every byte a literal */
+#define LZ_BOUND(len) ((len) + ((len) + 7) / 8)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t seq;			/* one more than the page before */
+  uint32_t done;		/* cleared once every record is replayed */
+} spool_page_t;
+
+/* Followed by the compressed bytes, padded to 4.  The header is written
+ * after them, so a record cut short by a reset is never read. */
+typedef struct {
+  uint16_t stored;		/* SPOOL_FREE past the last record */
+  uint16_t len;			/* expanded */
+} spool_record_t;
+
+/* The last LZ_WINDOW bytes of the page so far, expanded */
+typedef struct {
+  uint8_t window[LZ_WINDOW];
+  uint32_t pos;			/* bytes in the page so far */
+} lz_history_t;
+
+typedef struct {
+  uint32_t page;
+  uint32_t offset;
+  lz_history_t history;
+} spool_cursor_t;
+
+static hal_flash_t flash;
+static uint32_t pages;
+static uint32_t head_seq;
+static spool_cursor_t head;	/* where the next record goes */
+static spool_cursor_t tail;	/* the next record to replay */
+static uint32_t lz_head[1 << LZ_HASH_BITS];	/* last position with each hash */
+static uint8_t record_buf[ALIGN4(LZ_BOUND(SYSLOG_SPOOL_MAX_RECORD))];
+
+static uint32_t raw_bytes, stored_bytes;
+static int32_t spool_ratio(void) {
+  return raw_bytes ? (uint64_t)stored_bytes * 100 / raw_bytes : 0;
+}
+static metric_t written = METRIC_COUNTER_INIT("spool.written");
+static metric_t replayed = METRIC_COUNTER_INIT("spool.replayed");
+static metric_t lost_pages = METRIC_COUNTER_INIT("spool.lost_pages");
+static metric_t ratio = METRIC_GAUGE_READ_INIT("spool.ratio_pct", spool_ratio);
+
+static inline void lz_put(lz_history_t *h, uint8_t c) {
+  h->window[h->pos++ & (LZ_WINDOW - 1)] = c;
+}
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+  return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Compress len bytes into out against the page so far; returns the
+ * compressed length, at most LZ_BOUND(len).  One candidate per hash is
+ * tried, which finds the header a message shares with the last one. */
+static size_t lz_compress(lz_history_t *h, const uint8_t *in, size_t len, uint8_t *out) {
+  uint32_t at, cand, best, dist = 0, *slot;
+  size_t i = 0, o = 0, ctrl = 0;
+  unsigned bit = 8;
+  uint16_t token;
+  uint8_t c;
+
+  while (i < len) {
+    if (bit == 8) {
+      ctrl = o++;
+      out[ctrl] = 0;
+      bit = 0;
+    }
+    at = h->pos;
+    best = 0;
+    if (i + LZ_MIN_MATCH <= len) {
+      slot = &lz_head[lz_hash(in + i)];
+      cand = *slot;
+      if (cand != LZ_NONE && at - cand <= LZ_WINDOW) {
+	/* a match may run on into the bytes it copies */
+	for (; best < LZ_MAX_MATCH && i + best < len; best++) {
+	  c = cand + best < at ? h->window[(cand + best) & (LZ_WINDOW - 1)] : in[i + cand + best - at];
+	  if (c != in[i + best]) break;
+	}
+	dist = at - cand;
+      }
+    }
+    if (best >= LZ_MIN_MATCH) {
+      out[ctrl] |= 1 << bit;
+      token = (dist - 1) | (best - LZ_MIN_MATCH) << LZ_WINDOW_BITS;
+      out[o++] = token & 0xFF;
+      out[o++] = token >> 8;
+    }else{
+      best = 1;
+      out[o++] = in[i];
+    }
+    bit++;
+    for (; best; best--, i++) {
+      if (i + LZ_MIN_MATCH <= len) lz_head[lz_hash(in + i)] = h->pos;
+      lz_put(h, in[i]);
+    }
+  }
+  return o;
+}
+
+/* Expand one record into out, or with out NULL only follow it into the
+ * history; false if it is not a record lz_compress() made */
+static bool lz_expand(lz_history_t *h, const uint8_t *in, size_t stored, uint8_t *out, size_t len) {
+  size_t i = 0, o = 0;
+  uint32_t dist, n;
+  unsigned bit = 8;
+  uint8_t ctrl = 0, c;
+  uint16_t token;
+
+  while (o < len) {
+    if (bit == 8) {
+      if (i == stored) return false;
+      ctrl = in[i++];
+      bit = 0;
+    }
+    if (ctrl & 1 << bit++) {
+      if (i + 2 > stored) return false;
+      token = in[i] | in[i + 1] << 8;
+      i += 2;
+      dist = (token & (LZ_WINDOW - 1)) + 1;
+      n = (token >> LZ_WINDOW_BITS) + LZ_MIN_MATCH;
+      if (dist > h->pos || n > len - o) return false;
+      while (n--) {
+	c = h->window[(h->pos - dist) & (LZ_WINDOW - 1)];
+	if (out) out[o] = c;
+	o++;
+	lz_put(h, c);
+      }
+    }else{
+      if (i == stored) return false;
+      c = in[i++];
+      if (out) out[o] = c;
+      o++;
+      lz_put(h, c);
+    }
+  }
+  return i == stored;
+}
+
+static bool spool_page_header(uint32_t page, spool_page_t *header) {
+  return hal_flash_read(flash, page * SPOOL_PAGE, header, sizeof(*header)) &&
+    header->magic == SPOOL_MAGIC;
+}
+
+/* true if nothing is written from offset to the end of the page */
+static bool spool_page_erased(uint32_t page, uint32_t offset) {
+  size_t n, i;
+
+  for (; offset < SPOOL_PAGE; offset += n) {
+    n = SPOOL_PAGE - offset < sizeof(record_buf) ? SPOOL_PAGE - offset : sizeof(record_buf);
+    if (!hal_flash_read(flash, page * SPOOL_PAGE + offset, record_buf, n)) return false;
+    for (i = 0; i < n; i++)
+      if (record_buf[i] != 0xFF) return false;
+  }
+  return true;
+}
+
+static void spool_cursor_start(spool_cursor_t *cursor, uint32_t page) {
+  cursor->page = page;
+  cursor->offset = sizeof(spool_page_t);
+  cursor->history.pos = 0;
+}
+
+/* Expand the record at cursor and step over it; false at the end of
+ * the page or at a damaged record */
+static bool spool_record_read(spool_cursor_t *cursor, uint8_t *out, size_t *len) {
+  uint32_t at = cursor->page * SPOOL_PAGE + cursor->offset;
+  spool_record_t record;
+
+  if (cursor->offset + sizeof(record) > SPOOL_PAGE ||
+      !hal_flash_read(flash, at, &record, sizeof(record)) ||
+      record.stored == SPOOL_FREE || record.stored > LZ_BOUND(SYSLOG_SPOOL_MAX_RECORD) ||
+      record.len > SYSLOG_SPOOL_MAX_RECORD ||
+      cursor->offset + sizeof(record) + record.stored > SPOOL_PAGE ||
+      !hal_flash_read(flash, at + sizeof(record), record_buf, record.stored) ||
+      !lz_expand(&cursor->history, record_buf, record.stored, out, record.len))
+    return false;
+  cursor->offset += sizeof(record) + ALIGN4(record.stored);
+  *len = record.len;
+  return true;
+}
+
+/* Mark the tail page replayed and move on to the next */
+static void spool_tail_done(void) {
+  uint32_t done = 0;
+
+  hal_flash_write(flash, tail.page * SPOOL_PAGE + offsetof(spool_page_t, done), &done, sizeof(done));
+  spool_cursor_start(&tail, (tail.page + 1) % pages);
+}
+
+/* Erase the page after head's and write there from now on */
+static bool spool_next_page(void) {
+  uint32_t page = (head.page + 1) % pages;
+  spool_page_t header = { SPOOL_MAGIC, head_seq + 1, SPOOL_NOT_DONE };
+
+  if (page == tail.page && tail.page != head.page) {
+    /* every page is waiting to be replayed: the oldest goes */
+    metric_inc(&lost_pages);
+    spool_cursor_start(&tail, (tail.page + 1) % pages);
+  }
+  if (!hal_flash_erase(flash, page * SPOOL_PAGE, SPOOL_PAGE) ||
+      !hal_flash_write(flash, page * SPOOL_PAGE, &header, sizeof(header))) {
+    ESP_LOGE(__FUNCTION__, "flash page %u failed, spool off", (unsigned)page);
+    flash = NULL;
+    return false;
+  }
+  head_seq++;
+  spool_cursor_start(&head, page);
+  memset(lz_head, 0xFF, sizeof(lz_head));
+  return true;
+}
+
+bool syslog_spool_init(const char *partition) {
+  spool_page_t header;
+  uint32_t page, i;
+  bool found = false;
+  size_t len;
+
+  flash = hal_flash_open(partition);
+  if (!flash) return false;
+  pages = hal_flash_size(flash) / SPOOL_PAGE;
+  if (pages < 2) {
+    ESP_LOGW(__FUNCTION__, "partition %s is too small", partition);
+    flash = NULL;
+    return false;
+  }
+  metrics_register(&written);
+  metrics_register(&replayed);
+  metrics_register(&lost_pages);
+  metrics_register(&ratio);
+
+  for (page = 0; page < pages; page++) {
+    if (!spool_page_header(page, &header)) continue;
+    if (!found || (int32_t)(header.seq - head_seq) > 0) {
+      head.page = page;
+      head_seq = header.seq;
+    }
+    found = true;
+  }
+  memset(lz_head, 0xFF, sizeof(lz_head));
+
+  if (!found) {
+    head.page = tail.page = pages - 1;
+    if (!spool_next_page()) return false;
+    tail = head;
+    ESP_LOGI(__FUNCTION__, "%u pages, new", (unsigned)pages);
+    return true;
+  }
+
+  /* carry on after the newest page's last record, with the history
+   * expanding them gives; if something half written follows, the next
+   * record starts a new page */
+  spool_cursor_start(&head, head.page);
+  while (spool_record_read(&head, NULL, &len))
+    ;
+  if (!spool_page_erased(head.page, head.offset)) head.offset = SPOOL_PAGE;
+
+  /* replay from the oldest page not done */
+  tail = head;
+  for (i = 1; i <= pages; i++) {
+    page = (head.page + i) % pages;
+    if (spool_page_header(page, &header) && header.done == SPOOL_NOT_DONE) {
+      spool_cursor_start(&tail, page);
+      break;
+    }
+  }
+  ESP_LOGI(__FUNCTION__, "%u pages, %u to replay", (unsigned)pages,
+	   syslog_spool_pending() ? (unsigned)((head.page + pages - tail.page) % pages + 1) : 0);
+  return true;
+}
+
+bool syslog_spool_write(const void *data, size_t len) {
+  uint32_t at;
+  spool_record_t record;
+
+  if (!flash || !len || len > SYSLOG_SPOOL_MAX_RECORD) return false;
+  if (head.offset + sizeof(record) + LZ_BOUND(len) > SPOOL_PAGE && !spool_next_page())
+    return false;
+  at = head.page * SPOOL_PAGE + head.offset;
+  record.len = len;
+  record.stored = lz_compress(&head.history, data, len, record_buf);
+  if (!hal_flash_write(flash, at + sizeof(record), record_buf, record.stored) ||
+      !hal_flash_write(flash, at, &record, sizeof(record))) {
+    head.offset = SPOOL_PAGE;
+    return false;
+  }
+  head.offset += sizeof(record) + ALIGN4(record.stored);
+  raw_bytes += len;
+  stored_bytes += sizeof(record) + ALIGN4(record.stored);
+  metric_inc(&written);
+  return true;
+}
+
+size_t syslog_spool_read(void *out) {
+  size_t len;
+
+  while (syslog_spool_pending()) {
+    if (spool_record_read(&tail, out, &len)) {
+      metric_inc(&replayed);
+      return len;
+    }
+    if (tail.page == head.page) {
+      /* damaged where the writer still is: go on from the writer */
+      tail = head;
+      return 0;
+    }
+    spool_tail_done();
+  }
+  return 0;
+}
+
+bool syslog_spool_pending(void) {
+  return flash && (tail.page != head.page || tail.offset < head.offset);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Syslog records kept in a flash partition while the network is down.
+ *
+ * The partition is a ring of HAL_FLASH_SECTOR pages used in turn, so
+ * every sector is erased as often as the others.  Records are appended
+ * to the newest page and replayed from the oldest; a page is marked
+ * done in flash once it has been replayed, and is not erased until the
+ * ring comes round to it again.  If the ring fills up the oldest page
+ * is overwritten, as the RAM queue drops its oldest records.
+ *
+ * Records are LZSS compressed against the page so far, so the syslog
+ * header repeated in every message costs a few bytes.  RAM use is the
+ * compression window and one record, however much is spooled.
+ *
+ * After a reset the spool carries on from what is in flash; the page
+ * being replayed is replayed again from its start.  Writes and reads
+ * are for one task, the syslog task.
+ */
+
+#define SYSLOG_SPOOL_PARTITION "syslog"
+#define SYSLOG_SPOOL_MAX_RECORD 1024
+
+/* false if there is no such partition, or it is too small */
+bool syslog_spool_init(const char *partition);
+
+/* false if the record could not be stored */
+bool syslog_spool_write(const void *data, size_t len);
+
+/* Copies the oldest record not yet replayed to out, which holds
+ * SYSLOG_SPOOL_MAX_RECORD bytes; returns its length, 0 if there is
+ * none */
+size_t syslog_spool_read(void *out);
+
+/* true while there are records to replay */
+bool syslog_spool_pending(void);
@@ -0,0 +1,307 @@
+#include <stddef.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * TIMER_WHEEL_LEVELS))
+#define WHEEL_NEVER UINT64_MAX
+
+struct wheel_timer {
+  const char *name;
+  hal_timer_cb_t callback;
+  void *arg;
+  struct wheel_timer *next;
+  struct wheel_timer **pprev;	/* NULL when not armed */
+  int64_t due_us;
+  uint64_t period_us;		/* 0 for one shot */
+  uint32_t slack_us;
+  uint64_t tick;		/* when it fires, slack applied */
+  uint8_t level, slot;		/* where it is while armed */
+  uint32_t fired, shared;
+};
+
+static void timer_wheel_expire(void *arg);
+
+static struct wheel_timer timers[TIMER_WHEEL_MAX_TIMERS];
+static size_t timer_count;
+
+/* A timer due at tick t is at the lowest level whose slots, counted on
+ * from wheel_tick, reach t: level l slot (t >> 6l) & 63.  occupied has a
+ * bit for each slot with timers in it. */
+static struct wheel_timer *slots[TIMER_WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t occupied[TIMER_WHEEL_LEVELS];
+static uint64_t wheel_tick;	/* every tick before this has been run */
+static uint64_t hw_tick = WHEEL_NEVER;	/* what the HAL timer is armed for */
+static uint32_t align_ticks;
+static hal_timer_t hw_timer;
+static hal_mutex_t lock;
+HAL_STORAGE(lock_storage, HAL_MUTEX_STORAGE_SIZE);
+static bool expiring;		/* timer_wheel_expire() arms the HAL timer last */
+static timer_wheel_stats_t stats;
+
+static int32_t wheel_armed(void) { return stats.armed; }
+static metric_t armed_metric = METRIC_GAUGE_READ_INIT("timer.armed", wheel_armed);
+static metric_histogram_t jitter = METRIC_HISTOGRAM_INIT("timer.jitter_us");
+static metric_t expiries = METRIC_COUNTER_INIT("timer.expiries");
+
+void timer_wheel_init(uint32_t align_us) {
+  align_ticks = align_us / TIMER_WHEEL_TICK_US;
+  if (hw_timer) return;
+  lock = hal_mutex_create(lock_storage);
+  hw_timer = hal_timer_create("timer_wheel", timer_wheel_expire, NULL);
+  wheel_tick = hal_time_us() / TIMER_WHEEL_TICK_US;
+  metrics_register(&armed_metric);
+  metrics_register(&jitter.metric);
+  metrics_register(&expiries);
+}
+
+wheel_timer_t timer_wheel_create(const char *name, hal_timer_cb_t callback, void *arg) {
+  struct wheel_timer *timer;
+
+  hal_mutex_lock(lock);
+  if (timer_count == TIMER_WHEEL_MAX_TIMERS) {
+    hal_mutex_unlock(lock);
+    ESP_LOGE(__FUNCTION__, "no timer left for %s", name);
+    return NULL;
+  }
+  timer = &timers[timer_count++];
+  hal_mutex_unlock(lock);
+  timer->name = name;
+  timer->callback = callback;
+  timer->arg = arg;
+  return timer;
+}
+
+/* The tick in [due, due + slack] with the most trailing zeros, which
+ * timers with overlapping windows agree on */
+static uint64_t wheel_slack_tick(int64_t due_us, uint32_t slack_us) {
+  uint64_t first = (due_us + TIMER_WHEEL_TICK_US - 1) / TIMER_WHEEL_TICK_US;
+  uint64_t last = (due_us + slack_us) / TIMER_WHEEL_TICK_US;
+  uint64_t grid;
+
+  if (last <= first) return first;
+  if (align_ticks) {
+    grid = (first + align_ticks - 1) / align_ticks * align_ticks;
+    if (grid <= last) return grid;
+  }
+  return last & ~((1ULL << (63 - __builtin_clzll(first ^ last))) - 1);
+}
+
+static void wheel_insert(struct wheel_timer *timer) {
+  uint64_t tick, delta;
+  int level = 0, slot;
+
+  if (timer->tick < wheel_tick) timer->tick = wheel_tick;
+  delta = timer->tick - wheel_tick;
+  /* beyond the top level it waits in the last slot and goes round again */
+  tick = delta < WHEEL_SPAN ? timer->tick : wheel_tick + WHEEL_SPAN - 1;
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1))) level++;
+  slot = (tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+  timer->level = level;
+  timer->slot = slot;
+  timer->next = slots[level][slot];
+  if (timer->next) timer->next->pprev = &timer->next;
+  timer->pprev = &slots[level][slot];
+  slots[level][slot] = timer;
+  occupied[level] |= 1ULL << slot;
+}
+
+static void wheel_unlink(struct wheel_timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next) timer->next->pprev = timer->pprev;
+  if (!slots[timer->level][timer->slot]) occupied[timer->level] &= ~(1ULL << timer->slot);
+  timer->pprev = NULL;
+}
+
+static uint64_t rotate_right(uint64_t bits, unsigned n) {
+  n &= 63;
+  return n ? bits >> n | bits << (64 - n) : bits;
+}
+
+/* The earliest tick any timer fires at.  Level 0 holds the next 64
+ * ticks, so its first slot from wheel_tick on is exact; a lower level's
+ * first occupied slot after the current one holds its earliest timers,
+ * and only that slot's list is looked at.  The top level also holds the
+ * timers beyond its span, in whatever slot was last when they were
+ * started, so every one of its lists is. */
+static uint64_t wheel_next_tick(void) {
+  uint64_t next = WHEEL_NEVER, tick, bits;
+  struct wheel_timer *timer;
+  unsigned start;
+  int level;
+
+  if (occupied[0])
+    next = wheel_tick + __builtin_ctzll(rotate_right(occupied[0], wheel_tick & WHEEL_MASK));
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    if (!occupied[level]) continue;
+    start = ((wheel_tick >> (WHEEL_BITS * level)) + 1) & WHEEL_MASK;
+    start = (start + __builtin_ctzll(rotate_right(occupied[level], start))) & WHEEL_MASK;
+    bits = level < TIMER_WHEEL_LEVELS - 1 ? 1ULL << start : occupied[level];
+    for (; bits; bits &= bits - 1) {
+      for (timer = slots[level][__builtin_ctzll(bits)]; timer; timer = timer->next) {
+	tick = timer->tick;
+	if (tick < next) next = tick;
+      }
+    }
+  }
+  return next;
+}
+
+/* Moves wheel_tick on to tick, no later than the next expiry, and
+ * brings the timers of every higher level slot passed on the way down */
+static void wheel_advance(uint64_t tick) {
+  struct wheel_timer *timer, *list;
+  uint64_t start = wheel_tick, from, to, block;
+  int level, slot;
+
+  for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+    from = start >> (WHEEL_BITS * level);
+    to = tick >> (WHEEL_BITS * level);
+    if (to - from > WHEEL_SLOTS) from = to - WHEEL_SLOTS;
+    for (block = from + 1; block <= to; block++) {
+      slot = block & WHEEL_MASK;
+      if (!(occupied[level] & (1ULL << slot))) continue;
+      list = slots[level][slot];
+      slots[level][slot] = NULL;
+      occupied[level] &= ~(1ULL << slot);
+      wheel_tick = tick;
+      while ((timer = list) != NULL) {
+	list = timer->next;
+	wheel_insert(timer);
+      }
+    }
+  }
+  wheel_tick = tick;
+}
+
+static void wheel_arm(void) {
+  uint64_t next = wheel_next_tick();
+  int64_t now, due;
+
+  if (next == hw_tick) return;
+  hw_tick = next;
+  hal_timer_stop(hw_timer);
+  if (next == WHEEL_NEVER) return;
+  now = hal_time_us();
+  due = next * TIMER_WHEEL_TICK_US;
+  hal_timer_start_once(hw_timer, due > now ? due - now : 0);
+}
+
+static void wheel_start(struct wheel_timer *timer, int64_t due_us) {
+  if (timer->pprev) wheel_unlink(timer);
+  else stats.armed++;
+  timer->due_us = due_us;
+  timer->tick = wheel_slack_tick(due_us, timer->slack_us);
+  wheel_insert(timer);
+  if (!expiring && timer->tick < hw_tick) wheel_arm();
+}
+
+void timer_wheel_start_once(wheel_timer_t timer, uint64_t timeout_us, uint32_t slack_us) {
+  hal_mutex_lock(lock);
+  timer->period_us = 0;
+  timer->slack_us = slack_us;
+  wheel_start(timer, hal_time_us() + timeout_us);
+  hal_mutex_unlock(lock);
+}
+
+void timer_wheel_start_periodic(wheel_timer_t timer, uint64_t period_us, uint32_t slack_us) {
+  hal_mutex_lock(lock);
+  timer->period_us = period_us;
+  timer->slack_us = slack_us;
+  wheel_start(timer, hal_time_us() + period_us);
+  hal_mutex_unlock(lock);
+}
+
+void timer_wheel_stop(wheel_timer_t timer) {
+  hal_mutex_lock(lock);
+  if (timer->pprev) {
+    wheel_unlink(timer);
+    stats.armed--;
+    /* left armed, the HAL timer would wake the chip for nothing */
+    if (!expiring && timer->tick == hw_tick) wheel_arm();
+  }
+  hal_mutex_unlock(lock);
+}
+
+bool timer_wheel_armed(wheel_timer_t timer) {
+  return __atomic_load_n(&timer->pprev, __ATOMIC_RELAXED) != NULL;
+}
+
+/* HAL timer callback: runs every timer due by now, a tick at a time,
+ * and arms the HAL timer for the next */
+static void timer_wheel_expire(void *arg) {
+  struct wheel_timer *timer;
+  uint64_t now_tick, next;
+  int64_t now;
+  bool shared;
+
+  hal_mutex_lock(lock);
+  expiring = true;
+  now = hal_time_us();
+  now_tick = now / TIMER_WHEEL_TICK_US;
+  if ((next = wheel_next_tick()) <= now_tick) {
+    stats.expiries++;
+    metric_inc(&expiries);
+  }
+  for (; next <= now_tick; next = wheel_next_tick()) {
+    wheel_advance(next);
+    shared = slots[0][next & WHEEL_MASK]->next != NULL;
+    /* one at a time: a callback may stop or restart the others */
+    while ((timer = slots[0][next & WHEEL_MASK]) != NULL) {
+      wheel_unlink(timer);
+      stats.armed--;
+      stats.fired++;
+      timer->fired++;
+      if (shared) timer->shared++;
+      metric_observe(&jitter, now - timer->due_us);
+      if (timer->period_us) {
+	timer->due_us += timer->period_us;
+	if (timer->due_us <= now)
+	  timer->due_us += ((now - timer->due_us) / timer->period_us + 1) * timer->period_us;
+	wheel_start(timer, timer->due_us);
+      }
+      hal_mutex_unlock(lock);
+      timer->callback(timer->arg);
+      hal_mutex_lock(lock);
+      now = hal_time_us();
+    }
+  }
+  if (now_tick >= wheel_tick) wheel_advance(now_tick + 1);
+  expiring = false;
+  hw_tick = WHEEL_NEVER;
+  wheel_arm();
+  hal_mutex_unlock(lock);
+}
+
+void timer_wheel_stats(timer_wheel_stats_t *out) {
+  hal_mutex_lock(lock);
+  *out = stats;
+  hal_mutex_unlock(lock);
+}
+
+size_t timer_wheel_timer_stats(timer_wheel_timer_stat_t *out, size_t max) {
+  size_t i, j, n = 0;
+
+  hal_mutex_lock(lock);
+  for (i = 0; i < timer_count; i++) {
+    for (j = 0; j < n && strcmp(out[j].name, timers[i].name); j++)
+      ;
+    if (j == n) {
+      if (n == max) continue;
+      out[n].name = timers[i].name;
+      out[n].fired = out[n].shared = 0;
+      n++;
+    }
+    out[j].fired += timers[i].fired;
+    out[j].shared += timers[i].shared;
+  }
+  hal_mutex_unlock(lock);
+  return n;
+}
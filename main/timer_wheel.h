@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "hal.h"
+
+/* Every module timer, on one HAL timer.
+ *
+ * Timers sit in a hierarchical wheel of TIMER_WHEEL_LEVELS levels of 64
+ * slots, TIMER_WHEEL_TICK_US a tick at the bottom and 64 times coarser
+ * each level up.  Starting and stopping one is a list insert or unlink;
+ * a timer moves down a level at most once per level on its way to
+ * expiry.  Only the next expiry is ever armed on the HAL timer, so the
+ * chip wakes once for everything due at that tick.
+ *
+ * A timer may be given slack: it then fires at the tick in
+ * [due, due + slack] with the most trailing zeros, or on the alignment
+ * grid if there is one and it falls inside, so timers that tolerate a
+ * delay pick the same ticks and share wakeups.  Timers never fire
+ * early; without slack they fire within a tick of their due time.
+ *
+ * Callbacks run on the HAL timer task, one after another, and may
+ * start and stop timers; the functions below are safe from any task,
+ * but not from an ISR.
+ */
+
+#define TIMER_WHEEL_TICK_US 1000
+#define TIMER_WHEEL_LEVELS 4		/* 64^4 ticks, 4.6 hours */
+/* two per door, and the modules' own */
+#define TIMER_WHEEL_MAX_TIMERS 32
+
+typedef struct wheel_timer *wheel_timer_t;
+
+/* align_us is the grid timers with enough slack fire on, 0 for none */
+void timer_wheel_init(uint32_t align_us);
+
+/* NULL once TIMER_WHEEL_MAX_TIMERS are taken */
+wheel_timer_t timer_wheel_create(const char *name, hal_timer_cb_t callback, void *arg);
+
+/* Starting a timer that is armed restarts it */
+void timer_wheel_start_once(wheel_timer_t timer, uint64_t timeout_us, uint32_t slack_us);
+/* Expiries stay period_us apart whatever slack each one used; periods
+ * missed while the callback could not run are skipped */
+void timer_wheel_start_periodic(wheel_timer_t timer, uint64_t period_us, uint32_t slack_us);
+void timer_wheel_stop(wheel_timer_t timer);
+bool timer_wheel_armed(wheel_timer_t timer);
+
+typedef struct {
+  uint32_t armed;
+  uint32_t expiries;		/* HAL timer callbacks that found work */
+  uint32_t fired;		/* timer callbacks run */
+} timer_wheel_stats_t;
+
+void timer_wheel_stats(timer_wheel_stats_t *stats);
+
+/* Per timer name, timers of the same name added together: callbacks
+ * run, and how many of them shared their expiry with another timer */
+typedef struct {
+  const char *name;
+  uint32_t fired;
+  uint32_t shared;
+} timer_wheel_timer_stat_t;
+
+size_t timer_wheel_timer_stats(timer_wheel_timer_stat_t *stats, size_t max);
@@ -0,0 +1,151 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "garage_config.h"
+#include "garage_control.h"
+#include "travel_profile.h"
+#include "timer_wheel.h"
+
+#define TRAVEL_PROFILE_MAGIC 0x54525632	/* "TRV2" */
+#define TRAVEL_PROFILE_NS "garage"
+#define TRAVEL_PROFILE_KEY "travel"
+
+/* [0] closing, [1] opening; the same layout in RAM and NVS */
+typedef struct {
+  uint32_t magic;
+  uint32_t samples_ms[2][TRAVEL_PROFILE_SAMPLES];
+  uint8_t count[2];
+  uint8_t next[2];
+  uint32_t check;		/* CRC-32 of everything above */
+} travel_profile_blob_t;
+
+static void travel_profile_timer_callback(void* arg);
+
+static travel_profile_blob_t profiles[GARAGE_MAX_DOORS];
+static size_t profile_doors;
+static uint32_t dirty;		/* doors not yet in NVS, a bit each */
+static wheel_timer_t nvs_timer;
+
+static uint32_t travel_profile_check(const travel_profile_blob_t *blob) {
+  return hal_crc32(0, blob, offsetof(travel_profile_blob_t, check));
+}
+
+static bool travel_profile_valid(const travel_profile_blob_t *blob) {
+  return blob->magic == TRAVEL_PROFILE_MAGIC && blob->check == travel_profile_check(blob) &&
+    blob->count[0] <= TRAVEL_PROFILE_SAMPLES && blob->count[1] <= TRAVEL_PROFILE_SAMPLES &&
+    blob->next[0] < TRAVEL_PROFILE_SAMPLES && blob->next[1] < TRAVEL_PROFILE_SAMPLES;
+}
+
+/* door 0 has the plain key, as in door_store */
+static void travel_profile_key(size_t door, char *key, size_t size) {
+  if (door == 0) snprintf(key, size, "%s", TRAVEL_PROFILE_KEY);
+  else snprintf(key, size, "%s%u", TRAVEL_PROFILE_KEY, (unsigned)door);
+}
+
+static uint32_t isqrt(uint64_t n) {
+  uint64_t root = 0, bit = 1ULL << 62;
+
+  while (bit > n) bit >>= 2;
+  while (bit) {
+    if (n >= root + bit) {
+      n -= root + bit;
+      root = (root >> 1) + bit;
+    }else{
+      root >>= 1;
+    }
+    bit >>= 2;
+  }
+  return root;
+}
+
+void travel_profile_init(size_t doors) {
+  travel_profile_blob_t *blob;
+  char key[16];
+  size_t door, len;
+
+  nvs_timer = timer_wheel_create("travel_timer", travel_profile_timer_callback, NULL);
+  profile_doors = doors < GARAGE_MAX_DOORS ? doors : GARAGE_MAX_DOORS;
+  for (door = 0; door < profile_doors; door++) {
+    blob = &profiles[door];
+    travel_profile_key(door, key, sizeof(key));
+    len = sizeof(*blob);
+    if (!hal_nvs_get_blob(TRAVEL_PROFILE_NS, key, blob, &len) || len != sizeof(*blob) ||
+	!travel_profile_valid(blob)) {
+      memset(blob, 0, sizeof(*blob));
+      blob->magic = TRAVEL_PROFILE_MAGIC;
+    }
+    ESP_LOGI(__FUNCTION__, "door %u: %u opening and %u closing travels known", (unsigned)door,
+	     blob->count[1], blob->count[0]);
+  }
+}
+
+void travel_profile_add(size_t door, bool opening, uint32_t travel_ms) {
+  travel_profile_blob_t *blob;
+
+  if (door >= profile_doors) return;
+  blob = &profiles[door];
+  blob->samples_ms[opening][blob->next[opening]] = travel_ms;
+  blob->next[opening] = (blob->next[opening] + 1) % TRAVEL_PROFILE_SAMPLES;
+  if (blob->count[opening] < TRAVEL_PROFILE_SAMPLES) blob->count[opening]++;
+
+  if (!dirty)
+    timer_wheel_start_once(nvs_timer, GARAGE_STORE_MIN_INTERVAL_SECONDS * 1000000LL,
+			   GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
+  dirty |= 1u << door;
+}
+
+bool travel_profile_get(size_t door, bool opening, travel_stats_t *stats) {
+  const uint32_t fixed_ms = GARAGE_MAX_TRANSIT_SECONDS * 1000;
+  const travel_profile_blob_t *blob;
+  uint64_t sum = 0, squares = 0;
+  uint32_t i, n, sigma, timeout;
+
+  memset(stats, 0, sizeof(*stats));
+  stats->timeout_ms = fixed_ms;
+  if (door >= profile_doors) return false;
+  blob = &profiles[door];
+  n = blob->count[opening];
+  if (!n) return false;
+
+  for (i = 0; i < n; i++) sum += blob->samples_ms[opening][i];
+  stats->count = n;
+  stats->mean_ms = sum / n;
+  for (i = 0; i < n; i++) {
+    int64_t d = (int64_t)blob->samples_ms[opening][i] - stats->mean_ms;
+    squares += d * d;
+  }
+  stats->sigma_ms = isqrt(squares / n);
+  if (n < GARAGE_TRAVEL_MIN_SAMPLES) return false;
+
+  /* a door this regular still varies a little with the weather */
+  sigma = stats->sigma_ms > stats->mean_ms / 50 ? stats->sigma_ms : stats->mean_ms / 50;
+  timeout = stats->mean_ms + GARAGE_TRAVEL_SIGMAS * sigma + GARAGE_TRAVEL_MARGIN_MILLISECONDS;
+  if (timeout < fixed_ms) stats->timeout_ms = timeout;
+  return true;
+}
+
+/* Every door with new travels, in one go */
+static void travel_profile_write_event(const event_t *event) {
+  travel_profile_blob_t *blob;
+  char key[16];
+  size_t door;
+
+  for (door = 0; door < profile_doors; door++) {
+    if (!(dirty & (1u << door))) continue;
+    blob = &profiles[door];
+    blob->check = travel_profile_check(blob);
+    travel_profile_key(door, key, sizeof(key));
+    if (!hal_nvs_set_blob(TRAVEL_PROFILE_NS, key, blob, sizeof(*blob)))
+      ESP_LOGW(__FUNCTION__, "NVS write of %s failed", key);
+  }
+  dirty = 0;
+}
+
+static void travel_profile_timer_callback(void* arg) {
+  if (!garage_post(travel_profile_write_event, 0))
+    timer_wheel_start_once(nvs_timer, GARAGE_STORE_COALESCE_SECONDS * 1000000LL,
+			   GARAGE_TIMER_SLACK_MILLISECONDS * 1000);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Learned door travel times.
+ *
+ * For each door and direction the last TRAVEL_PROFILE_SAMPLES complete
+ * travels, sensor release to the other sensor making, are kept and
+ * give a mean and standard deviation.  Once there are
+ * GARAGE_TRAVEL_MIN_SAMPLES of them a travel taking longer than
+ * mean + GARAGE_TRAVEL_SIGMAS * sigma + GARAGE_TRAVEL_MARGIN_MILLISECONDS
+ * is overdue; before that, and never later than it, the fixed
+ * GARAGE_MAX_TRANSIT_SECONDS applies.
+ *
+ * The samples are kept in NVS, written at most every
+ * GARAGE_STORE_MIN_INTERVAL_SECONDS: losing the newest few to a reset
+ * costs nothing.  Runs on the garage event task.
+ */
+
+#define TRAVEL_PROFILE_SAMPLES 8
+
+typedef struct {
+  uint32_t count;		/* samples behind the figures, at most SAMPLES */
+  uint32_t mean_ms;
+  uint32_t sigma_ms;
+  uint32_t timeout_ms;		/* when a travel is overdue */
+} travel_stats_t;
+
+/* Reads the profiles from NVS */
+void travel_profile_init(size_t doors);
+
+void travel_profile_add(size_t door, bool opening, uint32_t travel_ms);
+
+/* false while too few travels are known; stats->timeout_ms is the
+ * timeout to use either way */
+bool travel_profile_get(size_t door, bool opening, travel_stats_t *stats);
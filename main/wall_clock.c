@@ -0,0 +1,71 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "wall_clock.h"
+
+#define WALL_CLOCK_MINUTE_US 60000000LL
+/* before the first sync, look again this often */
+#define WALL_CLOCK_RETRY_US 1000000LL
+
+static int64_t offset_us;	/* UTC - hal_time_us() */
+static int64_t polled_us;
+static bool synced;
+
+static int64_t prefix_minute = -1;
+static char prefix[18];		/* "2026-10-18T09:41:" */
+
+void wall_clock_init(const char *server) {
+  hal_sntp_init(server);
+}
+
+static void wall_clock_poll(void) {
+  int64_t now = hal_time_us(), utc, offset;
+
+  if (polled_us && now - polled_us < (synced ? WALL_CLOCK_POLL_SECONDS * 1000000LL : WALL_CLOCK_RETRY_US))
+    return;
+  polled_us = now;
+  if (!hal_utc_us(&utc)) return;
+  offset = utc - hal_time_us();
+  if (!synced) ESP_LOGI(__FUNCTION__, "clock set, %lld ms after boot", (long long)(now / 1000));
+  else if (llabs(offset - offset_us) > 1000000)
+    ESP_LOGW(__FUNCTION__, "clock stepped %lld ms", (long long)((offset - offset_us) / 1000));
+  offset_us = offset;
+  synced = true;
+}
+
+bool wall_clock_utc(int64_t mono_us, int64_t *utc_us) {
+  wall_clock_poll();
+  if (!synced) return false;
+  *utc_us = mono_us + offset_us;
+  return true;
+}
+
+size_t wall_clock_format(int64_t mono_us, char *out) {
+  int64_t utc, minute;
+  uint32_t us, sec;
+  struct tm tm;
+  time_t t;
+  int i;
+
+  if (!wall_clock_utc(mono_us, &utc) || utc < 0) return 0;
+  minute = utc / WALL_CLOCK_MINUTE_US;
+  if (minute != prefix_minute) {
+    t = minute * 60;
+    gmtime_r(&t, &tm);
+    strftime(prefix, sizeof(prefix), "%Y-%m-%dT%H:%M:", &tm);
+    prefix_minute = minute;
+  }
+  memcpy(out, prefix, sizeof(prefix) - 1);
+  us = utc - minute * WALL_CLOCK_MINUTE_US;
+  sec = us / 1000000;
+  us %= 1000000;
+  out[17] = '0' + sec / 10;
+  out[18] = '0' + sec % 10;
+  out[19] = '.';
+  for (i = 25; i > 19; i--, us /= 10) out[i] = '0' + us % 10;
+  out[26] = 'Z';
+  return WALL_CLOCK_TIMESTAMP_LEN;
+}
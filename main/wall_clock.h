@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* UTC for monotonic times.
+ *
+ * SNTP sets the system clock; the offset from hal_time_us() to it is
+ * sampled at most every WALL_CLOCK_POLL_SECONDS, so a monotonic time
+ * taken when something happened converts with an add, and converts
+ * just as well after the first sync as before.  The RFC 3339 text
+ * keeps the date, hour and minute from the last call and only renders
+ * the seconds and fraction again within the same minute.
+ *
+ * Not thread safe: for the syslog task.
+ */
+
+#define WALL_CLOCK_POLL_SECONDS 600
+/* "2026-10-18T09:41:07.123456Z" */
+#define WALL_CLOCK_TIMESTAMP_LEN 27
+
+/* Start SNTP from server */
+void wall_clock_init(const char *server);
+
+/* UTC microseconds for a hal_time_us() value; false before the first sync */
+bool wall_clock_utc(int64_t mono_us, int64_t *utc_us);
+
+/* The RFC 5424 TIMESTAMP for a hal_time_us() value, not terminated;
+ * returns WALL_CLOCK_TIMESTAMP_LEN, or 0 before the first sync */
+size_t wall_clock_format(int64_t mono_us, char *out);
@@ -0,0 +1,129 @@
+#include <string.h>
+#include <esp_wifi.h>
+#include <esp_system.h>
+#include <esp_log.h>
+
+#include "hal.h"
+#include "metrics.h"
+#include "wifi_conn.h"
+#include "timer_wheel.h"
+
+#define WIFI_CONN_NS "wifi"
+#define WIFI_CONN_KEY "ap"
+#define WIFI_CONN_BACKOFF_MIN_MS 250
+#define WIFI_CONN_BACKOFF_MAX_MS 8000
+
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t channel;
+} wifi_conn_ap_t;
+
+static void wifi_conn_retry_callback(void* arg);
+
+/* Only touched from the system event task, apart from the retry timer
+ * which just calls esp_wifi_connect() */
+static wifi_config_t wifi_config;
+static wifi_conn_ap_t cached_ap;
+static bool have_cached_ap = false;
+static uint32_t failures = 0;
+static int64_t connect_start_us = -1;
+static wheel_timer_t retry_timer;
+
+static metric_histogram_t connect_ms = METRIC_HISTOGRAM_CUMULATIVE_INIT("wifi.connect_ms");
+static metric_t disconnects = METRIC_COUNTER_INIT("wifi.disconnects");
+static metric_t retries = METRIC_COUNTER_INIT("wifi.retries");
+
+/* Directed: straight to the cached AP, else a full scan by SSID */
+static void wifi_conn_configure(bool directed) {
+  directed = directed && have_cached_ap;
+  wifi_config.sta.bssid_set = directed;
+  wifi_config.sta.channel = directed ? cached_ap.channel : 0;
+  if (directed) memcpy(wifi_config.sta.bssid, cached_ap.bssid, sizeof(cached_ap.bssid));
+  ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+}
+
+void wifi_conn_start(const char *ssid, const char *password) {
+  size_t len = sizeof(cached_ap);
+
+  metrics_register(&connect_ms.metric);
+  metrics_register(&disconnects);
+  metrics_register(&retries);
+  retry_timer = timer_wheel_create("wifi_retry_timer", wifi_conn_retry_callback, NULL);
+  have_cached_ap = hal_nvs_get_blob(WIFI_CONN_NS, WIFI_CONN_KEY, &cached_ap, &len) &&
+    len == sizeof(cached_ap);
+
+  memset(&wifi_config, 0, sizeof(wifi_config));
+  strncpy((char *)wifi_config.sta.ssid, ssid, sizeof(wifi_config.sta.ssid));
+  strncpy((char *)wifi_config.sta.password, password, sizeof(wifi_config.sta.password));
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  wifi_conn_configure(true);
+  ESP_ERROR_CHECK(esp_wifi_start());
+}
+
+/* Remember the AP we got an address from, writing NVS only if it changed */
+static void wifi_conn_save_ap(void) {
+  wifi_ap_record_t info;
+  wifi_conn_ap_t ap;
+
+  if (esp_wifi_sta_get_ap_info(&info) != ESP_OK) return;
+  memset(&ap, 0, sizeof(ap));
+  memcpy(ap.bssid, info.bssid, sizeof(ap.bssid));
+  ap.channel = info.primary;
+  if (have_cached_ap && !memcmp(&ap, &cached_ap, sizeof(ap))) return;
+  cached_ap = ap;
+  have_cached_ap = true;
+  hal_nvs_set_blob(WIFI_CONN_NS, WIFI_CONN_KEY, &ap, sizeof(ap));
+  ESP_LOGI(__FUNCTION__, "AP " MACSTR " channel %u", MAC2STR(ap.bssid), ap.channel);
+}
+
+static void wifi_conn_retry_callback(void* arg) {
+  /* only queues a request for the Wi-Fi task */
+  esp_wifi_connect();
+}
+
+static void wifi_conn_retry(uint8_t reason) {
+  uint32_t delay_ms;
+
+  failures++;
+  /* an AP that rebooted comes back where it was: the first retry is
+   * directed and immediate, after that alternate with a full scan */
+  wifi_conn_configure(failures & 1);
+  if (failures == 1) {
+    esp_wifi_connect();
+    return;
+  }
+  delay_ms = WIFI_CONN_BACKOFF_MIN_MS << (failures < 8 ? failures - 2 : 6);
+  if (delay_ms > WIFI_CONN_BACKOFF_MAX_MS) delay_ms = WIFI_CONN_BACKOFF_MAX_MS;
+  /* +-25% so a houseful of devices don't retry in step */
+  delay_ms = delay_ms * 3 / 4 + esp_random() % (delay_ms / 2 + 1);
+  metric_inc(&retries);
+  ESP_LOGI(__FUNCTION__, "reason %u, retry %u in %u ms", reason, (unsigned)failures,
+	   (unsigned)delay_ms);
+  timer_wheel_start_once(retry_timer, delay_ms * 1000ULL, 0);
+}
+
+void wifi_conn_event(const system_event_t *event) {
+  switch (event->event_id) {
+  case SYSTEM_EVENT_STA_START:
+    connect_start_us = hal_time_us();
+    esp_wifi_connect();
+    break;
+  case SYSTEM_EVENT_STA_GOT_IP:
+    if (connect_start_us >= 0)
+      metric_observe(&connect_ms, (hal_time_us() - connect_start_us) / 1000);
+    connect_start_us = -1;
+    failures = 0;
+    timer_wheel_stop(retry_timer);
+    wifi_conn_save_ap();
+    break;
+  case SYSTEM_EVENT_STA_DISCONNECTED:
+    if (connect_start_us < 0) {
+      connect_start_us = hal_time_us();
+      metric_inc(&disconnects);
+    }
+    wifi_conn_retry(event->event_info.disconnected.reason);
+    break;
+  default:
+    break;
+  }
+}
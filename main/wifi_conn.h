@@ -0,0 +1,22 @@
+#pragma once
+
+#include <esp_event_loop.h>
+
+/* Station connection manager.
+ *
+ * The channel and BSSID of the last AP that gave us an address are kept
+ * in NVS, so a boot or a reconnect first tries a directed connect to it
+ * with no scan.  Attempts then alternate between that and a full scan,
+ * in case the AP moved channel.  Retries back off exponentially from
+ * WIFI_CONN_BACKOFF_MIN_MS to WIFI_CONN_BACKOFF_MAX_MS, with jitter, so
+ * a missing AP does not keep the radio and CPU busy.  The time from
+ * losing the link (or from boot) to getting an address is reported as
+ * wifi.connect_ms.
+ */
+
+/* Configure the station and start it; the first connect follows from
+ * SYSTEM_EVENT_STA_START */
+void wifi_conn_start(const char *ssid, const char *password);
+
+/* Feed every system event from the application's event handler */
+void wifi_conn_event(const system_event_t *event);
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Report the static RAM each module owns, from its object file.
+
+Every task stack, queue and buffer of ours is static (hal.h
+HAL_STORAGE), so the .data, .bss and RTC sections of a module's object
+are all the RAM it will ever have.  Lists each module with its biggest
+items, fails if a module calls the heap or task and queue creation
+directly, and with --budget if the total is over it.
+
+  ram_report.py [--budget bytes] [--size size] [--nm nm] module.o...
+
+The host objects (make -C host ram) give the figures for a 64 bit
+build; for the firmware's own, point it at build/main/*.o with the
+xtensa-esp32-elf- tools.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+
+# the HAL is where heap use is allowed, through hal_alloc()
+HEAP_CALLS = {"malloc", "calloc", "realloc", "strdup", "strndup", "pvPortMalloc",
+              "heap_caps_malloc", "heap_caps_calloc", "xTaskCreate",
+              "xTaskCreatePinnedToCore", "xQueueGenericCreate", "xQueueCreateMutex",
+              "xTimerCreate"}
+HEAP_ALLOWED = ("hal_",)
+
+DATA = (".data", ".sdata", ".dram")
+BSS = (".bss", ".sbss")
+RTC = (".rtc",)
+
+SHOW_ITEMS = 3
+SHOW_MIN = 256
+
+
+def run(tool, *args):
+    return subprocess.run([tool] + list(args), check=True, capture_output=True,
+                          text=True).stdout
+
+
+def sections(size, obj):
+    data = bss = rtc = 0
+    for line in run(size, "-A", obj).splitlines():
+        fields = line.split()
+        if len(fields) < 2 or not fields[1].isdigit():
+            continue
+        name, n = fields[0], int(fields[1])
+        if name.startswith(RTC):
+            rtc += n
+        elif name.startswith(DATA):
+            data += n
+        elif name.startswith(BSS):
+            bss += n
+    return data, bss, rtc
+
+
+def items(nm, obj):
+    found = []
+    for line in run(nm, "-S", "--size-sort", obj).splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[2] in "bBdD":
+            found.append((int(fields[1], 16), fields[3]))
+    found.sort(reverse=True)
+    return [(n, name) for n, name in found[:SHOW_ITEMS] if n >= SHOW_MIN]
+
+
+def heap_calls(nm, obj):
+    calls = []
+    for line in run(nm, "-u", obj).splitlines():
+        name = line.split()[-1]
+        if name in HEAP_CALLS:
+            calls.append(name)
+    return calls
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--budget", type=int, help="fail above this many bytes in all")
+    parser.add_argument("--size", default="size")
+    parser.add_argument("--nm", default="nm")
+    parser.add_argument("objects", nargs="+")
+    args = parser.parse_args()
+
+    rows, bad = [], []
+    for obj in args.objects:
+        module = os.path.splitext(os.path.basename(obj))[0]
+        data, bss, rtc = sections(args.size, obj)
+        rows.append((data + bss + rtc, module, data, bss, rtc, items(args.nm, obj)))
+        if not module.startswith(HEAP_ALLOWED):
+            bad += ["%s calls %s" % (module, call) for call in heap_calls(args.nm, obj)]
+
+    rows.sort(reverse=True)
+    print("%-18s %8s %8s %8s %8s" % ("module", "data", "bss", "rtc", "total"))
+    for total, module, data, bss, rtc, biggest in rows:
+        print("%-18s %8d %8d %8d %8d" % (module, data, bss, rtc, total))
+        for n, name in biggest:
+            print("  %-30s %8d" % (name, n))
+    total = sum(row[0] for row in rows)
+    print("%-18s %35d" % ("total", total))
+
+    for line in bad:
+        print("error: %s, use static storage or hal_alloc() at boot" % line, file=sys.stderr)
+    if args.budget is not None and total > args.budget:
+        print("error: %d bytes, over the budget of %d" % (total, args.budget), file=sys.stderr)
+        return 1
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""Decode binary syslog frames (main/syslog_binary.h) back into RFC 5424.
+
+Format strings are looked up by address in the firmware ELF, so the ELF
+must be the one running on the device.  --formats reads them from a JSON
+object of "0xADDRESS": "format" instead, as the host tests write.
+
+  syslog_decode.py build/garage.elf --listen 514
+  syslog_decode.py build/garage.elf --listen 514 --forward 192.168.1.2:514
+  syslog_decode.py build/garage.elf frame1.bin frame2.bin
+  syslog_decode.py --formats formats.json frame.bin
+"""
+
+import argparse
+import json
+import re
+import socket
+import struct
+import sys
+
+MAGIC = b"GLB2"
+MAGIC_U8_STRINGS = b"GLB1"
+RECORD = 0xB1
+FACILITY_USER = 1
+TRUNCATED = 0x8000
+# shown after a string the device had to cut short
+TRUNCATED_MARK = "..."
+
+# the device is 32 bit: int, long, size_t and pointers are all 4 bytes
+INT_SIZE = {"": 4, "hh": 4, "h": 4, "l": 4, "ll": 8, "q": 8, "j": 8,
+            "z": 4, "t": 4, "L": 4}
+
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|q|j|z|t|L)?([diouxXcpfFeEgGaAsn%])")
+ESCAPE = re.compile(r"\x1b[^m]*m")
+
+
+class Elf:
+    """Just enough of ELF32 to read constant data by address"""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise ValueError("%s is not a 32 bit ELF file" % path)
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            (_, sh_type, _, addr, offset, size) = struct.unpack_from(
+                "<IIIIII", self.data, shoff + i * shentsize)
+            if sh_type == 1 and addr:  # SHT_PROGBITS, loaded
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.index(b"\0", start)
+                return self.data[start:end].decode("utf-8", "replace")
+        raise KeyError("no format string at 0x%08x" % addr)
+
+
+class Formats:
+    """Format strings from a JSON object keyed by address"""
+
+    def __init__(self, path):
+        with open(path) as f:
+            self.formats = {int(addr, 0): fmt for addr, fmt in json.load(f).items()}
+
+    def string(self, addr):
+        if addr not in self.formats:
+            raise KeyError("no format string at 0x%08x" % addr)
+        return self.formats[addr]
+
+
+class Reader:
+    def __init__(self, data, u8_strings=False):
+        self.data = data
+        self.pos = 0
+        self.u8_strings = u8_strings
+
+    def take(self, n):
+        if self.pos + n > len(self.data):
+            raise ValueError("truncated record")
+        b = self.data[self.pos:self.pos + n]
+        self.pos += n
+        return b
+
+    def u8(self):
+        return self.take(1)[0]
+
+    def u16(self):
+        return struct.unpack("<H", self.take(2))[0]
+
+    def u32(self):
+        return struct.unpack("<I", self.take(4))[0]
+
+    def u64(self):
+        return struct.unpack("<Q", self.take(8))[0]
+
+    def double(self):
+        return struct.unpack("<d", self.take(8))[0]
+
+    def string(self):
+        return self.take(self.u8()).decode("utf-8", "replace")
+
+    def arg_string(self):
+        """A %s argument, marked if it was truncated"""
+        if self.u8_strings:
+            return self.string()
+        length = self.u16()
+        s = self.take(length & ~TRUNCATED).decode("utf-8", "replace")
+        return s + TRUNCATED_MARK if length & TRUNCATED else s
+
+
+def signed(v, bits):
+    return v - (1 << bits) if v & (1 << (bits - 1)) else v
+
+
+def c_format(fmt, args):
+    """printf() the way the device would have"""
+
+    def conversion(m):
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = str(signed(args.u32(), 32))
+        if precision == "*":
+            precision = str(signed(args.u32(), 32))
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "")
+        length = length or ""
+        if conv in "diouxX":
+            bits = INT_SIZE[length] * 8
+            v = args.u64() if bits == 64 else args.u32()
+            if length == "hh":
+                bits = 8
+            elif length == "h":
+                bits = 16
+            v &= (1 << bits) - 1
+            if conv in "di":
+                return (spec + "d") % signed(v, bits)
+            return (spec + conv) % v
+        if conv == "c":
+            return (spec + "c") % chr(args.u32() & 0xFF)
+        if conv == "p":
+            return (spec + "s") % ("0x%x" % args.u32())
+        if conv in "aA":
+            v = float.hex(args.double())
+            return (spec + "s") % (v.upper() if conv == "A" else v)
+        if conv in "fFeEgG":
+            return (spec + conv) % args.double()
+        if conv == "s":
+            # the device already applied the precision
+            s = args.arg_string()
+            return ("%" + flags + (width or "") + "s") % s
+        return ""  # %n
+
+    return CONVERSION.sub(conversion, fmt)
+
+
+def decode_record(elf, hostname, data, u8_strings=False):
+    if data[:1] == b"<":
+        return data.decode("utf-8", "replace")
+    r = Reader(data, u8_strings)
+    if r.u8() != RECORD:
+        raise ValueError("unknown record type")
+    severity = r.u8()
+    prefix = r.u8()
+    fmt = elf.string(r.u32())
+    r.u32()  # timestamp, ms since boot; the text format carries none
+    msgid = r.u32()
+    tag = r.string()
+    msg = ESCAPE.sub("", c_format(fmt[prefix:], r)).rstrip("\n")
+    return "<%d>1 - %s %s - %u %s" % (FACILITY_USER * 8 + severity, hostname, tag, msgid, msg)
+
+
+def decode_frame(elf, frame):
+    if frame[:4] not in (MAGIC, MAGIC_U8_STRINGS):
+        # not a binary frame, pass plain syslog through
+        return [frame.decode("utf-8", "replace")]
+    r = Reader(frame)
+    r.take(4)
+    hostname = r.string()
+    lines = []
+    while r.pos < len(frame):
+        length = r.u16()
+        lines.append(decode_record(elf, hostname, r.take(length), frame[:4] == MAGIC_U8_STRINGS))
+    return lines
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf", nargs="?", help="firmware ELF the device is running")
+    parser.add_argument("--formats", help="JSON file of format strings by address, for no ELF")
+    parser.add_argument("frames", nargs="*", help="files each holding one frame")
+    parser.add_argument("--listen", type=int, help="UDP port to receive frames on")
+    parser.add_argument("--forward", help="HOST:PORT of a syslog server to send decoded lines to")
+    args = parser.parse_args()
+    if args.formats and args.elf:
+        # without an ELF the first name is a frame
+        args.frames.insert(0, args.elf)
+        args.elf = None
+    if not args.elf and not args.formats:
+        parser.error("give the firmware ELF or --formats")
+
+    elf = Formats(args.formats) if args.formats else Elf(args.elf)
+    out = None
+    if args.forward:
+        host, port = args.forward.rsplit(":", 1)
+        out = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        dest = (host, int(port))
+
+    def emit(frame):
+        try:
+            lines = decode_frame(elf, frame)
+        except (ValueError, KeyError) as e:
+            print("bad frame: %s" % e, file=sys.stderr)
+            return
+        for line in lines:
+            if out:
+                out.sendto(line.encode("utf-8"), dest)
+            else:
+                print(line, flush=True)
+
+    for path in args.frames:
+        with open(path, "rb") as f:
+            emit(f.read())
+
+    if args.listen:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(("", args.listen))
+        while True:
+            emit(sock.recv(65535))
+
+
+if __name__ == "__main__":
+    main()